@@ -0,0 +1,315 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "mjpg_streamer.h"
+#include "frame.h"
+#include "trace.h"
+
+/******************************************************************************
+Description.: set up an empty ring, must be called before the input runs
+Input Value.: ring to initialize
+Return Value: -
+******************************************************************************/
+void frame_ring_init(frame_ring *ring)
+{
+    memset(ring, 0, sizeof(frame_ring));
+}
+
+/******************************************************************************
+Description.: the clock of the frame stamps
+Input Value.: -
+Return Value: CLOCK_MONOTONIC in nanoseconds
+******************************************************************************/
+long long frame_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/******************************************************************************
+Description.: note that a frame reached a stage now
+Input Value.: frame and stage
+Return Value: -
+******************************************************************************/
+void frame_stamp(frame *f, frame_stage stage)
+{
+    f->stamp[stage] = frame_clock();
+}
+
+/******************************************************************************
+Description.: the wall clock time a frame was captured. The timestamp of a
+              frame is not suitable, input_uvc fills it from CLOCK_MONOTONIC
+              unless told otherwise, so the earliest stamp is converted.
+Input Value.: frame
+Return Value: microseconds since the epoch
+******************************************************************************/
+long long frame_walltime(frame *f)
+{
+    struct timeval now;
+    long long stamp = f->stamp[FRAME_CAPTURED];
+
+    if(stamp == 0)
+        stamp = f->stamp[FRAME_PUBLISHED];
+
+    gettimeofday(&now, NULL);
+    if(stamp == 0)
+        return now.tv_sec * 1000000LL + now.tv_usec;
+
+    return now.tv_sec * 1000000LL + now.tv_usec - (frame_clock() - stamp) / 1000;
+}
+
+/******************************************************************************
+Description.: take an additional reference of a frame
+Input Value.: frame, may be NULL
+Return Value: the same frame
+******************************************************************************/
+frame *frame_ref(frame *f)
+{
+    if(f != NULL)
+        __sync_add_and_fetch(&f->refcount, 1);
+    return f;
+}
+
+/******************************************************************************
+Description.: drop a reference, a slot becomes writable again if this was the
+              last one, detached frames get freed or handed to their release
+              function
+Input Value.: frame, may be NULL
+Return Value: -
+******************************************************************************/
+void frame_unref(frame *f)
+{
+    if(f == NULL)
+        return;
+
+    if(__sync_sub_and_fetch(&f->refcount, 1) == 0 && f->detached) {
+        if(f->release != NULL) {
+            f->release(f);
+            return;
+        }
+        free(f->buf);
+        free(f);
+    }
+}
+
+/******************************************************************************
+Description.: make sure the buffer of a frame can hold "size" bytes, only
+              allowed as long as the frame was not published
+Input Value.: frame and the required size
+Return Value: 0 if everything is fine, -1 if there is not enough memory
+******************************************************************************/
+int frame_reserve(frame *f, int size)
+{
+    unsigned char *tmp;
+
+    if(size <= f->capacity)
+        return 0;
+
+    DBG("increasing frame buffer size to %d\n", size);
+    if((tmp = realloc(f->buf, size)) == NULL)
+        return -1;
+
+    f->buf = tmp;
+    f->capacity = size;
+    return 0;
+}
+
+/******************************************************************************
+Description.: returns a frame the producer can fill without holding the "db"
+              mutex. Only a single thread per input may call this.
+Input Value.: input plugin and the number of bytes that will be written
+Return Value: frame with one reference owned by the caller or NULL if there
+              is not enough memory. Pass it to frame_ring_publish() or drop
+              it with frame_unref().
+******************************************************************************/
+frame *frame_ring_writable(struct _input *in, int size)
+{
+    frame_ring *ring = &in->ring;
+    frame *f = NULL;
+    int i, n;
+
+    ring->enabled = 1;
+
+    /*
+     * only the latest frame can gain new references and it is referenced by
+     * the ring itself, so a slot that is unreferenced now stays unreferenced
+     */
+    for(i = 0; i < FRAME_RING_SLOTS; i++) {
+        n = (ring->next + i) % FRAME_RING_SLOTS;
+
+        if(ring->slot[n] == NULL) {
+            if((ring->slot[n] = calloc(1, sizeof(frame))) == NULL)
+                return NULL;
+        }
+
+        if(__sync_fetch_and_add(&ring->slot[n]->refcount, 0) == 0) {
+            f = ring->slot[n];
+            ring->next = (n + 1) % FRAME_RING_SLOTS;
+            break;
+        }
+    }
+
+    /* every slot is still referenced by consumers, do not wait for them */
+    if(f == NULL) {
+        DBG("all frame slots are in use, allocating a detached frame\n");
+        if((f = calloc(1, sizeof(frame))) == NULL)
+            return NULL;
+        f->detached = 1;
+    }
+
+    if(frame_reserve(f, size) < 0) {
+        if(f->detached)
+            free(f);
+        return NULL;
+    }
+
+    f->size = 0;
+    f->refcount = 1;
+    memset(f->stamp, 0, sizeof(f->stamp));
+    return f;
+}
+
+/******************************************************************************
+Description.: makes a filled frame the latest one and wakes up all consumers.
+              The reference of the caller is handed over to the ring.
+Input Value.: input plugin and the frame from frame_ring_writable()
+Return Value: -
+******************************************************************************/
+void frame_ring_publish(struct _input *in, frame *f)
+{
+    frame *old;
+
+    metrics_lock(in);
+
+    old = in->ring.latest;
+    f->seq = ++in->ring.seq;
+    frame_stamp(f, FRAME_PUBLISHED);
+    in->ring.latest = f;
+
+    /* keep the plain buffer valid for plugins that still read it directly */
+    in->buf = f->buf;
+    in->size = f->size;
+    in->timestamp = f->timestamp;
+    metrics_frame(in, f->size);
+
+    pthread_cond_broadcast(&in->db_update);
+    pthread_mutex_unlock(&in->db);
+
+    trace_frame(in->param.id, f);
+    frame_unref(old);
+}
+
+/******************************************************************************
+Description.: copies the plain buffer of an input plugin that does not use the
+              ring to a detached frame, the "db" mutex must be locked
+Input Value.: input plugin
+Return Value: frame or NULL if there is no picture or not enough memory
+******************************************************************************/
+static frame *frame_copy_legacy(struct _input *in)
+{
+    frame *f;
+
+    if(in->buf == NULL || in->size <= 0)
+        return NULL;
+
+    if((f = calloc(1, sizeof(frame))) == NULL)
+        return NULL;
+
+    if(frame_reserve(f, in->size) < 0) {
+        free(f);
+        return NULL;
+    }
+
+    memcpy(f->buf, in->buf, in->size);
+    f->size = in->size;
+    f->timestamp = in->timestamp;
+    f->seq = ++in->ring.seq;
+    f->refcount = 1;
+    f->detached = 1;
+
+    /* the picture was published just before the consumer woke up */
+    frame_stamp(f, FRAME_PUBLISHED);
+    return f;
+}
+
+/******************************************************************************
+Description.: wait for a frame that is newer than "after". If the consumer is
+              too slow the intermediate frames are skipped, the latest wins.
+Input Value.: input plugin and the sequence number of the last frame the
+              consumer has seen or FRAME_SEQ_FRESH
+Return Value: a referenced frame the caller has to release with frame_unref(),
+              NULL in case the input does not provide a picture
+******************************************************************************/
+frame *frame_ring_next(struct _input *in, unsigned long long after)
+{
+    frame *f = NULL;
+
+    metrics_lock(in);
+
+    if(after == FRAME_SEQ_FRESH || !in->ring.enabled)
+        after = in->ring.seq;
+
+    while(in->ring.latest == NULL || in->ring.seq <= after) {
+        pthread_cond_wait(&in->db_update, &in->db);
+
+        /* input plugins that write the buffer directly just signal a fresh picture */
+        if(!in->ring.enabled) {
+            f = frame_copy_legacy(in);
+            pthread_mutex_unlock(&in->db);
+            return f;
+        }
+    }
+
+    f = frame_ref(in->ring.latest);
+    pthread_mutex_unlock(&in->db);
+
+    return f;
+}
+
+/******************************************************************************
+Description.: returns the current frame without waiting
+Input Value.: input plugin
+Return Value: a referenced frame the caller has to release with frame_unref()
+              or NULL if no frame was captured yet
+******************************************************************************/
+frame *frame_ring_latest(struct _input *in)
+{
+    frame *f;
+
+    metrics_lock(in);
+    if(in->ring.enabled)
+        f = frame_ref(in->ring.latest);
+    else
+        f = frame_copy_legacy(in);
+    pthread_mutex_unlock(&in->db);
+
+    return f;
+}
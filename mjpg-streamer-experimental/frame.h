@@ -0,0 +1,106 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <sys/time.h>
+
+/*
+ * Number of frame slots every input plugin keeps. A slot is only written by
+ * the producer while nobody holds a reference to it, so this has to be larger
+ * than the number of frames consumers usually keep at the same time. If all
+ * slots are in use the producer allocates a detached frame instead of waiting.
+ */
+#define FRAME_RING_SLOTS 8
+
+/* pass this to frame_ring_next() to wait for a frame newer than the current one */
+#define FRAME_SEQ_FRESH 0xFFFFFFFFFFFFFFFFULL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _input;
+
+/*
+ * Points in time a frame passes on its way through the input plugin, stored
+ * as CLOCK_MONOTONIC nanoseconds. Stages a plugin does not know stay 0.
+ */
+typedef enum {
+    FRAME_CAPTURED,             /* the driver finished the picture */
+    FRAME_DEQUEUED,             /* the input plugin took it from the driver */
+    FRAME_ENCODED,              /* compressed or copied into the frame */
+    FRAME_PUBLISHED,            /* made the latest frame of the input */
+    FRAME_STAGES
+} frame_stage;
+
+/*
+ * A single JPG frame. Once published a frame is immutable, consumers take a
+ * reference instead of copying the picture and drop it with frame_unref().
+ */
+typedef struct _frame frame;
+struct _frame {
+    unsigned char *buf;         /* the JPG data */
+    int size;                   /* bytes used in buf */
+    int capacity;               /* bytes allocated for buf */
+    unsigned long long seq;     /* incremented for every published frame */
+    struct timeval timestamp;   /* v4l2_buffer timestamp or time of capture */
+    long long stamp[FRAME_STAGES];  /* monotonic time of each stage */
+    int refcount;               /* only modified with atomic operations */
+    int detached;               /* not owned by a slot, freed with the last reference */
+    void (*release)(frame *f);  /* frees a detached frame that borrows buf from its producer */
+    void *owner;                /* for the release function */
+};
+
+/* the frames of one input plugin, protected by the "db" mutex of the input */
+typedef struct _frame_ring frame_ring;
+struct _frame_ring {
+    int enabled;                /* set as soon as the producer uses the ring */
+    int next;                   /* slot to try first for the next frame */
+    frame *slot[FRAME_RING_SLOTS];
+    frame *latest;              /* the current frame, the ring holds a reference */
+    unsigned long long seq;     /* sequence number of "latest" */
+};
+
+void frame_ring_init(frame_ring *ring);
+
+/* producer side */
+frame *frame_ring_writable(struct _input *in, int size);
+int frame_reserve(frame *f, int size);
+void frame_ring_publish(struct _input *in, frame *f);
+
+long long frame_clock(void);
+void frame_stamp(frame *f, frame_stage stage);
+long long frame_walltime(frame *f);
+
+/* consumer side */
+frame *frame_ring_next(struct _input *in, unsigned long long after);
+frame *frame_ring_latest(struct _input *in);
+frame *frame_ref(frame *f);
+void frame_unref(frame *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
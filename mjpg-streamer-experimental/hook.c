@@ -0,0 +1,259 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "mjpg_streamer.h"
+#include "utils.h"
+#include "hook.h"
+
+/******************************************************************************
+Description.: start the process of a hook, its standard input is a pipe
+Input Value.: hook
+Return Value: 0 if OK, -1 in case of an error
+******************************************************************************/
+static int hook_spawn(hook *h)
+{
+    int fds[2];
+
+    if(pipe(fds) < 0) {
+        perror("could not create a pipe for the hook");
+        return -1;
+    }
+
+    if((h->pid = fork()) < 0) {
+        perror("could not start the hook");
+        close(fds[0]);
+        close(fds[1]);
+        h->pid = 0;
+        return -1;
+    }
+
+    if(h->pid == 0) {
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", h->command, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[0]);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    h->fd = fds[1];
+
+    DBG("hook \"%s\" started as process %d\n", h->command, h->pid);
+    return 0;
+}
+
+/******************************************************************************
+Description.: close the standard input of the hook and collect the process
+Input Value.: * h......: hook
+              * wait...: seconds the process gets to exit before it is killed
+Return Value: -
+******************************************************************************/
+static void hook_reap(hook *h, int wait)
+{
+    int i;
+
+    if(h->fd >= 0)
+        close(h->fd);
+    h->fd = -1;
+
+    if(h->pid <= 0)
+        return;
+
+    for(i = 0; i < 10 * wait && waitpid(h->pid, NULL, WNOHANG) == 0; i++)
+        usleep(100 * 1000);
+
+    if(i == 10 * wait) {
+        kill(h->pid, SIGTERM);
+        waitpid(h->pid, NULL, 0);
+    }
+    h->pid = 0;
+}
+
+/******************************************************************************
+Description.: the thread of a hook passes the queued events to the process
+Input Value.: hook
+Return Value: NULL
+******************************************************************************/
+static void *hook_thread(void *arg)
+{
+    hook *h = arg;
+    hook_line line;
+    ssize_t rc;
+    int written;
+
+    while(1) {
+        pthread_mutex_lock(&h->mutex);
+        while(h->count == 0 && !h->quit)
+            pthread_cond_wait(&h->cond, &h->mutex);
+
+        if(h->count == 0) {
+            pthread_mutex_unlock(&h->mutex);
+            break;
+        }
+
+        line = h->queue[h->head];
+        h->head = (h->head + 1) % h->capacity;
+        h->count--;
+        pthread_mutex_unlock(&h->mutex);
+
+        if(h->pid == 0 && hook_spawn(h) < 0) {
+            metrics_hook_drop(h->out);
+            sleep(1);
+            continue;
+        }
+
+        for(written = 0; written < line.length; written += rc) {
+            if((rc = write(h->fd, line.text + written, line.length - written)) < 0) {
+                if(errno == EINTR) {
+                    rc = 0;
+                    continue;
+                }
+                break;
+            }
+        }
+
+        /* the process is gone, it gets started again with the next event */
+        if(written < line.length) {
+            LOG("hook \"%s\" exited, restarting it\n", h->command);
+            metrics_hook_drop(h->out);
+            hook_reap(h, 1);
+            sleep(1);
+        }
+    }
+
+    hook_reap(h, 2);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: set up a hook, the process is started with the first event
+Input Value.: hook with its configuration set
+Return Value: 0 if OK, -1 in case of an error
+******************************************************************************/
+int hook_start(hook *h)
+{
+    h->pid = 0;
+    h->fd = -1;
+    h->head = h->count = h->quit = 0;
+
+    if(h->capacity < 1 || (h->queue = calloc(h->capacity, sizeof(hook_line))) == NULL)
+        return -1;
+
+    pthread_mutex_init(&h->mutex, NULL);
+    pthread_cond_init(&h->cond, NULL);
+
+    if(pthread_create(&h->thread, NULL, hook_thread, h) != 0) {
+        free(h->queue);
+        h->queue = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: queue the event of a saved frame, it is dropped if the process
+              does not keep up
+Input Value.: * h......: hook
+              * file...: where the frame was saved
+              * f......: the frame
+Return Value: -
+******************************************************************************/
+void hook_event(hook *h, const char *file, frame *f)
+{
+    hook_line *line;
+    long long now;
+    int i, n;
+
+    if(h->queue == NULL)
+        return;
+
+    pthread_mutex_lock(&h->mutex);
+    if(h->count == h->capacity) {
+        pthread_mutex_unlock(&h->mutex);
+        metrics_hook_drop(h->out);
+        return;
+    }
+    line = &h->queue[(h->head + h->count) % h->capacity];
+    now = frame_walltime(f);
+
+    if(h->json) {
+        n = snprintf(line->text, HOOK_LINE, "{\"seq\": %llu, \"timestamp\": %lld.%06lld, \"size\": %d, \"file\": \"",
+                     f->seq, now / 1000000, now % 1000000, f->size);
+
+        /* the file name is escaped, the line must leave room for the end */
+        for(i = 0; file[i] != '\0' && n < HOOK_LINE - 10; i++) {
+            if(file[i] == '"' || file[i] == '\\')
+                line->text[n++] = '\\';
+            if((unsigned char)file[i] < 0x20)
+                n += snprintf(line->text + n, HOOK_LINE - n, "\\u%04x", file[i]);
+            else
+                line->text[n++] = file[i];
+        }
+        n += snprintf(line->text + n, HOOK_LINE - n, "\"}\n");
+    } else {
+        /* the file name goes last, it may contain spaces */
+        n = snprintf(line->text, HOOK_LINE, "%llu %lld.%06lld %d %s\n",
+                     f->seq, now / 1000000, now % 1000000, f->size, file);
+        if(n >= HOOK_LINE) {
+            n = HOOK_LINE - 1;
+            line->text[n - 1] = '\n';
+        }
+    }
+    line->length = n;
+
+    h->count++;
+    pthread_cond_signal(&h->cond);
+    pthread_mutex_unlock(&h->mutex);
+}
+
+/******************************************************************************
+Description.: pass the remaining events, close the standard input of the
+              process and wait for it to exit
+Input Value.: hook
+Return Value: -
+******************************************************************************/
+void hook_stop(hook *h)
+{
+    if(h->queue == NULL)
+        return;
+
+    pthread_mutex_lock(&h->mutex);
+    h->quit = 1;
+    pthread_cond_signal(&h->cond);
+    pthread_mutex_unlock(&h->mutex);
+
+    pthread_join(h->thread, NULL);
+
+    free(h->queue);
+    h->queue = NULL;
+}
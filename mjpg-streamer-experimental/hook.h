@@ -0,0 +1,78 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef HOOK_H
+#define HOOK_H
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "frame.h"
+
+/*
+ * A hook is a command that gets started once and learns about every saved
+ * frame through a line on its standard input, instead of a shell being
+ * forked for each frame. Events wait in a bounded queue for the process,
+ * if it falls behind further events are dropped and counted. A hook that
+ * exits gets started again with the next event.
+ */
+
+/* longest event line */
+#define HOOK_LINE 1024
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _output;
+
+typedef struct {
+    char text[HOOK_LINE];
+    int length;
+} hook_line;
+
+typedef struct _hook hook;
+struct _hook {
+    /* configuration */
+    char *command;              /* run with "/bin/sh -c" */
+    int json;                   /* JSON objects instead of plain lines */
+    int capacity;               /* events waiting for the process */
+    struct _output *out;        /* counts the dropped events */
+
+    pid_t pid;                  /* 0 while not running */
+    int fd;                     /* standard input of the process */
+    hook_line *queue;
+    int head, count, quit;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+int hook_start(hook *h);
+void hook_event(hook *h, const char *file, frame *f);
+void hook_stop(hook *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
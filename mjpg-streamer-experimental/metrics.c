@@ -0,0 +1,151 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <pthread.h>
+#include <time.h>
+
+#include "mjpg_streamer.h"
+#include "metrics.h"
+
+/* names used as "reason" label */
+const char *drop_reason_names[DROP_REASONS] = {
+    "minimum_size",
+    "every_frame",
+    "framerate",
+    "queue_full",
+    "late"
+};
+
+/* upper bounds of the histogram buckets */
+const unsigned long long encode_us_bounds[METRICS_BUCKETS - 1] = {
+    500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000
+};
+const unsigned long long frame_bytes_bounds[METRICS_BUCKETS - 1] = {
+    8 << 10, 16 << 10, 32 << 10, 64 << 10, 128 << 10, 256 << 10, 512 << 10, 1 << 20, 2 << 20
+};
+
+/******************************************************************************
+Description.: count a value into the matching bucket of a histogram
+Input Value.: * h......: histogram
+              * bounds.: upper bounds of its buckets
+              * value..: value to add
+Return Value: -
+******************************************************************************/
+static void histogram_add(histogram *h, const unsigned long long *bounds, unsigned long long value)
+{
+    int i;
+
+    for(i = 0; i < METRICS_BUCKETS - 1 && value > bounds[i]; i++);
+
+    __sync_add_and_fetch(&h->bucket[i], 1);
+    __sync_add_and_fetch(&h->count, 1);
+    __sync_add_and_fetch(&h->sum, value);
+}
+
+/******************************************************************************
+Description.: count a frame the input plugin did not publish
+Input Value.: input plugin and the reason
+Return Value: -
+******************************************************************************/
+void metrics_drop(struct _input *in, drop_reason reason)
+{
+    __sync_add_and_fetch(&in->metrics.drops[reason], 1);
+}
+
+/******************************************************************************
+Description.: record the time a frame took to compress or copy
+Input Value.: input plugin and the CLOCK_MONOTONIC time the work started
+Return Value: -
+******************************************************************************/
+void metrics_encode(struct _input *in, const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histogram_add(&in->metrics.encode_us, encode_us_bounds,
+                  (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000);
+}
+
+/******************************************************************************
+Description.: count a published frame
+Input Value.: input plugin and the size of the frame
+Return Value: -
+******************************************************************************/
+void metrics_frame(struct _input *in, int size)
+{
+    __sync_add_and_fetch(&in->metrics.frames, 1);
+    histogram_add(&in->metrics.frame_bytes, frame_bytes_bounds, size);
+}
+
+/******************************************************************************
+Description.: lock the "db" mutex of an input plugin, the time spent waiting
+              is recorded if somebody else holds it
+Input Value.: input plugin
+Return Value: -
+******************************************************************************/
+void metrics_lock(struct _input *in)
+{
+    struct timespec start, end;
+
+    if(pthread_mutex_trylock(&in->db) == 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&in->db);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    __sync_add_and_fetch(&in->metrics.db_contended, 1);
+    __sync_add_and_fetch(&in->metrics.db_wait_ns,
+                         (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+}
+
+/******************************************************************************
+Description.: count a frame an output plugin delivered
+Input Value.: output plugin and the size of the picture
+Return Value: -
+******************************************************************************/
+void metrics_sent(struct _output *out, int size)
+{
+    __sync_add_and_fetch(&out->metrics.frames, 1);
+    __sync_add_and_fetch(&out->metrics.bytes, size);
+}
+
+/******************************************************************************
+Description.: count a frame an output plugin dropped because it was still
+              busy with earlier ones
+Input Value.: output plugin
+Return Value: -
+******************************************************************************/
+void metrics_output_drop(struct _output *out)
+{
+    __sync_add_and_fetch(&out->metrics.drops, 1);
+}
+
+/******************************************************************************
+Description.: count an event the hook process of an output plugin did not get
+Input Value.: output plugin
+Return Value: -
+******************************************************************************/
+void metrics_hook_drop(struct _output *out)
+{
+    __sync_add_and_fetch(&out->metrics.hook_drops, 1);
+}
@@ -0,0 +1,95 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+
+/*
+ * Runtime statistics of the plugins. Every counter has a single place that
+ * increments it with an atomic operation, readers like the "/metrics" page of
+ * output_http just load the values, so nobody ever takes a lock for them.
+ */
+
+/* number of buckets of a histogram, the last one takes everything larger */
+#define METRICS_BUCKETS 10
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _input;
+struct _output;
+
+/* why an input plugin did not publish a captured frame */
+typedef enum {
+    DROP_MINIMUM_SIZE,          /* smaller than --minimum_size, assumed broken */
+    DROP_EVERY,                 /* skipped because of --every_frame */
+    DROP_FRAMERATE,             /* software frame dropping for a low frame rate */
+    DROP_QUEUE_FULL,            /* the encoder was still busy */
+    DROP_LATE,                  /* the deadline of the frame had already passed */
+    DROP_REASONS
+} drop_reason;
+
+/* distribution of values, bucket i counts values up to bounds[i] */
+typedef struct {
+    unsigned long long bucket[METRICS_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum;
+} histogram;
+
+typedef struct _input_metrics input_metrics;
+struct _input_metrics {
+    unsigned long long frames;              /* frames published */
+    unsigned long long drops[DROP_REASONS];
+    histogram encode_us;                    /* time to compress or copy a frame */
+    histogram frame_bytes;                  /* size of the published frames */
+    unsigned long long db_contended;        /* times the "db" mutex was already locked */
+    unsigned long long db_wait_ns;          /* time spent waiting for it */
+};
+
+typedef struct _output_metrics output_metrics;
+struct _output_metrics {
+    unsigned long long frames;              /* frames delivered, each client counts */
+    unsigned long long bytes;               /* picture bytes delivered */
+    unsigned long long drops;               /* frames dropped because the output could not keep up */
+    unsigned long long hook_drops;          /* events the hook process did not get */
+};
+
+extern const char *drop_reason_names[DROP_REASONS];
+extern const unsigned long long encode_us_bounds[METRICS_BUCKETS - 1];
+extern const unsigned long long frame_bytes_bounds[METRICS_BUCKETS - 1];
+
+void metrics_drop(struct _input *in, drop_reason reason);
+void metrics_encode(struct _input *in, const struct timespec *start);
+void metrics_frame(struct _input *in, int size);
+void metrics_lock(struct _input *in);
+void metrics_sent(struct _output *out, int size);
+void metrics_output_drop(struct _output *out);
+void metrics_hook_drop(struct _output *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -41,6 +41,7 @@
 
 #include "utils.h"
 #include "mjpg_streamer.h"
+#include "trace.h"
 
 /* globals */
 static globals global;
@@ -58,7 +59,8 @@ static void help(char *progname)
             "  -o | --output \"<output-plugin.so> [parameters]\"\n" \
             " [-h | --help ]........: display this help\n" \
             " [-v | --version ].....: display version information\n" \
-            " [-b | --background]...: fork to the background, daemon mode\n", progname);
+            " [-b | --background]...: fork to the background, daemon mode\n" \
+            " [-t | --trace ].......: trace the latency of every n-th frame\n", progname);
     fprintf(stderr, "-----------------------------------------------------------------------\n");
     fprintf(stderr, "Example #1:\n" \
             " To open an UVC webcam \"/dev/video1\" and stream it via HTTP:\n" \
@@ -210,10 +212,11 @@ int main(int argc, char *argv[])
             {"output", required_argument, NULL, 'o'},
             {"version", no_argument, NULL, 'v'},
             {"background", no_argument, NULL, 'b'},
+            {"trace", required_argument, NULL, 't'},
             {NULL, 0, NULL, 0}
         };
 
-        c = getopt_long(argc, argv, "hi:o:vb", long_options, NULL);
+        c = getopt_long(argc, argv, "hi:o:vbt:", long_options, NULL);
 
         /* no more options to parse */
         if(c == -1) break;
@@ -242,6 +245,10 @@ int main(int argc, char *argv[])
             daemon = 1;
             break;
 
+        case 't':
+            trace_init(atoi(optarg));
+            break;
+
         case 'h': /* fall through */
         default:
             help(argv[0]);
@@ -304,6 +311,7 @@ int main(int argc, char *argv[])
         global.in[i].context   = NULL;
         global.in[i].buf       = NULL;
         global.in[i].size      = 0;
+        frame_ring_init(&global.in[i].ring);
         global.in[i].plugin = (tmp > 0) ? strndup(input[i], tmp) : strdup(input[i]);
         global.in[i].handle = dlopen(global.in[i].plugin, RTLD_LAZY);
         if(!global.in[i].handle) {
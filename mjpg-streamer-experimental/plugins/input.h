@@ -22,6 +22,8 @@
 
 #include <syslog.h>
 #include "../mjpg_streamer.h"
+#include "../frame.h"
+#include "../metrics.h"
 #define INPUT_PLUGIN_PREFIX " i: "
 #define IPRINT(...) { char _bf[1024] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", INPUT_PLUGIN_PREFIX); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
 
@@ -76,6 +78,12 @@ struct _input {
     /* v4l2_buffer timestamp */
     struct timeval timestamp;
 
+    /* reference counted frames, "buf" points to the latest one if used */
+    frame_ring ring;
+
+    /* statistics, updated atomically */
+    input_metrics metrics;
+
     input_format *in_formats;
     int formatCount;
     int currentFormat; // holds the current format number
@@ -210,7 +210,6 @@ int input_run(int id)
     }
 
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -247,6 +246,7 @@ void *worker_thread(void *arg)
     int currentFileNumber = 0;
     char hasJpgFile = 0;
     struct timeval timestamp;
+    frame *f;
 
     if (mode == ExistingFiles) {
         fileCount = scandir(folder, &fileList, 0, alphasort);
@@ -329,34 +329,27 @@ void *worker_thread(void *arg)
 
         filesize = stats.st_size;
 
-        /* copy frame from file to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
-
-        /* allocate memory for frame */
-        if(pglobal->in[plugin_number].buf != NULL)
-            free(pglobal->in[plugin_number].buf);
-
-        pglobal->in[plugin_number].buf = malloc(filesize + (1 << 16));
-
-        if(pglobal->in[plugin_number].buf == NULL) {
+        /* get a free frame, it is filled without locking the global buffer */
+        if((f = frame_ring_writable(&pglobal->in[plugin_number], filesize + (1 << 16))) == NULL) {
             fprintf(stderr, "could not allocate memory\n");
+            close(file);
             break;
         }
 
-        if((pglobal->in[plugin_number].size = read(file, pglobal->in[plugin_number].buf, filesize)) == -1) {
+        frame_stamp(f, FRAME_DEQUEUED);
+        if((f->size = read(file, f->buf, filesize)) == -1) {
             perror("could not read from file");
-            free(pglobal->in[plugin_number].buf); pglobal->in[plugin_number].buf = NULL; pglobal->in[plugin_number].size = 0;
-            pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+            frame_unref(f);
             close(file);
             break;
         }
+        frame_stamp(f, FRAME_ENCODED);
 
         gettimeofday(&timestamp, NULL);
-        pglobal->in[plugin_number].timestamp = timestamp;
-        DBG("new frame copied (size: %d)\n", pglobal->in[plugin_number].size);
+        f->timestamp = timestamp;
+        DBG("new frame copied (size: %d)\n", f->size);
         /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        frame_ring_publish(&pglobal->in[plugin_number], f);
 
         close(file);
 
@@ -397,8 +390,6 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
 
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
-
     free(ev);
 
     if (mode == NewFilesOnly) {
@@ -104,20 +104,13 @@ int input_stop(int id)
 }
 
 /******************************************************************************
-Description.: starts the worker thread and allocates memory
+Description.: starts the worker thread
 Input Value.: -
 Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(256 * 1024);
-    if(pglobal->in[id].buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
-
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -128,15 +121,21 @@ int input_run(int id)
 
 
 void on_image_received(char * data, int length){
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        frame *f;
+
+        /* copy JPG picture to a free frame of the ring */
+        if((f = frame_ring_writable(&pglobal->in[plugin_number], length)) == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            return;
+        }
 
-        pglobal->in[plugin_number].size = length;
-        memcpy(pglobal->in[plugin_number].buf, data, pglobal->in[plugin_number].size);
+        f->size = length;
+        memcpy(f->buf, data, f->size);
+        gettimeofday(&f->timestamp, NULL);
+        frame_stamp(f, FRAME_ENCODED);
 
         /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        frame_ring_publish(&pglobal->in[plugin_number], f);
 
 }
 
@@ -173,7 +172,6 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
     close_mjpg_proxy(&proxy);
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
 }
 
 
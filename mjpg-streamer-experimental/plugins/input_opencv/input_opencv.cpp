@@ -23,6 +23,7 @@
 #include <getopt.h>
 #include <dlfcn.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "input_opencv.h"
 
@@ -414,6 +415,7 @@ void *worker_thread(void *arg)
     
     Mat src, dst;
     vector<uchar> jpeg_buffer;
+    struct timespec start;
     
     // this exists so that the numpy allocator can assign a custom allocator to
     // the mat, so that it doesn't need to copy the data each time
@@ -431,13 +433,16 @@ void *worker_thread(void *arg)
         pthread_mutex_lock(&in->db);
         
         // take whatever Mat it returns, and write it to jpeg buffer
+        clock_gettime(CLOCK_MONOTONIC, &start);
         imencode(".jpg", dst, jpeg_buffer, compression_params);
+        metrics_encode(in, &start);
         
         // TODO: what to do if imencode returns an error?
         
         // std::vector is guaranteed to be contiguous
         in->buf = &jpeg_buffer[0];
         in->size = jpeg_buffer.size();
+        metrics_frame(in, in->size);
         
         /* signal fresh_frame */
         pthread_cond_broadcast(&in->db_update);
@@ -413,6 +413,7 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
       complete = 1;
 
       pData->offset = 0;
+      metrics_frame(&pglobal->in[plugin_number], pglobal->in[plugin_number].size);
       /* signal fresh_frame */
       pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
       pthread_mutex_unlock(&pglobal->in[plugin_number].db);
@@ -19,24 +19,32 @@
 # Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
 #                                                                              #
 *******************************************************************************/
+
+/*
+  Synthetic input for load tests of the frame pipeline and the output plugins,
+  no camera required. The pictures are either embedded in this plugin or all
+  JPG files of a folder, loaded to memory once. Every frame gets a comment
+  marker with its sequence number and the time of capture, optionally padded
+  to a certain size. Frames are produced at absolute deadlines of a monotonic
+  clock, so the rate does not drift with the time it takes to copy them and
+  high rates are possible. A frame whose deadline has already passed by more
+  than one period is skipped and counted as a "late" drop.
+*/
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <errno.h>
-#include <signal.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <syslog.h>
 
-#include <linux/types.h>          /* for videodev2.h */
-#include <linux/videodev2.h>
-
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
 
@@ -44,6 +52,16 @@
 
 #define INPUT_PLUGIN_NAME "TESTPICTURE input plugin"
 
+/*
+ * Payload of the comment marker behind the APPn segments that follow SOI, so
+ * JFIF APP0 stays the first segment. It is rewritten for every frame:
+ * "mjpg-streamer seq=<sequence number> ts=<seconds>.<microseconds>"
+ */
+#define STAMP_LENGTH 64
+
+/* largest payload of a JPG marker segment */
+#define SEGMENT_MAX 65533
+
 /* private functions and variables to this plugin */
 static pthread_t   worker;
 static globals     *pglobal;
@@ -54,7 +72,9 @@ void *worker_thread(void *);
 void worker_cleanup(void *);
 void help(void);
 
-static int delay = 1000;
+static double fps = 1.0;
+static int target_size = 0;
+static char *folder = NULL;
 
 /* details of converted JPG pictures */
 struct pic {
@@ -76,6 +96,141 @@ static struct pictures {
 
 struct pictures *pics;
 
+/* the pictures as they get published, with the stamp marker and padding */
+typedef struct {
+    unsigned char *data;
+    int size;
+    int stamp;          /* offset of the stamp payload */
+} template;
+
+static template *templates = NULL;
+static int template_count = 0;
+
+/******************************************************************************
+Description.: add a picture to the templates, a comment marker for the stamp
+              and comment markers as padding get inserted behind SOI and
+              the APPn segments following it
+Input Value.: * data...: JPG picture
+              * size...: its size in bytes
+Return Value: 0 if everything is ok, -1 if it is no JPG or memory is missing
+******************************************************************************/
+static int template_add(const unsigned char *data, int size)
+{
+    template *t;
+    unsigned char *p;
+    int total, padding, segment, head = 2;
+
+    if(size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return -1;
+
+    /* JFIF APP0, EXIF APP1 and the like have to stay in front */
+    while(head + 4 <= size && data[head] == 0xFF && (data[head + 1] & 0xF0) == 0xE0)
+        head += 2 + ((data[head + 2] << 8) | data[head + 3]);
+
+    if(head > size)
+        return -1;
+
+    total = size + 4 + STAMP_LENGTH;
+    padding = (target_size > total) ? target_size - total : 0;
+
+    /* a marker segment takes at least 4 bytes */
+    if(padding > 0 && padding < 4)
+        padding = 4;
+
+    if((t = realloc(templates, (template_count + 1) * sizeof(template))) == NULL)
+        return -1;
+    templates = t;
+    t = &templates[template_count];
+
+    if((t->data = p = malloc(total + padding)) == NULL)
+        return -1;
+    t->size = total + padding;
+
+    /* SOI and APPn, then the stamp marker */
+    memcpy(p, data, head);
+    p += head;
+    *p++ = 0xFF;
+    *p++ = 0xFE;
+    *p++ = (STAMP_LENGTH + 2) >> 8;
+    *p++ = (STAMP_LENGTH + 2) & 0xFF;
+    t->stamp = p - t->data;
+    memset(p, ' ', STAMP_LENGTH);
+    p += STAMP_LENGTH;
+
+    while(padding > 0) {
+        segment = (padding > SEGMENT_MAX + 4) ? SEGMENT_MAX + 4 : padding;
+
+        /* do not leave a rest that is too small for another segment */
+        if(padding - segment > 0 && padding - segment < 4)
+            segment -= 4;
+
+        *p++ = 0xFF;
+        *p++ = 0xFE;
+        *p++ = (segment - 2) >> 8;
+        *p++ = (segment - 2) & 0xFF;
+        memset(p, ' ', segment - 4);
+        p += segment - 4;
+        padding -= segment;
+    }
+
+    /* the rest of the picture */
+    memcpy(p, data + head, size - head);
+
+    template_count++;
+    return 0;
+}
+
+/******************************************************************************
+Description.: load all JPG files of a folder as templates
+Input Value.: folder
+Return Value: number of pictures loaded, -1 if the folder can not be read
+******************************************************************************/
+static int template_load(const char *path)
+{
+    struct dirent **list;
+    struct stat stats;
+    char name[4096];
+    unsigned char *data;
+    int i, n, fd, loaded = 0;
+
+    if((n = scandir(path, &list, 0, alphasort)) < 0) {
+        perror("could not read folder");
+        return -1;
+    }
+
+    for(i = 0; i < n; i++) {
+        if(strstr(list[i]->d_name, ".jpg") == NULL && strstr(list[i]->d_name, ".JPG") == NULL) {
+            free(list[i]);
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "%s/%s", path, list[i]->d_name);
+
+        if((fd = open(name, O_RDONLY)) == -1) {
+            free(list[i]);
+            continue;
+        }
+
+        if(fstat(fd, &stats) == -1 || (data = malloc(stats.st_size)) == NULL) {
+            close(fd);
+            free(list[i]);
+            continue;
+        }
+
+        if(read(fd, data, stats.st_size) == stats.st_size && template_add(data, stats.st_size) == 0)
+            loaded++;
+        else
+            IPRINT("ignoring %s, it is no JPG\n", list[i]->d_name);
+
+        free(data);
+        close(fd);
+        free(list[i]);
+    }
+    free(list);
+
+    return loaded;
+}
+
 /*** plugin interface functions ***/
 
 /******************************************************************************
@@ -88,6 +243,7 @@ int input_init(input_parameter *param, int plugin_no)
     int i;
 
     pics = &picture_lookup[1];
+    plugin_number = plugin_no;
 
     if(pthread_mutex_init(&controls_mutex, NULL) != 0) {
         IPRINT("could not initialize mutex variable\n");
@@ -112,6 +268,12 @@ int input_init(input_parameter *param, int plugin_no)
             {"delay", required_argument, 0, 0},
             {"r", required_argument, 0, 0},
             {"resolution", required_argument, 0, 0},
+            {"f", required_argument, 0, 0},
+            {"fps", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"size", required_argument, 0, 0},
+            {"fo", required_argument, 0, 0},
+            {"folder", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -139,7 +301,8 @@ int input_init(input_parameter *param, int plugin_no)
         case 2:
         case 3:
             DBG("case 2,3\n");
-            delay = atoi(optarg);
+            i = atoi(optarg);
+            fps = (i > 0) ? 1000.0 / i : 0;
             break;
 
             /* r, resolution */
@@ -154,6 +317,27 @@ int input_init(input_parameter *param, int plugin_no)
             }
             break;
 
+            /* f, fps */
+        case 6:
+        case 7:
+            DBG("case 6,7\n");
+            fps = atof(optarg);
+            break;
+
+            /* s, size */
+        case 8:
+        case 9:
+            DBG("case 8,9\n");
+            target_size = atoi(optarg);
+            break;
+
+            /* fo, folder */
+        case 10:
+        case 11:
+            DBG("case 10,11\n");
+            folder = strdup(optarg);
+            break;
+
         default:
             DBG("default case\n");
             help();
@@ -163,8 +347,34 @@ int input_init(input_parameter *param, int plugin_no)
 
     pglobal = param->global;
 
-    IPRINT("delay.............: %i\n", delay);
-    IPRINT("resolution........: %s\n", pics->resolution);
+    if(fps < 0) {
+        IPRINT("ERROR: the frame rate must not be negative\n");
+        return 1;
+    }
+
+    if(folder != NULL) {
+        if(template_load(folder) <= 0) {
+            IPRINT("ERROR: no JPG pictures in %s\n", folder);
+            return 1;
+        }
+    } else {
+        for(i = 0; i < LENGTH_OF(pics->sequence); i++)
+            template_add(pics->sequence[i].data, pics->sequence[i].size);
+    }
+
+    if(fps > 0) {
+        IPRINT("frames per second.: %.2f\n", fps);
+    } else {
+        IPRINT("frames per second.: as many as possible\n");
+    }
+    if(folder != NULL) {
+        IPRINT("pictures..........: %d from %s\n", template_count, folder);
+    } else {
+        IPRINT("resolution........: %s\n", pics->resolution);
+    }
+    IPRINT("frame size........: %d bytes\n", templates[0].size);
+
+    param->global->in[plugin_no].name = strdup(INPUT_PLUGIN_NAME);
 
     return 0;
 }
@@ -183,20 +393,13 @@ int input_stop(int id)
 }
 
 /******************************************************************************
-Description.: starts the worker thread and allocates memory
+Description.: starts the worker thread
 Input Value.: -
 Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(256 * 1024);
-    if(pglobal->in[id].buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
-
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -216,38 +419,81 @@ void help(void)
     " Help for input plugin..: "INPUT_PLUGIN_NAME"\n" \
     " ---------------------------------------------------------------\n" \
     " The following parameters can be passed to this plugin:\n\n" \
-    " [-d | --delay ]........: delay to pause between frames\n" \
-    " [-r | --resolution]....: can be 960x720, 640x480, 320x240, 160x120\n"
+    " [-d | --delay ]........: delay to pause between frames in ms\n" \
+    " [-f | --fps ]..........: frames per second, fractions are allowed,\n" \
+    "                          0 produces frames as fast as possible\n" \
+    " [-r | --resolution]....: can be 960x720, 640x480, 320x240, 160x120\n" \
+    " [-s | --size ].........: pad the frames to this many bytes\n" \
+    " [-fo | --folder ]......: use the JPG files of this folder instead\n" \
+    "                          of the embedded pictures\n" \
     " ---------------------------------------------------------------\n");
 }
 
 /******************************************************************************
-Description.: copy a picture from testpictures.h and signal this to all output
-              plugins, afterwards switch to the next frame of the animation.
+Description.: copy the next picture to a frame, stamp it and signal this to
+              all output plugins, then wait for the deadline of the next frame
 Input Value.: arg is not used
 Return Value: NULL
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int i = 0;
+    input *in = &pglobal->in[plugin_number];
+    template *t;
+    frame *f;
+    struct timespec ts;
+    char stamp[STAMP_LENGTH + 1];
+    unsigned long long seq = 0;
+    long long period, deadline, now, late;
+    int i = 0, len;
+
+    period = (fps > 0) ? (long long)(1000000000.0 / fps) : 0;
+    deadline = frame_clock();
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
     while(!pglobal->stop) {
 
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        /* copy JPG picture to a free frame of the ring */
+        t = &templates[i];
+        i = (i + 1) % template_count;
+        if((f = frame_ring_writable(in, t->size)) == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            break;
+        }
+
+        /* the frame counts as captured at its deadline */
+        f->stamp[FRAME_CAPTURED] = deadline;
+        frame_stamp(f, FRAME_DEQUEUED);
 
-        i = (i + 1) % LENGTH_OF(pics->sequence);
-        pglobal->in[plugin_number].size = pics->sequence[i].size;
-        memcpy(pglobal->in[plugin_number].buf, pics->sequence[i].data, pglobal->in[plugin_number].size);
+        f->size = t->size;
+        memcpy(f->buf, t->data, f->size);
+        gettimeofday(&f->timestamp, NULL);
+
+        len = snprintf(stamp, sizeof(stamp), "mjpg-streamer seq=%llu ts=%ld.%06ld",
+                       seq++, (long)f->timestamp.tv_sec, (long)f->timestamp.tv_usec);
+        memcpy(f->buf + t->stamp, stamp, MIN(len, STAMP_LENGTH));
+        frame_stamp(f, FRAME_ENCODED);
 
         /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        frame_ring_publish(in, f);
+
+        if(period == 0)
+            continue;
+
+        /* skip the frames whose time is over already instead of catching up */
+        deadline += period;
+        now = frame_clock();
+        if(now - deadline > period) {
+            late = (now - deadline) / period;
+            deadline += late * period;
+            while(late-- > 0)
+                metrics_drop(in, DROP_LATE);
+        }
 
-        usleep(1000 * delay);
+        ts.tv_sec = deadline / 1000000000LL;
+        ts.tv_nsec = deadline % 1000000000LL;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
     }
 
     IPRINT("leaving input thread, calling cleanup function now\n");
@@ -264,6 +510,7 @@ Return Value: -
 void worker_cleanup(void *arg)
 {
     static unsigned char first_run = 1;
+    int i;
 
     if(!first_run) {
         DBG("already cleaned up resources\n");
@@ -273,9 +520,9 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
 
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
+    for(i = 0; i < template_count; i++)
+        free(templates[i].data);
+    free(templates);
+    templates = NULL;
+    template_count = 0;
 }
-
-
-
-
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/socket.h>
@@ -76,6 +77,9 @@ static struct timeval timestamp;
 static int softfps = -1;
 static unsigned int timeout = 5;
 static unsigned int dv_timings = 0;
+static int encoders = 1;
+static int buffers = NB_BUFFER;
+static int userptr = 0;
 
 static const struct {
   const char * k;
@@ -97,6 +101,7 @@ static const struct {
 };
 
 void *cam_thread(void *);
+void *encode_thread(void *);
 void cam_cleanup(void *);
 void help(void);
 int input_cmd(int plugin, unsigned int control, unsigned int group, int value, char *value_string);
@@ -215,6 +220,9 @@ int input_init(input_parameter *param, int id)
             {"softfps", required_argument, 0, 0},
             {"timeout", required_argument, 0, 0},
             {"dv_timings", no_argument, 0, 0},
+            {"encoders", required_argument, 0, 0},
+            {"buffers", required_argument, 0, 0},
+            {"userptr", no_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -387,6 +395,18 @@ int input_init(input_parameter *param, int id)
             DBG("case 42\n");
             dv_timings = 1;
             break;
+        case 43:
+            DBG("case 43\n");
+            encoders = MAX(atoi(optarg), 0);
+            break;
+        case 44:
+            DBG("case 44\n");
+            buffers = MIN(MAX(atoi(optarg), 1), MAX_BUFFER);
+            break;
+        case 45:
+            DBG("case 45\n");
+            userptr = 1;
+            break;
        default:
            DBG("default case\n");
            help();
@@ -435,8 +455,14 @@ int input_init(input_parameter *param, int id)
 
     IPRINT("Format............: %s\n", fmtString);
     #ifndef NO_LIBJPEG
-        if(format != V4L2_PIX_FMT_MJPEG && format != V4L2_PIX_FMT_JPEG)
+        if(format != V4L2_PIX_FMT_MJPEG && format != V4L2_PIX_FMT_JPEG) {
             IPRINT("JPEG Quality......: %d\n", settings->quality);
+            if(encoders > 0) {
+                IPRINT("JPEG Encoders.....: %d\n", encoders);
+            } else {
+                IPRINT("JPEG Encoders.....: one per CPU core\n");
+            }
+        }
     #endif
 
     if (tvnorm != V4L2_STD_UNKNOWN) {
@@ -448,6 +474,9 @@ int input_init(input_parameter *param, int id)
     DBG("vdIn pn: %d\n", id);
     /* open video device and prepare data structure */
     pctx->videoIn->dv_timings = dv_timings;
+    pctx->videoIn->encoders = encoders;
+    pctx->videoIn->nbuffers = buffers;
+    pctx->videoIn->memory = userptr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
     if(init_videoIn(pctx->videoIn, dev, width, height, fps, format, 1, pctx->pglobal, id, tvnorm) < 0) {
         IPRINT("init_VideoIn failed\n");
         closelog();
@@ -457,6 +486,8 @@ int input_init(input_parameter *param, int id)
     if (softfps > 0) {
         IPRINT("Framedrop FPS.....: %d\n", softfps);
     }
+    IPRINT("Capture buffers...: %u (%s)\n", pctx->videoIn->rb.count,
+           pctx->videoIn->memory == V4L2_MEMORY_USERPTR ? "user pointers" : "mmap");
 
     /*
      * recent linux-uvc driver (revision > ~#125) requires to use dynctrls
@@ -496,12 +527,6 @@ int input_run(int id)
     input * in = &pglobal->in[id];
     context *pctx = (context*)in->context;
     
-    in->buf = malloc(pctx->videoIn->framesizeIn);
-    if(in->buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
-
     DBG("launching camera thread #%02d\n", id);
     /* create thread and pass context to thread function */
     pthread_create(&(pctx->threadID), NULL, cam_thread, in);
@@ -551,6 +576,13 @@ void help(void)
     "                          set your camera to its maximum fps to avoid stuttering\n" \
     " [-timeout] ............: Timeout for device querying (seconds)\n" \
     " [-dv_timings] .........: Enable DV timings queriyng and events processing\n" \
+    " [-encoders ] ..........: split YUV/RGB frames into slices that are compressed\n" \
+    "                          by this many threads, 0 = one per CPU core, default: 1\n" \
+    " [-buffers ] ...........: number of capture buffers to request, default: 4\n" \
+    " [-userptr ] ...........: capture into our own buffers (V4L2_MEMORY_USERPTR)\n" \
+    "                          instead of driver buffers, falls back to mmap.\n" \
+    "                          MJPEG frames are published without a copy while\n" \
+    "                          at least 2 buffers stay with the driver\n" \
     " ---------------------------------------------------------------\n");
 
     fprintf(stderr, "\n"\
@@ -585,7 +617,9 @@ void *cam_thread(void *arg)
     context_settings *settings = pcontext->init_settings;
     
     unsigned int every_count = 0;
-    int quality = settings->quality;
+    struct timeval last_timestamp = {0, 0};
+    uvc_buffer b;
+    int ret;
     
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(cam_cleanup, in);
@@ -659,6 +693,7 @@ void *cam_thread(void *arg)
         }
     }
     
+    pcontext->quality = settings->quality;
     free(settings);
     settings = NULL;
     pcontext->init_settings = NULL;
@@ -673,6 +708,13 @@ void *cam_thread(void *arg)
         goto endloop;
     }
 
+    /* second stage of the pipeline, it owns the buffers between dequeueing and requeueing */
+    if(pthread_create(&pcontext->encodeID, NULL, encode_thread, in) != 0) {
+        IPRINT("could not start the encoding thread\n");
+        goto endloop;
+    }
+    pcontext->encoding = 1;
+
     while(!pglobal->stop) {
         while(pcontext->videoIn->streamingState == STREAMING_PAUSED) {
             usleep(1); // maybe not the best way so FIXME
@@ -718,16 +760,19 @@ void *cam_thread(void *arg)
 
         if (FD_ISSET(pcontext->videoIn->fd, &rd_fds)) {
             DBG("Grabbing a frame...\n");
-            /* grab a frame */
-            if(uvcGrab(pcontext->videoIn) < 0) {
+            /* grab a frame, it is requeued by the encoding thread or right here if it gets dropped */
+            if((ret = video_dequeue(pcontext->videoIn, &b)) < 0) {
                 IPRINT("Error grabbing frames\n");
                 goto endloop;
             }
+            if(ret > 0)
+                goto other_select_handlers;
 
             if ( every_count < every - 1 ) {
                 DBG("dropping %d frame for every=%d\n", every_count + 1, every);
                 ++every_count;
-                goto other_select_handlers;
+                metrics_drop(in, DROP_EVERY);
+                goto drop_frame;
             } else {
                 every_count = 0;
             }
@@ -741,9 +786,10 @@ void *cam_thread(void *arg)
              * For example a VGA (640x480) webcam picture is normally >= 8kByte large,
              * corrupted frames are smaller.
              */
-            if(pcontext->videoIn->tmpbytesused < minimum_size) {
+            if(b.bytesused < minimum_size) {
                 DBG("dropping too small frame, assuming it as broken\n");
-                goto other_select_handlers;
+                metrics_drop(in, DROP_MINIMUM_SIZE);
+                goto drop_frame;
             }
 
             // Overwrite timestamp (e.g. where camera is providing 0 values)
@@ -751,63 +797,39 @@ void *cam_thread(void *arg)
             if(wantTimestamp)
             {
                 gettimeofday(&timestamp, NULL);
-                pcontext->videoIn->tmptimestamp = timestamp;
+                b.timestamp = timestamp;
             }
 
             // use software frame dropping on low fps
             if (pcontext->videoIn->soft_framedrop == 1) {
-                unsigned long last = pglobal->in[pcontext->id].timestamp.tv_sec * 1000 +
-                                    (pglobal->in[pcontext->id].timestamp.tv_usec/1000); // convert to ms
-                unsigned long current = pcontext->videoIn->tmptimestamp.tv_sec * 1000 +
-                                        pcontext->videoIn->tmptimestamp.tv_usec/1000; // convert to ms
+                unsigned long last = last_timestamp.tv_sec * 1000 +
+                                    (last_timestamp.tv_usec/1000); // convert to ms
+                unsigned long current = b.timestamp.tv_sec * 1000 +
+                                        b.timestamp.tv_usec/1000; // convert to ms
 
                 // if the requested time did not esplashed skip the frame
                 if ((current - last) < pcontext->videoIn->frame_period_time) {
                     DBG("Last frame taken %d ms ago so drop it\n", (current - last));
-                    goto other_select_handlers;
+                    metrics_drop(in, DROP_FRAMERATE);
+                    goto drop_frame;
                 }
                 DBG("Lagg: %ld\n", (current - last) - pcontext->videoIn->frame_period_time);
             }
 
-            /* copy JPG picture to global buffer */
-            pthread_mutex_lock(&pglobal->in[pcontext->id].db);
-
-            /*
-             * If capturing in YUV mode convert to JPEG now.
-             * This compression requires many CPU cycles, so try to avoid YUV format.
-             * Getting JPEGs straight from the webcam, is one of the major advantages of
-             * Linux-UVC compatible devices.
-             */
-            #ifndef NO_LIBJPEG
-            if ((pcontext->videoIn->formatIn == V4L2_PIX_FMT_YUYV) ||
-            (pcontext->videoIn->formatIn == V4L2_PIX_FMT_UYVY) ||
-            (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB24) ||
-            (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB565) ) {
-                DBG("compressing frame from input: %d\n", (int)pcontext->id);
-                pglobal->in[pcontext->id].size = compress_image_to_jpeg(pcontext->videoIn, pglobal->in[pcontext->id].buf, pcontext->videoIn->framesizeIn, quality);
-                /* copy this frame's timestamp to user space */
-                pglobal->in[pcontext->id].timestamp = pcontext->videoIn->tmptimestamp;
-            } else {
-            #endif
-                DBG("copying frame from input: %d\n", (int)pcontext->id);
-                pglobal->in[pcontext->id].size = memcpy_picture(pglobal->in[pcontext->id].buf, pcontext->videoIn->tmpbuffer, pcontext->videoIn->tmpbytesused);
-                /* copy this frame's timestamp to user space */
-                pglobal->in[pcontext->id].timestamp = pcontext->videoIn->tmptimestamp;
-            #ifndef NO_LIBJPEG
+            /* the encoding thread compresses or copies the frame while the next one is captured */
+            if(buffer_queue_push(pcontext->videoIn, &b) < 0) {
+                DBG("encoding queue is full, dropping frame\n");
+                metrics_drop(in, DROP_QUEUE_FULL);
+                goto drop_frame;
             }
-            #endif
+            last_timestamp = b.timestamp;
+            goto other_select_handlers;
 
-#if 0
-            /* motion detection can be done just by comparing the picture size, but it is not very accurate!! */
-            if((prev_size - global->size)*(prev_size - global->size) > 4 * 1024 * 1024) {
-                DBG("motion detected (delta: %d kB)\n", (prev_size - global->size) / 1024);
+drop_frame:
+            if(video_requeue(pcontext->videoIn, b.index) < 0) {
+                IPRINT("Error requeueing frames\n");
+                goto endloop;
             }
-            prev_size = global->size;
-#endif
-
-            /* signal fresh_frame */
-            pthread_cond_broadcast(&pglobal->in[pcontext->id].db_update);
-            pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
         }
 
 other_select_handlers:
@@ -834,6 +856,100 @@ endloop:
     return NULL;
 }
 
+/******************************************************************************
+Description.: second stage of the camera pipeline, it compresses or copies
+              the buffers cam_thread hands over and gives them back to the
+              driver, meanwhile the driver keeps filling the other buffers
+Input Value.: input
+Return Value: NULL
+******************************************************************************/
+void *encode_thread(void *arg)
+{
+    input * in = (input*)arg;
+    context *pcontext = (context*)in->context;
+    struct vdIn *vd = pcontext->videoIn;
+    unsigned char *src;
+    uvc_buffer b;
+    frame *f, *lent;
+    struct timespec start;
+
+    while(!pcontext->encode_stop) {
+        if(buffer_queue_peek(vd, &b) < 0)
+            continue;
+        src = vd->mem[b.index];
+
+        /*
+         * MJPEG frames in user pointer buffers are published as they are,
+         * the buffer is requeued when the last consumer drops the frame
+         */
+        lent = NULL;
+        #ifndef NO_LIBJPEG
+        if((vd->formatIn != V4L2_PIX_FMT_YUYV) &&
+        (vd->formatIn != V4L2_PIX_FMT_UYVY) &&
+        (vd->formatIn != V4L2_PIX_FMT_RGB24) &&
+        (vd->formatIn != V4L2_PIX_FMT_RGB565))
+        #endif
+            lent = buffer_lend(vd, &b);
+
+        /*
+         * otherwise get a free frame of the ring, it is filled without locking
+         * the global buffer so readers of the previous frame are not blocked
+         */
+        if(lent != NULL) {
+            DBG("lending frame from input: %d\n", (int)pcontext->id);
+            f = lent;
+            f->timestamp = b.timestamp;
+            f->stamp[FRAME_CAPTURED] = b.captured;
+            f->stamp[FRAME_DEQUEUED] = b.dequeued;
+            frame_stamp(f, FRAME_ENCODED);
+        } else if((f = frame_ring_writable(in, MAX(vd->framesizeIn, (int)b.bytesused + DHT_SIZE))) == NULL) {
+            IPRINT("could not allocate memory\n");
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            /*
+             * If capturing in YUV mode convert to JPEG now.
+             * This compression requires many CPU cycles, so try to avoid YUV format.
+             * Getting JPEGs straight from the webcam, is one of the major advantages of
+             * Linux-UVC compatible devices.
+             */
+            #ifndef NO_LIBJPEG
+            if ((vd->formatIn == V4L2_PIX_FMT_YUYV) ||
+            (vd->formatIn == V4L2_PIX_FMT_UYVY) ||
+            (vd->formatIn == V4L2_PIX_FMT_RGB24) ||
+            (vd->formatIn == V4L2_PIX_FMT_RGB565) ) {
+                DBG("compressing frame from input: %d\n", (int)pcontext->id);
+                f->size = compress_image_to_jpeg(vd, src, f->buf, f->capacity, pcontext->quality);
+            } else {
+            #endif
+                DBG("copying frame from input: %d\n", (int)pcontext->id);
+                f->size = memcpy_picture(f->buf, src, b.bytesused);
+            #ifndef NO_LIBJPEG
+            }
+            #endif
+            metrics_encode(in, &start);
+
+            /* copy this frame's timestamp to user space */
+            f->timestamp = b.timestamp;
+            f->stamp[FRAME_CAPTURED] = b.captured;
+            f->stamp[FRAME_DEQUEUED] = b.dequeued;
+            frame_stamp(f, FRAME_ENCODED);
+        }
+
+        /* the picture is not needed anymore, let the driver fill the buffer again */
+        if(lent == NULL && video_requeue(vd, b.index) < 0) {
+            IPRINT("Error requeueing frames\n");
+        }
+        buffer_queue_release(vd);
+
+        /* signal fresh_frame */
+        if(f != NULL)
+            frame_ring_publish(in, f);
+    }
+
+    return NULL;
+}
+
 /******************************************************************************
 Description.:
 Input Value.:
@@ -847,15 +963,20 @@ void cam_cleanup(void *arg)
     IPRINT("cleaning up resources allocated by input thread\n");
 
     if (pctx->videoIn != NULL) {
+        /* the encoding thread must be done with the buffers before they get unmapped */
+        if(pctx->encoding) {
+            pctx->encode_stop = 1;
+            sem_post(&pctx->videoIn->queue.filled);
+            pthread_join(pctx->encodeID, NULL);
+            pctx->encoding = 0;
+        }
         close_v4l2(pctx->videoIn);
-        free(pctx->videoIn->tmpbuffer);
+        #ifndef NO_LIBJPEG
+        jpeg_encoder_free(pctx->videoIn);
+        #endif
         free(pctx->videoIn);
         pctx->videoIn = NULL;
     }
-    
-    free(in->buf);
-    in->buf = NULL;
-    in->size = 0;
 }
 
 /******************************************************************************
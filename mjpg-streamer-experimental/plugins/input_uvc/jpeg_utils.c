@@ -26,11 +26,25 @@
 #include <stdio.h>
 #include <jpeglib.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
 
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
 
+#include "../../utils.h"
 #include "v4l2uvc.h"
+#include "jpeg_utils.h"
 
 #define OUTPUT_BUF_SIZE  4096
 
@@ -57,9 +71,6 @@ METHODDEF(void) init_destination(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
 
-    /* Allocate the output buffer --- it will be released when done with image */
-    dest->buffer = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_IMAGE, OUTPUT_BUF_SIZE * sizeof(JOCTET));
-
     *(dest->written) = 0;
 
     dest->pub.next_output_byte = dest->buffer;
@@ -114,6 +125,8 @@ GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size,
 
     if(cinfo->dest == NULL) {
         cinfo->dest = (struct jpeg_destination_mgr *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(mjpg_destination_mgr));
+        /* the bounce buffer lives as long as the compressor, it is reused for every image */
+        ((mjpg_dest_ptr) cinfo->dest)->buffer = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, OUTPUT_BUF_SIZE * sizeof(JOCTET));
     }
 
     dest = (mjpg_dest_ptr) cinfo->dest;
@@ -126,6 +139,572 @@ GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size,
     dest->written = written;
 }
 
+/******************************************************************************
+Description.: splits a line of packed 4:2:2 pixels into the Y, Cb and Cr planes
+              libjpeg expects for raw data input. No colour conversion is
+              needed, JPEG stores YCbCr anyway.
+Input Value.: * src....: YUYV or UYVY line
+              * y......: receives "width" luma samples
+              * cb, cr.: receive "width / 2" chroma samples each
+              * width..: number of pixels, must be even
+              * uyvy...: 0 for YUYV, 1 for UYVY byte order
+Return Value: -
+******************************************************************************/
+static void split_yuv422(const unsigned char *src, unsigned char *y, unsigned char *cb, unsigned char *cr, int width, int uyvy)
+{
+    int x = 0;
+
+#if defined(__AVX2__)
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    const __m256i zero = _mm256_setzero_si256();
+
+    /* 32 pixels per round, packus works per 128 bit lane so the results need reordering */
+    for(; x + 32 <= width; x += 32, src += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)src);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+        __m256i luma, chroma, u, v;
+
+        if(uyvy) {
+            luma = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+            chroma = _mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+        } else {
+            luma = _mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+            chroma = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+        }
+        luma = _mm256_permute4x64_epi64(luma, 0xd8);
+        chroma = _mm256_permute4x64_epi64(chroma, 0xd8);
+
+        u = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(chroma, mask), zero), 0xd8);
+        v = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(chroma, 8), zero), 0xd8);
+
+        _mm256_storeu_si256((__m256i *)(y + x), luma);
+        _mm_storeu_si128((__m128i *)(cb + x / 2), _mm256_castsi256_si128(u));
+        _mm_storeu_si128((__m128i *)(cr + x / 2), _mm256_castsi256_si128(v));
+    }
+#elif defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    const __m128i zero = _mm_setzero_si128();
+
+    /* 16 pixels per round */
+    for(; x + 16 <= width; x += 16, src += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i luma, chroma;
+
+        if(uyvy) {
+            luma = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+            chroma = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+        } else {
+            luma = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+            chroma = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        }
+
+        _mm_storeu_si128((__m128i *)(y + x), luma);
+        _mm_storel_epi64((__m128i *)(cb + x / 2), _mm_packus_epi16(_mm_and_si128(chroma, mask), zero));
+        _mm_storel_epi64((__m128i *)(cr + x / 2), _mm_packus_epi16(_mm_srli_epi16(chroma, 8), zero));
+    }
+#elif defined(HAVE_NEON)
+    /* 32 pixels per round, vld4 does the deinterleaving */
+    for(; x + 32 <= width; x += 32, src += 64) {
+        uint8x16x4_t px = vld4q_u8(src);
+        uint8x16x2_t luma;
+
+        if(uyvy) {
+            luma.val[0] = px.val[1];
+            luma.val[1] = px.val[3];
+            vst1q_u8(cb + x / 2, px.val[0]);
+            vst1q_u8(cr + x / 2, px.val[2]);
+        } else {
+            luma.val[0] = px.val[0];
+            luma.val[1] = px.val[2];
+            vst1q_u8(cb + x / 2, px.val[1]);
+            vst1q_u8(cr + x / 2, px.val[3]);
+        }
+        vst2q_u8(y + x, luma);
+    }
+#endif
+
+    /* remaining pixels */
+    for(; x + 2 <= width; x += 2, src += 4) {
+        if(uyvy) {
+            y[x] = src[1];
+            y[x + 1] = src[3];
+            cb[x / 2] = src[0];
+            cr[x / 2] = src[2];
+        } else {
+            y[x] = src[0];
+            y[x + 1] = src[2];
+            cb[x / 2] = src[1];
+            cr[x / 2] = src[3];
+        }
+    }
+}
+
+/******************************************************************************
+Description.: expands a line of RGB5:6:5 pixels to RGB24
+Input Value.: source line, destination line and number of pixels
+Return Value: -
+******************************************************************************/
+static void rgb565_to_rgb24(const unsigned char *src, unsigned char *dst, int width)
+{
+    int x = 0;
+
+#if defined(HAVE_NEON)
+    /* 16 pixels per round, vst3 does the interleaving */
+    for(; x + 16 <= width; x += 16, src += 32, dst += 48) {
+        uint8x16x2_t px = vld2q_u8(src);    /* val[0]: low bytes, val[1]: high bytes */
+        uint8x16x3_t rgb;
+
+        rgb.val[0] = vandq_u8(px.val[1], vdupq_n_u8(0xf8));
+        rgb.val[1] = vorrq_u8(vshlq_n_u8(px.val[1], 5), vshrq_n_u8(vandq_u8(px.val[0], vdupq_n_u8(0xe0)), 3));
+        rgb.val[2] = vshlq_n_u8(px.val[0], 3);
+        vst3q_u8(dst, rgb);
+    }
+#endif
+
+    /* plain C, branch free so the compiler is able to vectorize it */
+    for(; x < width; x++, src += 2) {
+        *(dst++) = (src[1] & 248);
+        *(dst++) = (unsigned char)((((src[1] << 8) | src[0]) & 2016) >> 3);
+        *(dst++) = ((src[0] & 31) * 8);
+    }
+}
+
+/******************************************************************************
+Description.: averages two lines of chroma samples, this is the vertical part
+              of the 4:2:2 to 4:2:0 downsampling
+Input Value.: line that receives the result, second line and number of samples
+Return Value: -
+******************************************************************************/
+static void average_lines(unsigned char *dst, const unsigned char *src, int width)
+{
+    int x = 0;
+
+#if defined(__SSE2__)
+    for(; x + 16 <= width; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + x));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_avg_epu8(a, b));
+    }
+#elif defined(HAVE_NEON)
+    for(; x + 16 <= width; x += 16) {
+        vst1q_u8(dst + x, vrhaddq_u8(vld1q_u8(dst + x), vld1q_u8(src + x)));
+    }
+#endif
+
+    for(; x < width; x++)
+        dst[x] = (dst[x] + src[x] + 1) >> 1;
+}
+
+/******************************************************************************
+Description.: feeds a YUYV or UYVY picture as raw 4:2:0 YCbCr to libjpeg,
+              jpeg_write_raw_data() takes one iMCU row of 16 lines per call
+Input Value.: compressor that was started with raw_data_in, the picture and a
+              buffer of RAW_BUFFER_SIZE(width) bytes for the planes
+Return Value: -
+******************************************************************************/
+#define RAW_STRIDE(width) (((width) + 15) & ~15)
+#define RAW_BUFFER_SIZE(width) (RAW_STRIDE(width) * (2 * DCTSIZE + DCTSIZE + 1))
+
+static void write_yuv422_raw(j_compress_ptr cinfo, const unsigned char *yuv, int width, int height, int uyvy,
+                             unsigned char *buffer)
+{
+    JSAMPROW y_rows[2 * DCTSIZE], cb_rows[DCTSIZE], cr_rows[DCTSIZE];
+    JSAMPARRAY planes[3];
+    /* libjpeg reads whole blocks, the planes are padded to a multiple of 16/8 samples */
+    int y_stride = RAW_STRIDE(width), c_stride = y_stride / 2, c_width = width / 2;
+    unsigned char *cb_tmp, *cr_tmp;
+    int i, line, row = 0;
+
+    planes[0] = y_rows;
+    planes[1] = cb_rows;
+    planes[2] = cr_rows;
+
+    for(i = 0; i < 2 * DCTSIZE; i++)
+        y_rows[i] = buffer + i * y_stride;
+    buffer += 2 * DCTSIZE * y_stride;
+
+    for(i = 0; i < DCTSIZE; i++) {
+        cb_rows[i] = buffer + (2 * i) * c_stride;
+        cr_rows[i] = buffer + (2 * i + 1) * c_stride;
+    }
+    buffer += 2 * DCTSIZE * c_stride;
+
+    cb_tmp = buffer;
+    cr_tmp = buffer + c_stride;
+
+    while(cinfo->next_scanline < cinfo->image_height) {
+        for(i = 0; i < 2 * DCTSIZE; i++) {
+            /* repeat the last line to fill the final iMCU row */
+            line = (row + i < height) ? row + i : height - 1;
+
+            /* every second line only contributes to the average of the chroma planes */
+            if(i % 2 == 0) {
+                split_yuv422(yuv + line * width * 2, y_rows[i], cb_rows[i / 2], cr_rows[i / 2], width, uyvy);
+            } else {
+                split_yuv422(yuv + line * width * 2, y_rows[i], cb_tmp, cr_tmp, width, uyvy);
+                average_lines(cb_rows[i / 2], cb_tmp, c_width);
+                average_lines(cr_rows[i / 2], cr_tmp, c_width);
+
+                /* repeat the last column up to the block boundary */
+                memset(cb_rows[i / 2] + c_width, cb_rows[i / 2][c_width - 1], c_stride - c_width);
+                memset(cr_rows[i / 2] + c_width, cr_rows[i / 2][c_width - 1], c_stride - c_width);
+            }
+            memset(y_rows[i] + width, y_rows[i][width - 1], y_stride - width);
+        }
+
+        jpeg_write_raw_data(cinfo, planes, 2 * DCTSIZE);
+        row += 2 * DCTSIZE;
+    }
+}
+
+/* height of an MCU row, the luma is sampled 2x2 for raw as well as RGB input */
+#define SLICE_LINES (2 * DCTSIZE)
+
+/*
+ * a horizontal stripe of the picture with its own libjpeg compressor,
+ * the first slice writes straight into the destination buffer while
+ * all others write into a private buffer that is appended afterwards
+ */
+typedef struct {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *line_buffer;
+    unsigned char *out;
+    int out_size;
+    int written;
+    int first_line;
+    int lines;
+    pthread_t thread;
+    jpeg_encoder *encoder;
+} jpeg_slice;
+
+/*
+ * compressor state kept per camera, so libjpeg is only set up again
+ * when the picture geometry, the input format, the quality or the number
+ * of encoders changes
+ */
+struct _jpeg_encoder {
+    int width;
+    int height;
+    int format;
+    int quality;
+    int encoders;
+    int count;                  /* slices the picture is split into */
+    int threads;                /* worker threads, slice 0 is encoded by the capture thread */
+    jpeg_slice *slice;
+    const unsigned char *src;   /* picture of the current job */
+    pthread_mutex_t mutex;
+    pthread_cond_t job;
+    pthread_cond_t done;
+    unsigned int generation;
+    int pending;
+    int stop;
+};
+
+/******************************************************************************
+Description.: compresses the stripe of the current picture that belongs to
+              a slice, called by the capture thread and the worker threads
+Input Value.: encoder and slice, the destination must be set up already
+Return Value: -
+******************************************************************************/
+static void encode_slice(jpeg_encoder *enc, jpeg_slice *s)
+{
+    struct jpeg_compress_struct *cinfo = &s->cinfo;
+    const unsigned char *src = enc->src;
+    JSAMPROW row_pointer[1];
+
+    jpeg_start_compress(cinfo, TRUE);
+
+    if(cinfo->raw_data_in) {
+        src += s->first_line * enc->width * 2;
+        write_yuv422_raw(cinfo, src, enc->width, s->lines, enc->format == V4L2_PIX_FMT_UYVY, s->line_buffer);
+    } else if (enc->format == V4L2_PIX_FMT_RGB24) {
+        /* already what libjpeg expects, no need to copy the lines */
+        src += s->first_line * enc->width * 3;
+        while(cinfo->next_scanline < cinfo->image_height) {
+            row_pointer[0] = (JSAMPROW)src;
+            jpeg_write_scanlines(cinfo, row_pointer, 1);
+            src += enc->width * 3;
+        }
+    } else if (enc->format == V4L2_PIX_FMT_RGB565) {
+        src += s->first_line * enc->width * 2;
+        while(cinfo->next_scanline < cinfo->image_height) {
+            rgb565_to_rgb24(src, s->line_buffer, enc->width);
+            src += enc->width * 2;
+
+            row_pointer[0] = s->line_buffer;
+            jpeg_write_scanlines(cinfo, row_pointer, 1);
+        }
+    }
+    /* returns the compressor to its idle state, the parameters and tables are kept */
+    jpeg_finish_compress(cinfo);
+}
+
+/******************************************************************************
+Description.: worker thread of the encoder, it compresses its slice whenever
+              the capture thread posts a new picture
+Input Value.: slice
+Return Value: NULL
+******************************************************************************/
+static void *slice_thread(void *arg)
+{
+    jpeg_slice *s = arg;
+    jpeg_encoder *enc = s->encoder;
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&enc->mutex);
+    while(1) {
+        while(enc->generation == generation && !enc->stop)
+            pthread_cond_wait(&enc->job, &enc->mutex);
+        if(enc->stop)
+            break;
+        generation = enc->generation;
+        pthread_mutex_unlock(&enc->mutex);
+
+        encode_slice(enc, s);
+
+        pthread_mutex_lock(&enc->mutex);
+        if(--enc->pending == 0)
+            pthread_cond_signal(&enc->done);
+    }
+    pthread_mutex_unlock(&enc->mutex);
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: sets up the compressor of a slice
+Input Value.: slice, video structure, the stripe and the quality
+              restart: emit a restart marker after every MCU row
+Return Value: 0 if ok, -1 if memory is exhausted
+******************************************************************************/
+static int slice_setup(jpeg_slice *s, struct vdIn *vd, int first_line, int lines, int quality, int restart)
+{
+    int raw = (vd->formatIn == V4L2_PIX_FMT_YUYV) || (vd->formatIn == V4L2_PIX_FMT_UYVY);
+
+    s->first_line = first_line;
+    s->lines = lines;
+
+    s->cinfo.err = jpeg_std_error(&s->jerr);
+    jpeg_create_compress(&s->cinfo);
+
+    /* raw input needs 16 lines of the luma and 8 of both chroma planes */
+    s->line_buffer = calloc(raw ? RAW_BUFFER_SIZE(vd->width) : vd->width * 3, 1);
+    if(s->line_buffer == NULL)
+        return -1;
+
+    s->cinfo.image_width = vd->width;
+    s->cinfo.image_height = lines;
+    s->cinfo.input_components = 3;
+    s->cinfo.in_color_space = raw ? JCS_YCbCr : JCS_RGB;
+
+    /* builds the quantization and huffman tables, they stay valid for all following images */
+    jpeg_set_defaults(&s->cinfo);
+    jpeg_set_quality(&s->cinfo, quality, TRUE);
+
+    if(raw) {
+        /* hand over the camera's samples, no colour conversion and only the vertical chroma downsampling */
+        s->cinfo.raw_data_in = TRUE;
+        s->cinfo.comp_info[0].h_samp_factor = 2;
+        s->cinfo.comp_info[0].v_samp_factor = 2;
+        s->cinfo.comp_info[1].h_samp_factor = 1;
+        s->cinfo.comp_info[1].v_samp_factor = 1;
+        s->cinfo.comp_info[2].h_samp_factor = 1;
+        s->cinfo.comp_info[2].v_samp_factor = 1;
+    }
+
+    /* the slices are stitched together at the restart markers */
+    if(restart)
+        s->cinfo.restart_in_rows = 1;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: (re)configure the compressor of a camera for its current
+              resolution, input format, the requested quality and number
+              of encoders
+Input Value.: video structure and quality
+Return Value: the encoder or NULL if memory is exhausted
+******************************************************************************/
+static jpeg_encoder *jpeg_encoder_setup(struct vdIn *vd, int quality)
+{
+    jpeg_encoder *enc = vd->encoder;
+    int count, rows, per_slice, k;
+
+    if(enc != NULL &&
+       enc->width == vd->width && enc->height == vd->height &&
+       enc->format == vd->formatIn && enc->quality == quality &&
+       enc->encoders == vd->encoders)
+        return enc;
+
+    jpeg_encoder_free(vd);
+
+    /* one slice per core unless told otherwise, a slice covers at least one MCU row */
+    count = vd->encoders;
+    if(count <= 0)
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    if(count < 1)
+        count = 1;
+
+    rows = (vd->height + SLICE_LINES - 1) / SLICE_LINES;
+    per_slice = (rows + count - 1) / count;
+    count = (rows + per_slice - 1) / per_slice;
+
+    if((enc = calloc(1, sizeof(jpeg_encoder))) == NULL)
+        return NULL;
+    if((enc->slice = calloc(count, sizeof(jpeg_slice))) == NULL) {
+        free(enc);
+        return NULL;
+    }
+
+    enc->width = vd->width;
+    enc->height = vd->height;
+    enc->format = vd->formatIn;
+    enc->quality = quality;
+    enc->encoders = vd->encoders;
+    enc->count = count;
+    pthread_mutex_init(&enc->mutex, NULL);
+    pthread_cond_init(&enc->job, NULL);
+    pthread_cond_init(&enc->done, NULL);
+    vd->encoder = enc;
+
+    for(k = 0; k < count; k++) {
+        int first_line = k * per_slice * SLICE_LINES;
+        int lines = MIN(per_slice * SLICE_LINES, vd->height - first_line);
+
+        enc->slice[k].encoder = enc;
+        if(slice_setup(&enc->slice[k], vd, first_line, lines, quality, count > 1) < 0) {
+            jpeg_encoder_free(vd);
+            return NULL;
+        }
+    }
+
+    /* slices without a worker thread are encoded by the capture thread */
+    for(k = 1; k < count; k++) {
+        if(pthread_create(&enc->slice[k].thread, NULL, slice_thread, &enc->slice[k]) != 0)
+            break;
+        enc->threads++;
+    }
+
+    return enc;
+}
+
+/******************************************************************************
+Description.: release the compressor of a camera and stop its worker threads,
+              it is created again by the next call of compress_image_to_jpeg
+Input Value.: video structure
+Return Value: -
+******************************************************************************/
+void jpeg_encoder_free(struct vdIn *vd)
+{
+    jpeg_encoder *enc = vd->encoder;
+    int k;
+
+    if(enc == NULL)
+        return;
+
+    pthread_mutex_lock(&enc->mutex);
+    enc->stop = 1;
+    pthread_cond_broadcast(&enc->job);
+    pthread_mutex_unlock(&enc->mutex);
+
+    for(k = 1; k <= enc->threads; k++)
+        pthread_join(enc->slice[k].thread, NULL);
+
+    for(k = 0; k < enc->count; k++) {
+        jpeg_destroy_compress(&enc->slice[k].cinfo);
+        free(enc->slice[k].line_buffer);
+        free(enc->slice[k].out);
+    }
+
+    pthread_mutex_destroy(&enc->mutex);
+    pthread_cond_destroy(&enc->job);
+    pthread_cond_destroy(&enc->done);
+    free(enc->slice);
+    free(enc);
+    vd->encoder = NULL;
+}
+
+/******************************************************************************
+Description.: walks the marker segments of a JPEG written by libjpeg up to
+              the start of the entropy coded data and optionally replaces the
+              picture height in the frame header
+Input Value.: JPEG data, its size and the height or 0 to leave it alone
+Return Value: offset of the entropy coded data, -1 if no scan header was found
+******************************************************************************/
+static int jpeg_scan_start(unsigned char *jpg, int size, int height)
+{
+    int pos = 2, marker, length;
+
+    while(pos + 4 <= size && jpg[pos] == 0xFF) {
+        marker = jpg[pos + 1];
+        length = (jpg[pos + 2] << 8) | jpg[pos + 3];
+
+        /* SOF0..SOF2: length, precision, height, width */
+        if(height > 0 && marker >= 0xC0 && marker <= 0xC2 && pos + 9 <= size) {
+            jpg[pos + 5] = height >> 8;
+            jpg[pos + 6] = height & 0xFF;
+        }
+
+        pos += 2 + length;
+        if(marker == 0xDA)
+            return pos;
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+Description.: joins the slices to a single baseline JPEG, every slice starts
+              at a restart marker so only the marker numbers have to be
+              continued
+Input Value.: encoder, destination buffer holding slice 0 and its size
+Return Value: size of the picture, 0 if it does not fit into the buffer
+******************************************************************************/
+static int stitch_slices(jpeg_encoder *enc, unsigned char *buffer, int size)
+{
+    int pos, start, length, rst, k;
+    unsigned char *p, *end;
+
+    if(jpeg_scan_start(buffer, enc->slice[0].written, enc->height) < 0)
+        return 0;
+
+    /* drop the EOI of the first slice */
+    pos = enc->slice[0].written - 2;
+
+    for(k = 1; k < enc->count; k++) {
+        jpeg_slice *s = &enc->slice[k];
+
+        if((start = jpeg_scan_start(s->out, s->written, 0)) < 0)
+            return 0;
+        length = s->written - 2 - start;
+        if(pos + 2 + length + 2 > size)
+            return 0;
+
+        /* restart intervals, that is MCU rows, in front of this slice */
+        rst = s->first_line / SLICE_LINES;
+
+        buffer[pos++] = 0xFF;
+        buffer[pos++] = JPEG_RST0 + ((rst - 1) & 7);
+        memcpy(buffer + pos, s->out + start, length);
+
+        /* continue the numbering of the slice's own restart markers, any other 0xFF is stuffed */
+        end = buffer + pos + length;
+        for(p = buffer + pos; p + 1 < end && (p = memchr(p, 0xFF, end - p - 1)) != NULL; p += 2) {
+            if(p[1] >= JPEG_RST0 && p[1] <= JPEG_RST0 + 7)
+                p[1] = JPEG_RST0 + ((p[1] - JPEG_RST0 + rst) & 7);
+        }
+        pos += length;
+    }
+
+    buffer[pos++] = 0xFF;
+    buffer[pos++] = JPEG_EOI;
+
+    return pos;
+}
+
 /******************************************************************************
 Description.: yuv2jpeg function is based on compress_yuyv_to_jpeg written by
               Gabriel A. Devenyi.
@@ -134,148 +713,65 @@ Description.: yuv2jpeg function is based on compress_yuyv_to_jpeg written by
               YUYV data to JPEG. Most other implementations use the
               "jpeg_stdio_dest" from libjpeg, which can not store compressed
               pictures to memory instead of a file.
-Input Value.: video structure from v4l2uvc.c/h, destination buffer and buffersize
+              The compressor and its line buffer are kept in vd->encoder
+              between calls. With more than one encoder the picture is split
+              into horizontal slices that are compressed in parallel.
+Input Value.: video structure from v4l2uvc.c/h, the captured picture,
+              destination buffer and buffersize
               the buffer must be large enough, no error/size checking is done!
-Return Value: the buffer will contain the compressed data
+Return Value: the buffer will contain the compressed data, 0 if the compressor
+              could not be allocated
 ******************************************************************************/
-int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality)
+int compress_image_to_jpeg(struct vdIn *vd, const unsigned char *src, unsigned char *buffer, int size, int quality)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    unsigned char *line_buffer, *yuyv;
-    int z;
-    static int written;
-
-    line_buffer = calloc(vd->width * 3, 1);
-    yuyv = vd->framebuffer;
-
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    /* jpeg_stdio_dest (&cinfo, file); */
-    dest_buffer(&cinfo, buffer, size, &written);
-
-    cinfo.image_width = vd->width;
-    cinfo.image_height = vd->height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-
-    jpeg_start_compress(&cinfo, TRUE);
-
-    z = 0;
-    if (vd->formatIn == V4L2_PIX_FMT_YUYV) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-
-            for(x = 0; x < vd->width; x++) {
-                int r, g, b;
-                int y, u, v;
-
-                if(!z)
-                    y = yuyv[0] << 8;
-                else
-                    y = yuyv[2] << 8;
-                u = yuyv[1] - 128;
-                v = yuyv[3] - 128;
-
-                r = (y + (359 * v)) >> 8;
-                g = (y - (88 * u) - (183 * v)) >> 8;
-                b = (y + (454 * u)) >> 8;
-
-                *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-                *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-                *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-
-                if(z++) {
-                    z = 0;
-                    yuyv += 4;
-                }
-            }
+    jpeg_encoder *enc;
+    int k, cancel_state;
 
-            row_pointer[0] = line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
-    } else if (vd->formatIn == V4L2_PIX_FMT_RGB24) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-            for(x = 0; x < vd->width; x++) {
-                *(ptr++) = yuyv[0];
-                *(ptr++) = yuyv[1];
-                *(ptr++) = yuyv[2];
-                yuyv += 3;
-            }
+    if((enc = jpeg_encoder_setup(vd, quality)) == NULL)
+        return 0;
 
-            row_pointer[0] = line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
-    } else if (vd->formatIn == V4L2_PIX_FMT_RGB565) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-            for(x = 0; x < vd->width; x++) {
-                /*
-                unsigned int tb = ((unsigned char)raw[i+1] << 8) + (unsigned char)raw[i];
-                r =  ((unsigned char)(raw[i+1]) & 248);
-                g = (unsigned char)(( tb & 2016) >> 3);
-                b =  ((unsigned char)raw[i] & 31) * 8;
-                */
-                unsigned int twoByte = (yuyv[1] << 8) + yuyv[0];
-                *(ptr++) = (yuyv[1] & 248);
-                *(ptr++) = (unsigned char)((twoByte & 2016) >> 3);
-                *(ptr++) = ((yuyv[0] & 31) * 8);
-                yuyv += 2;
-            }
+    enc->src = src;
+    dest_buffer(&enc->slice[0].cinfo, buffer, size, &enc->slice[0].written);
 
-            row_pointer[0] = line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
-    }  else if (vd->formatIn == V4L2_PIX_FMT_UYVY) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-
-            for(x = 0; x < vd->width; x++) {
-                int r, g, b;
-                int y, u, v;
-
-                if(!z)
-                    y = yuyv[1] << 8;
-                else
-                    y = yuyv[3] << 8;
-                u = yuyv[0] - 128;
-                v = yuyv[2] - 128;
-
-                r = (y + (359 * v)) >> 8;
-                g = (y - (88 * u) - (183 * v)) >> 8;
-                b = (y + (454 * u)) >> 8;
-
-                *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-                *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-                *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-
-                if(z++) {
-                    z = 0;
-                    yuyv += 4;
-                }
-            }
+    if(enc->count == 1) {
+        encode_slice(enc, &enc->slice[0]);
+        return enc->slice[0].written;
+    }
 
-            row_pointer[0] = line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    /* a slice can not get larger than the whole picture */
+    for(k = 1; k < enc->count; k++) {
+        jpeg_slice *s = &enc->slice[k];
+
+        if(s->out_size < size) {
+            free(s->out);
+            if((s->out = malloc(size)) == NULL) {
+                s->out_size = 0;
+                return 0;
+            }
+            s->out_size = size;
         }
+        dest_buffer(&s->cinfo, s->out, s->out_size, &s->written);
     }
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
 
-    free(line_buffer);
+    /* the workers use the frame buffer, do not leave them behind on cancellation */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+
+    pthread_mutex_lock(&enc->mutex);
+    enc->generation++;
+    enc->pending = enc->threads;
+    pthread_cond_broadcast(&enc->job);
+    pthread_mutex_unlock(&enc->mutex);
+
+    encode_slice(enc, &enc->slice[0]);
+    for(k = enc->threads + 1; k < enc->count; k++)
+        encode_slice(enc, &enc->slice[k]);
+
+    pthread_mutex_lock(&enc->mutex);
+    while(enc->pending > 0)
+        pthread_cond_wait(&enc->done, &enc->mutex);
+    pthread_mutex_unlock(&enc->mutex);
+
+    pthread_setcancelstate(cancel_state, NULL);
 
-    return (written);
+    return stitch_slices(enc, buffer, size);
 }
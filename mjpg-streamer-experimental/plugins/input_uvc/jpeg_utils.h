@@ -1 +1,2 @@
-int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality);
+int compress_image_to_jpeg(struct vdIn *vd, const unsigned char *src, unsigned char *buffer, int size, int quality);
+void jpeg_encoder_free(struct vdIn *vd);
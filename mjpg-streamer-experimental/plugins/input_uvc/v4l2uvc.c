@@ -87,8 +87,9 @@ int xioctl(int fd, int IOCTL_X, void *arg)
 }
 
 static int init_v4l2(struct vdIn *vd);
-static int init_framebuffer(struct vdIn *vd);
-static void free_framebuffer(struct vdIn *vd);
+static int init_framesize(struct vdIn *vd);
+static int init_buffers(struct vdIn *vd);
+static void free_buffers(struct vdIn *vd);
 
 int init_videoIn(struct vdIn *vd, char *device, int width,
                  int height, int fps, int format, int grabmethod, globals *pglobal, int id, v4l2_std_id vstd)
@@ -116,6 +117,14 @@ int init_videoIn(struct vdIn *vd, char *device, int width,
 	vd->vstd = vstd;
     vd->grabmethod = grabmethod;
     vd->soft_framedrop = 0;
+    if(vd->nbuffers <= 0)
+        vd->nbuffers = NB_BUFFER;
+    if(vd->nbuffers > MAX_BUFFER)
+        vd->nbuffers = MAX_BUFFER;
+    if(vd->memory != V4L2_MEMORY_USERPTR)
+        vd->memory = V4L2_MEMORY_MMAP;
+    vd->queue.head = vd->queue.tail = 0;
+    sem_init(&vd->queue.filled, 0, 0);
 
     if(init_v4l2(vd) < 0) {
         goto error;
@@ -212,13 +221,14 @@ int init_videoIn(struct vdIn *vd, char *device, int width,
         }
     }
 
-    if (init_framebuffer(vd) < 0) {
+    if (init_framesize(vd) < 0) {
         goto error;
     }
 
     return 0;
 error:
-    free_framebuffer(vd);
+    free_buffers(vd);
+    sem_destroy(&vd->queue.filled);
     free(pglobal->in[id].in_parameters);
     free(vd->videodevice);
     free(vd->status);
@@ -227,49 +237,29 @@ error:
     return -1;
 }
 
-static int init_framebuffer(struct vdIn *vd) {
-    /* alloc a temp buffer to reconstruct the pict */
+/* the frames are encoded straight from the mapped buffers, only their size is needed */
+static int init_framesize(struct vdIn *vd) {
     vd->framesizeIn = (vd->width * vd->height << 1);
     switch (vd->formatIn) {
         case V4L2_PIX_FMT_JPEG:
             // Fall-through intentional
-        case V4L2_PIX_FMT_MJPEG: // in JPG mode the frame size is varies at every frame, so we allocate a bit bigger buffer
-            vd->tmpbuffer = (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
-            if(!vd->tmpbuffer)
-                return -1;
-            vd->framebuffer =
-                (unsigned char *) calloc(1, (size_t) vd->width * (vd->height + 8) * 2);
+        case V4L2_PIX_FMT_MJPEG: // in JPG mode the frame size is varies at every frame, so this is a bit bigger
+        case V4L2_PIX_FMT_RGB565:
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
             break;
         case V4L2_PIX_FMT_RGB24:
             vd->framesizeIn = (vd->width * vd->height) * 3;
-            vd->framebuffer =
-                (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
-            break;
-        case V4L2_PIX_FMT_RGB565: // buffer allocation for non varies on frame size formats
-        case V4L2_PIX_FMT_YUYV:
-        case V4L2_PIX_FMT_UYVY:
-            vd->framebuffer =
-                (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
             break;
         default:
             fprintf(stderr, "Unknown vd->formatIn\n");
             return -1;
     }
-    return -!vd->framebuffer;
-}
-
-static void free_framebuffer(struct vdIn *vd) {
-    if (vd->tmpbuffer) {
-        free(vd->tmpbuffer);
-    }
-    vd->tmpbuffer = NULL;
-    free(vd->framebuffer);
-    vd->framebuffer = NULL;
+    return 0;
 }
 
 static int init_v4l2(struct vdIn *vd)
 {
-    int i;
     int ret = 0;
     if((vd->fd = OPEN_VIDEO(vd->videodevice, O_RDWR)) == -1) {
         perror("ERROR opening V4L interface");
@@ -426,24 +416,85 @@ static int init_v4l2(struct vdIn *vd)
         }
     }
 
-    /*
-     * request buffers
-     */
+    if(init_buffers(vd) < 0)
+        goto fatal;
+
+    return 0;
+fatal:
+    fprintf(stderr, "Init v4L2 failed !! exit fatal\n");
+    return -1;
+
+}
+
+/******************************************************************************
+Description.: requests the capture buffers from the driver, maps them or
+              allocates them ourselves for user pointer I/O and queues them.
+              Drivers that refuse user pointers get memory mapped buffers.
+Input Value.: video structure, nbuffers and memory select count and type
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int init_buffers(struct vdIn *vd)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size;
+    int ret, i;
+
     memset(&vd->rb, 0, sizeof(struct v4l2_requestbuffers));
-    vd->rb.count = NB_BUFFER;
+    vd->rb.count = vd->nbuffers;
     vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vd->rb.memory = V4L2_MEMORY_MMAP;
+    vd->rb.memory = vd->memory;
 
     ret = xioctl(vd->fd, VIDIOC_REQBUFS, &vd->rb);
+    if(ret < 0 && vd->memory == V4L2_MEMORY_USERPTR) {
+        fprintf(stderr, " i: The driver does not support user pointers, using mmap instead\n");
+        vd->memory = V4L2_MEMORY_MMAP;
+        memset(&vd->rb, 0, sizeof(struct v4l2_requestbuffers));
+        vd->rb.count = vd->nbuffers;
+        vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        vd->rb.memory = vd->memory;
+        ret = xioctl(vd->fd, VIDIOC_REQBUFS, &vd->rb);
+    }
     if(ret < 0) {
         perror("Unable to allocate buffers");
-        goto fatal;
+        return -1;
     }
 
-    /*
-     * map the buffers
-     */
-    for(i = 0; i < NB_BUFFER; i++) {
+    /* the driver may hand out less or more buffers than asked for */
+    if(vd->rb.count > MAX_BUFFER)
+        vd->rb.count = MAX_BUFFER;
+    if(vd->rb.count == 0) {
+        fprintf(stderr, "The driver did not allocate any buffers\n");
+        return -1;
+    }
+    if(vd->rb.count != vd->nbuffers)
+        fprintf(stderr, " i: The driver uses %u buffers instead of %d\n", vd->rb.count, vd->nbuffers);
+
+    if(vd->memory == V4L2_MEMORY_USERPTR) {
+        if((vd->pool = calloc(1, sizeof(uvc_pool))) == NULL) {
+            fprintf(stderr, "Unable to allocate buffer pool\n");
+            return -1;
+        }
+        pthread_mutex_init(&vd->pool->mutex, NULL);
+        vd->pool->vd = vd;
+    }
+
+    for(i = 0; i < vd->rb.count; i++) {
+        if(vd->memory == V4L2_MEMORY_USERPTR) {
+            /* the image size as reported by the driver, rounded up to whole pages */
+            size = vd->fmt.fmt.pix.sizeimage ? vd->fmt.fmt.pix.sizeimage : vd->width * vd->height * 3;
+            size = (size + page - 1) & ~(page - 1);
+            if(posix_memalign(&vd->mem[i], page, size) != 0) {
+                vd->mem[i] = NULL;
+                fprintf(stderr, "Unable to allocate buffer\n");
+                return -1;
+            }
+            vd->memlength[i] = size;
+            continue;
+        }
+
+        /*
+         * map the buffers
+         */
         memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
         vd->buf.index = i;
         vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -451,7 +502,7 @@ static int init_v4l2(struct vdIn *vd)
         ret = xioctl(vd->fd, VIDIOC_QUERYBUF, &vd->buf);
         if(ret < 0) {
             perror("Unable to query buffer");
-            goto fatal;
+            return -1;
         }
 
         if(debug)
@@ -461,9 +512,11 @@ static int init_v4l2(struct vdIn *vd)
                           vd->buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, vd->fd,
                           vd->buf.m.offset);
         if(vd->mem[i] == MAP_FAILED) {
+            vd->mem[i] = NULL;
             perror("Unable to map buffer");
-            goto fatal;
+            return -1;
         }
+        vd->memlength[i] = vd->buf.length;
         if(debug)
             fprintf(stderr, "Buffer mapped at address %p.\n", vd->mem[i]);
     }
@@ -471,22 +524,51 @@ static int init_v4l2(struct vdIn *vd)
     /*
      * Queue the buffers.
      */
-    for(i = 0; i < NB_BUFFER; ++i) {
-        memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
-        vd->buf.index = i;
-        vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        vd->buf.memory = V4L2_MEMORY_MMAP;
-        ret = xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
-        if(ret < 0) {
-            perror("Unable to queue buffer");
-            goto fatal;;
-        }
+    for(i = 0; i < vd->rb.count; ++i) {
+        if(video_requeue(vd, i) < 0)
+            return -1;
     }
+
     return 0;
-fatal:
-    fprintf(stderr, "Init v4L2 failed !! exit fatal\n");
-    return -1;
+}
+
+/******************************************************************************
+Description.: unmaps or frees the capture buffers, streaming must be off.
+              User pointer buffers that are lent to frames are left to them.
+Input Value.: video structure
+Return Value: -
+******************************************************************************/
+static void free_buffers(struct vdIn *vd)
+{
+    uvc_pool *pool = vd->pool;
+    int i, last = 1;
+
+    if(pool != NULL) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->vd = NULL;
+        last = (pool->lent == 0);
+    }
+
+    for(i = 0; i < MAX_BUFFER; i++) {
+        if(vd->mem[i] == NULL)
+            continue;
+        if(vd->memory == V4L2_MEMORY_USERPTR) {
+            if(pool == NULL || !pool->borrowed[i])
+                free(vd->mem[i]);
+        } else {
+            munmap(vd->mem[i], vd->memlength[i]);
+        }
+        vd->mem[i] = NULL;
+    }
 
+    if(pool != NULL) {
+        pthread_mutex_unlock(&pool->mutex);
+        if(last) {
+            pthread_mutex_destroy(&pool->mutex);
+            free(pool);
+        }
+        vd->pool = NULL;
+    }
 }
 
 int video_enable(struct vdIn *vd)
@@ -587,34 +669,179 @@ int is_huffman(unsigned char *buf)
 }
 
 /******************************************************************************
-Description.:
-Input Value.:
-Return Value:
+Description.: walks the marker segments behind the SOI of a MJPEG frame up to
+              the huffman tables or the start of the scan
+Input Value.: frame, size and where to store the offset of the frame header
+              (SOF0), -1 if there is none before the stop
+Return Value: offset of the marker the walk stopped at
+******************************************************************************/
+static int walk_header(unsigned char *buf, int size, int *sof)
+{
+    int pos = 2, length;
+
+    *sof = -1;
+
+    /* SOI followed by marker segments that carry their length */
+    while(pos + 4 <= size && buf[pos] == 0xff) {
+        if(buf[pos + 1] == 0xff) {
+            /* fill byte */
+            pos++;
+            continue;
+        }
+        if(buf[pos + 1] == 0xc4 || buf[pos + 1] == 0xda)
+            break;
+        if(buf[pos + 1] == 0xc0)
+            *sof = pos;
+
+        length = (buf[pos + 2] << 8) | buf[pos + 3];
+        pos += 2 + length;
+    }
+
+    return pos;
+}
+
+/******************************************************************************
+Description.: copies a MJPEG frame from the mapped buffer, many UVC cameras
+              leave out the huffman tables so the default ones get inserted
+              in front of the frame header. The marker segments up to the
+              start of the scan are walked once to find out, frames with a
+              broken header are scanned byte by byte as before.
+Input Value.: destination of at least size + DHT_SIZE bytes, frame and size
+Return Value: size of the copied picture, 0 if there is no frame header
 ******************************************************************************/
 int memcpy_picture(unsigned char *out, unsigned char *buf, int size)
 {
     unsigned char *ptdeb, *ptlimit, *ptcur = buf;
-    int sizein, pos = 0;
+    int sizein, pos, sof;
+
+    pos = walk_header(buf, size, &sof);
+
+    if(pos + 2 <= size && buf[pos] == 0xff && buf[pos + 1] == 0xc4)
+        goto copy;
+
+    if(pos + 2 <= size && buf[pos] == 0xff && buf[pos + 1] == 0xda) {
+        if(sof < 0)
+            return 0;
 
+        memcpy(out, buf, sof);
+        memcpy(out + sof, dht_data, sizeof(dht_data));
+        memcpy(out + sof + sizeof(dht_data), buf + sof, size - sof);
+        return size + sizeof(dht_data);
+    }
+
+    /* the header could not be walked, look for the markers the old way */
     if(!is_huffman(buf)) {
         ptdeb = ptcur = buf;
         ptlimit = buf + size;
         while((((ptcur[0] << 8) | ptcur[1]) != 0xffc0) && (ptcur < ptlimit))
             ptcur++;
         if(ptcur >= ptlimit)
-            return pos;
+            return 0;
         sizein = ptcur - ptdeb;
 
-        memcpy(out + pos, buf, sizein); pos += sizein;
-        memcpy(out + pos, dht_data, sizeof(dht_data)); pos += sizeof(dht_data);
-        memcpy(out + pos, ptcur, size - sizein); pos += size - sizein;
+        memcpy(out, buf, sizein);
+        memcpy(out + sizein, dht_data, sizeof(dht_data));
+        memcpy(out + sizein + sizeof(dht_data), ptcur, size - sizein);
+        return size + sizeof(dht_data);
+    }
+
+copy:
+    memcpy(out, buf, size);
+    return size;
+}
+
+/******************************************************************************
+Description.: gives a lent user pointer buffer back to the driver once the last
+              reference to its frame is dropped, called by any thread. If the
+              device gave up its buffers meanwhile the buffer is freed instead.
+Input Value.: frame from buffer_lend
+Return Value: -
+******************************************************************************/
+static void buffer_return(frame *f)
+{
+    uvc_pool *pool = f->owner;
+    struct vdIn *vd;
+    int i, last;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->lent--;
+    if((vd = pool->vd) == NULL) {
+        free(f->buf);
     } else {
-        memcpy(out + pos, ptcur, size); pos += size;
+        for(i = 0; i < MAX_BUFFER && vd->mem[i] != f->buf; i++);
+        if(i < MAX_BUFFER) {
+            pool->borrowed[i] = 0;
+            /* a paused device gets all of its buffers queued again when it is restarted */
+            if(vd->streamingState == STREAMING_ON && video_requeue(vd, i) < 0) {
+                IPRINT("Error requeueing frames\n");
+            }
+        }
     }
-    return pos;
+    last = (pool->vd == NULL && pool->lent == 0);
+    pthread_mutex_unlock(&pool->mutex);
+
+    if(last) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+    }
+    free(f);
 }
 
-int uvcGrab(struct vdIn *vd)
+/******************************************************************************
+Description.: publishes a MJPEG frame straight from its user pointer buffer,
+              the buffer goes back to the driver with the last reference.
+              Frames without huffman tables need the copy of memcpy_picture
+              and LEND_RESERVE buffers always stay with the driver, so slow
+              consumers can not starve the capture.
+Input Value.: video structure and the dequeued buffer
+Return Value: detached frame that borrows the buffer, NULL if the frame has to
+              be copied
+******************************************************************************/
+frame *buffer_lend(struct vdIn *vd, const uvc_buffer *b)
+{
+    uvc_pool *pool = vd->pool;
+    unsigned char *buf = vd->mem[b->index];
+    frame *f;
+    int sof, pos;
+
+    if(pool == NULL)
+        return NULL;
+
+    pos = walk_header(buf, (int)b->bytesused, &sof);
+    if(pos + 2 > (int)b->bytesused || buf[pos] != 0xff || buf[pos + 1] != 0xc4)
+        return NULL;
+
+    if((f = calloc(1, sizeof(frame))) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if(pool->lent + LEND_RESERVE >= (int)vd->rb.count) {
+        pthread_mutex_unlock(&pool->mutex);
+        free(f);
+        return NULL;
+    }
+    pool->lent++;
+    pool->borrowed[b->index] = 1;
+    pthread_mutex_unlock(&pool->mutex);
+
+    f->buf = buf;
+    f->size = b->bytesused;
+    f->capacity = vd->memlength[b->index];
+    f->refcount = 1;
+    f->detached = 1;
+    f->release = buffer_return;
+    f->owner = pool;
+    return f;
+}
+
+/******************************************************************************
+Description.: takes the next filled buffer from the driver, the buffer stays
+              owned by the caller until it is given back with video_requeue
+Input Value.: video structure and the buffer description to fill in
+Return Value: 0 if a frame was dequeued, 1 if an empty frame was skipped,
+              -1 on errors
+******************************************************************************/
+int video_dequeue(struct vdIn *vd, uvc_buffer *b)
 {
 #define HEADERFRAME1 0xaf
     int ret;
@@ -625,7 +852,7 @@ int uvcGrab(struct vdIn *vd)
     }
     memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
     vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vd->buf.memory = V4L2_MEMORY_MMAP;
+    vd->buf.memory = vd->memory;
 
     ret = xioctl(vd->fd, VIDIOC_DQBUF, &vd->buf);
     if(ret < 0) {
@@ -641,20 +868,11 @@ int uvcGrab(struct vdIn *vd)
             /* Prevent crash
              * on empty image */
             fprintf(stderr, "Ignoring empty buffer ...\n");
-            break;
+            if(video_requeue(vd, vd->buf.index) < 0)
+                goto err;
+            return 1;
         }
 
-        /* memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
-
-        memcpy (vd->tmpbuffer, vd->mem[vd->buf.index], HEADERFRAME1);
-        memcpy (vd->tmpbuffer + HEADERFRAME1, dht_data, sizeof(dht_data));
-        memcpy (vd->tmpbuffer + HEADERFRAME1 + sizeof(dht_data), vd->mem[vd->buf.index] + HEADERFRAME1, (vd->buf.bytesused - HEADERFRAME1));
-        */
-
-        memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
-        vd->tmpbytesused = vd->buf.bytesused;
-        vd->tmptimestamp = vd->buf.timestamp;
-
         if(debug) {
             fprintf(stderr, "bytes in used %d \n", vd->buf.bytesused);
         }
@@ -663,24 +881,21 @@ int uvcGrab(struct vdIn *vd)
     case V4L2_PIX_FMT_RGB565:
     case V4L2_PIX_FMT_YUYV:
     case V4L2_PIX_FMT_UYVY:
-        if(vd->buf.bytesused > vd->framesizeIn) {
-            memcpy(vd->framebuffer, vd->mem[vd->buf.index], (size_t) vd->framesizeIn);
-        } else {
-            memcpy(vd->framebuffer, vd->mem[vd->buf.index], (size_t) vd->buf.bytesused);
-        }
-        vd->tmpbytesused = vd->buf.bytesused;
-        vd->tmptimestamp = vd->buf.timestamp;
         break;
     default:
         goto err;
         break;
     }
 
-    ret = xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
-    if(ret < 0) {
-        perror("Unable to requeue buffer");
-        goto err;
-    }
+    b->index = vd->buf.index;
+    b->bytesused = vd->buf.bytesused;
+    b->timestamp = vd->buf.timestamp;
+    b->dequeued = frame_clock();
+    b->captured = 0;
+    if((vd->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        b->captured = vd->buf.timestamp.tv_sec * 1000000000LL + vd->buf.timestamp.tv_usec * 1000LL;
+    vd->tmpbytesused = vd->buf.bytesused;
+    vd->tmptimestamp = vd->buf.timestamp;
 
     return 0;
 
@@ -689,11 +904,103 @@ err:
     return -1;
 }
 
+/******************************************************************************
+Description.: gives a buffer back to the driver to be filled again
+Input Value.: video structure and the buffer index
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+int video_requeue(struct vdIn *vd, unsigned int index)
+{
+    struct v4l2_buffer buf;
+
+    /* the encoding thread requeues as well, so vd->buf can not be used here */
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+    buf.index = index;
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = vd->memory;
+    if(vd->memory == V4L2_MEMORY_USERPTR) {
+        buf.m.userptr = (unsigned long)vd->mem[index];
+        buf.length = vd->memlength[index];
+    }
+
+    if(xioctl(vd->fd, VIDIOC_QBUF, &buf) < 0) {
+        perror("Unable to requeue buffer");
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: hands a dequeued buffer over to the encoding thread, called by
+              the capture thread only
+Input Value.: video structure and the buffer
+Return Value: 0 if ok, -1 if the queue is full
+******************************************************************************/
+int buffer_queue_push(struct vdIn *vd, const uvc_buffer *b)
+{
+    uvc_queue *q = &vd->queue;
+    unsigned int head = q->head;
+
+    if(head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= MAX_BUFFER)
+        return -1;
+
+    q->slot[head % MAX_BUFFER] = *b;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    sem_post(&q->filled);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: waits for the oldest buffer of the queue, called by the encoding
+              thread only. The slot stays occupied until buffer_queue_release.
+Input Value.: video structure and the buffer to fill in
+Return Value: 0 if ok, -1 if woken up without a buffer
+******************************************************************************/
+int buffer_queue_peek(struct vdIn *vd, uvc_buffer *b)
+{
+    uvc_queue *q = &vd->queue;
+    unsigned int tail = q->tail;
+
+    while(sem_wait(&q->filled) < 0 && errno == EINTR);
+
+    if(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail)
+        return -1;
+
+    *b = q->slot[tail % MAX_BUFFER];
+    return 0;
+}
+
+/******************************************************************************
+Description.: frees the slot of the buffer returned by buffer_queue_peek after
+              it was requeued
+Input Value.: video structure
+Return Value: -
+******************************************************************************/
+void buffer_queue_release(struct vdIn *vd)
+{
+    __atomic_store_n(&vd->queue.tail, vd->queue.tail + 1, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+Description.: waits until the encoding thread gave back all buffers, the
+              buffers must not be unmapped before
+Input Value.: video structure
+Return Value: -
+******************************************************************************/
+void buffer_queue_drain(struct vdIn *vd)
+{
+    while(__atomic_load_n(&vd->queue.tail, __ATOMIC_ACQUIRE) != vd->queue.head)
+        usleep(1000);
+}
+
 int close_v4l2(struct vdIn *vd)
 {
     if(vd->streamingState == STREAMING_ON)
         video_disable(vd, STREAMING_OFF);
-    free_framebuffer(vd);
+    free_buffers(vd);
+    sem_destroy(&vd->queue.filled);
     free(vd->videodevice);
     free(vd->status);
     free(vd->pictName);
@@ -970,16 +1277,14 @@ void control_readed(struct vdIn *vd, struct v4l2_queryctrl *ctrl, globals *pglob
 int setResolution(struct vdIn *vd, int width, int height)
 {
     vd->streamingState = STREAMING_PAUSED;
+    buffer_queue_drain(vd);
     if (video_disable(vd, STREAMING_PAUSED) < 0) {
         IPRINT("Unable to disable streaming\n");
         return -1;
     }
 
     DBG("Unmap buffers\n");
-    int i;
-    for (i = 0; i < NB_BUFFER; i++) {
-        munmap(vd->mem[i], vd->buf.length);
-    }
+    free_buffers(vd);
 
     if (CLOSE_VIDEO(vd->fd) == 0) {
         DBG("Device closed successfully\n");
@@ -991,9 +1296,8 @@ int setResolution(struct vdIn *vd, int width, int height)
         return -1;
     }
 
-    free_framebuffer(vd);
-    if (init_framebuffer(vd) < 0) {
-        IPRINT("Can\'t reallocate framebuffer\n");
+    if (init_framesize(vd) < 0) {
+        IPRINT("Can\'t handle the new frame size\n");
         return -1;
     }
 
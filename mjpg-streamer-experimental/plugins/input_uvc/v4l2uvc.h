@@ -36,12 +36,18 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/select.h>
+#include <semaphore.h>
 
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
 
 #include "../../mjpg_streamer.h"
 #define NB_BUFFER 4
+#define MAX_BUFFER 32
+/* size of the default huffman tables memcpy_picture inserts, see huffman.h */
+#define DHT_SIZE 420
+/* user pointer buffers that are never lent to consumers, see buffer_lend() */
+#define LEND_RESERVE 2
 
 
 #define IOCTL_RETRY 4
@@ -73,6 +79,41 @@ enum _streaming_state {
     STREAMING_PAUSED = 2,
 };
 
+typedef struct _jpeg_encoder jpeg_encoder;
+
+/* a buffer dequeued by the capture thread, it goes back to the driver once it is encoded */
+typedef struct {
+    unsigned int index;
+    uint32_t bytesused;
+    struct timeval timestamp;
+    long long captured;         /* driver timestamp on the frame_clock(), 0 if not monotonic */
+    long long dequeued;         /* frame_clock() when it was dequeued */
+} uvc_buffer;
+
+/*
+ * lock-free queue between the capture thread (producer) and the encoding
+ * thread (consumer), a slot is released only after its buffer was requeued
+ */
+typedef struct {
+    uvc_buffer slot[MAX_BUFFER];
+    unsigned int head;
+    unsigned int tail;
+    sem_t filled;
+} uvc_queue;
+
+/*
+ * the user pointer buffers of one VIDIOC_REQBUFS, MJPEG frames are published
+ * straight from them. Consumers may drop such a frame after the buffers were
+ * given up (close_v4l2, setResolution), so the pool is freed by whoever lets
+ * go of it last and a buffer that is lent at that time is freed with its frame.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    struct vdIn *vd;            /* NULL once the buffers were given up */
+    int lent;                   /* frames that borrow a buffer */
+    unsigned char borrowed[MAX_BUFFER];
+} uvc_pool;
+
 struct vdIn {
     int fd;
     char *videodevice;
@@ -82,9 +123,12 @@ struct vdIn {
     struct v4l2_format fmt;
     struct v4l2_buffer buf;
     struct v4l2_requestbuffers rb;
-    void *mem[NB_BUFFER];
-    unsigned char *tmpbuffer;
-    unsigned char *framebuffer;
+    void *mem[MAX_BUFFER];
+    size_t memlength[MAX_BUFFER];
+    int nbuffers; // buffers to request from the driver
+    uint32_t memory; // V4L2_MEMORY_MMAP or V4L2_MEMORY_USERPTR
+    uvc_pool *pool; // lends the user pointer buffers to frames
+    uvc_queue queue;
     streaming_state streamingState;
     int grabmethod;
     int width;
@@ -115,6 +159,8 @@ struct vdIn {
     unsigned long frame_period_time; // in ms
     unsigned char soft_framedrop;
     unsigned int dv_timings;
+    int encoders; // JPEG slices encoded in parallel, 0 = one per CPU core
+    jpeg_encoder *encoder; // libjpeg compressor, kept between frames
 };
 
 /* optional initial settings */
@@ -141,6 +187,10 @@ typedef struct {
     int id;
     globals *pglobal;
     pthread_t threadID;
+    pthread_t encodeID;
+    int encoding;
+    int encode_stop;
+    int quality;
     pthread_mutex_t controls_mutex;
     struct vdIn *videoIn;
     context_settings *init_settings;
@@ -152,7 +202,13 @@ void control_readed(struct vdIn *vd, struct v4l2_queryctrl *ctrl, globals *pglob
 int setResolution(struct vdIn *vd, int width, int height);
 
 int memcpy_picture(unsigned char *out, unsigned char *buf, int size);
-int uvcGrab(struct vdIn *vd);
+frame *buffer_lend(struct vdIn *vd, const uvc_buffer *b);
+int video_dequeue(struct vdIn *vd, uvc_buffer *b);
+int video_requeue(struct vdIn *vd, unsigned int index);
+int buffer_queue_push(struct vdIn *vd, const uvc_buffer *b);
+int buffer_queue_peek(struct vdIn *vd, uvc_buffer *b);
+void buffer_queue_release(struct vdIn *vd);
+void buffer_queue_drain(struct vdIn *vd);
 int close_v4l2(struct vdIn *vd);
 
 int video_enable(struct vdIn *vd);
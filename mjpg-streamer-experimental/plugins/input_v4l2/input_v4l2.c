@@ -20,7 +20,6 @@
 #define INPUT_PLUGIN_NAME "V4L2 input plugin"
 #define MAX_ARGUMENTS 32
 #define JPEG_BUFFER_SIZE (2 * 1024 * 1024)
-#define MAX_BUFFERS 4
 #define MAX_INPUT_PLUGINS 10
 
 enum {
@@ -65,6 +64,8 @@ int input_init(input_parameter *param, int id) {
         {"device", required_argument, 0, 'd'},
         {"resolution", required_argument, 0, 'r'},
         {"fps", required_argument, 0, 'f'},
+        {"buffers", required_argument, 0, 'b'},
+        {"userptr", no_argument, 0, 'u'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
@@ -72,7 +73,7 @@ int input_init(input_parameter *param, int id) {
     optind = 0;
     
     int c;
-    while ((c = getopt_long(argc, argv, "d:r:f:h", long_options, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "d:r:f:b:uh", long_options, NULL)) != -1) {
         switch (c) {
             case 'd':
                 ctx->device = strdup(optarg);
@@ -83,6 +84,13 @@ int input_init(input_parameter *param, int id) {
             case 'f':
                 ctx->fps = atoi(optarg);
                 break;
+            case 'b':
+                ctx->v4l2.n_requested = atoi(optarg) > 0 ? atoi(optarg) : DEFAULT_BUFFERS;
+                if (ctx->v4l2.n_requested > MAX_BUFFERS) ctx->v4l2.n_requested = MAX_BUFFERS;
+                break;
+            case 'u':
+                ctx->v4l2.memory = V4L2_MEMORY_USERPTR;
+                break;
             case 'h':
                 free(ctx);
                 plugin_contexts[id] = NULL;
@@ -259,7 +267,7 @@ int input_run(int id) {
     }
 
     int index = v4l2_capture_frame(&ctx->v4l2);
-    if (index < 0 || index >= MAX_BUFFERS) {
+    if (index < 0 || index >= (int)ctx->v4l2.n_buffers) {
         return -1;
     }
     
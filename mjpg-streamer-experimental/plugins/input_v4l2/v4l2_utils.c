@@ -8,6 +8,35 @@
 #include <string.h>
 #include <sys/select.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// 释放缓冲区: mmap 的解除映射, USERPTR 的由我们自己分配
+static void v4l2_free_buffers(v4l2_dev_t* dev) {
+    for (uint32_t i = 0; i < MAX_BUFFERS; ++i) {
+        if (dev->buffers[i]) {
+            if (dev->memory == V4L2_MEMORY_USERPTR) {
+                free(dev->buffers[i]);
+            } else {
+                munmap(dev->buffers[i], dev->buffer_lengths[i]);
+            }
+            dev->buffers[i] = NULL;
+        }
+    }
+    dev->n_buffers = 0;
+}
+
+// 填写 QBUF/DQBUF 需要的字段
+static void v4l2_prepare_buf(v4l2_dev_t* dev, uint32_t index) {
+    CLEAR(dev->buf);
+    dev->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    dev->buf.memory = dev->memory;
+    dev->buf.index = index;
+    if (dev->memory == V4L2_MEMORY_USERPTR) {
+        dev->buf.m.userptr = (unsigned long)dev->buffers[index];
+        dev->buf.length = dev->buffer_lengths[index];
+    }
+}
 
 int v4l2_open(const char* device) {
     return open(device, O_RDWR | O_NONBLOCK);
@@ -42,14 +71,29 @@ int v4l2_init(v4l2_dev_t* dev, int width, int height, int fps, int format) {
         ioctl(dev->fd, VIDIOC_S_PARM, &parm);
     }
 
+    // 重新初始化时先释放旧的缓冲区
+    v4l2_free_buffers(dev);
+    if (dev->memory != V4L2_MEMORY_USERPTR) {
+        dev->memory = V4L2_MEMORY_MMAP;
+    }
+
     struct v4l2_requestbuffers req;
     CLEAR(req);
-    req.memory = V4L2_MEMORY_MMAP;
+    req.memory = dev->memory;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.count = 4;
+    req.count = dev->n_requested ? dev->n_requested : DEFAULT_BUFFERS;
     
     if (ioctl(dev->fd, VIDIOC_REQBUFS, &req) < 0) {
-        return -1;
+        if (dev->memory != V4L2_MEMORY_USERPTR) {
+            return -1;
+        }
+        // 驱动不支持 USERPTR, 回退到 MMAP
+        fprintf(stderr, "USERPTR not supported by the driver, using MMAP\n");
+        dev->memory = V4L2_MEMORY_MMAP;
+        req.memory = dev->memory;
+        if (ioctl(dev->fd, VIDIOC_REQBUFS, &req) < 0) {
+            return -1;
+        }
     }
 
     dev->n_buffers = req.count;
@@ -57,6 +101,25 @@ int v4l2_init(v4l2_dev_t* dev, int width, int height, int fps, int format) {
         dev->n_buffers = MAX_BUFFERS;
     }
     
+    if (dev->memory == V4L2_MEMORY_USERPTR) {
+        long page = sysconf(_SC_PAGESIZE);
+        size_t size = actual_fmt.fmt.pix.sizeimage;
+
+        if (size == 0) {
+            size = actual_fmt.fmt.pix.width * actual_fmt.fmt.pix.height * 2;
+        }
+        size = (size + page - 1) & ~(page - 1);
+
+        for (uint32_t i = 0; i < dev->n_buffers; ++i) {
+            if (posix_memalign(&dev->buffers[i], page, size) != 0) {
+                dev->buffers[i] = NULL;
+                return -1;
+            }
+            dev->buffer_lengths[i] = size;
+        }
+        return 0;
+    }
+
     for (uint32_t i = 0; i < dev->n_buffers; ++i) {
         CLEAR(dev->buf);
         dev->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -81,10 +144,7 @@ int v4l2_init(v4l2_dev_t* dev, int width, int height, int fps, int format) {
 
 int v4l2_start_capture(v4l2_dev_t* dev) {
     for (uint32_t i = 0; i < dev->n_buffers; ++i) {
-        CLEAR(dev->buf);
-        dev->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        dev->buf.memory = V4L2_MEMORY_MMAP;
-        dev->buf.index = i;
+        v4l2_prepare_buf(dev, i);
         if (ioctl(dev->fd, VIDIOC_QBUF, &dev->buf) < 0) {
             return -1;
         }
@@ -114,7 +174,7 @@ int v4l2_capture_frame(v4l2_dev_t* dev) {
     
     CLEAR(dev->buf);
     dev->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    dev->buf.memory = V4L2_MEMORY_MMAP;
+    dev->buf.memory = dev->memory;
     
     if (ioctl(dev->fd, VIDIOC_DQBUF, &dev->buf) < 0) {
         return -1;
@@ -125,11 +185,7 @@ int v4l2_capture_frame(v4l2_dev_t* dev) {
 
 void v4l2_close(v4l2_dev_t* dev) {
     if (dev->fd != -1) {
-        for (uint32_t i = 0; i < dev->n_buffers; ++i) {
-            if (dev->buffers[i]) {
-                munmap(dev->buffers[i], dev->buffer_lengths[i]);
-            }
-        }
+        v4l2_free_buffers(dev);
         close(dev->fd);
         dev->fd = -1;
     }
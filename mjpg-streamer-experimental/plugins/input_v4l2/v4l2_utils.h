@@ -23,7 +23,8 @@
 #endif
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
-#define MAX_BUFFERS 4
+#define MAX_BUFFERS 32
+#define DEFAULT_BUFFERS 4
 
 typedef struct {
     int fd;
@@ -32,6 +33,8 @@ typedef struct {
     void* buffers[MAX_BUFFERS];
     size_t buffer_lengths[MAX_BUFFERS]; // 存储每个缓冲区的长度
     uint32_t n_buffers;
+    uint32_t n_requested; // 请求的缓冲区数量, 0 = DEFAULT_BUFFERS
+    uint32_t memory;      // V4L2_MEMORY_MMAP 或 V4L2_MEMORY_USERPTR
 } v4l2_dev_t;
 
 int v4l2_open(const char* device);
@@ -21,6 +21,9 @@
 *******************************************************************************/
 
 #include "../mjpg_streamer.h"
+#include "../metrics.h"
+#include "../trace.h"
+#include "../hook.h"
 #define OUTPUT_PLUGIN_PREFIX " o: "
 #define OPRINT(...) { char _bf[1024] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", OUTPUT_PLUGIN_PREFIX); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
 
@@ -48,6 +51,9 @@ struct _output {
     struct _control *out_parameters;
     int parametercount;
 
+    /* statistics, updated atomically */
+    output_metrics metrics;
+
     int (*init)(output_parameter *param, int id);
     int (*stop)(int);
     int (*run)(int);
@@ -19,6 +19,10 @@
 # Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
 #                                                                              #
 *******************************************************************************/
+
+/* syncfs() */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -36,23 +40,85 @@
 #include <time.h>
 #include <syslog.h>
 #include <dirent.h>
+#include <strings.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include "output_file.h"
+#include "recording.h"
 
 #include "../../utils.h"
 #include "../../mjpg_streamer.h"
 
 #define OUTPUT_PLUGIN_NAME "FILE output plugin"
 
-static pthread_t worker;
+/* most frames the writer thread takes from the queue at once */
+#define BATCH_MAX 64
+
+static pthread_t worker, writer;
 static globals *pglobal;
-static int fd, delay, ringbuffer_size = -1, ringbuffer_exceed = 0, max_frame_size;
+static int delay, ringbuffer_size = -1, ringbuffer_exceed = 0;
 static char *folder = "/tmp";
-static unsigned char *frame = NULL;
+static frame *current = NULL;
 static char *command = NULL;
 static int input_number = 0;
+static int plugin_id = 0;
 static char *mjpgFileName = NULL;
 static char *linkFileName = NULL;
+static recording rec = { .fd = -1, .index_fd = -1 };
+static hook events = { .capacity = 64 };
+
+/* a picture of the ring buffer */
+typedef struct {
+    char name[64];      /* file name within the folder */
+    off_t bytes;
+} ring_entry;
+
+/*
+ * The pictures of the ring buffer as a FIFO, oldest first. It is read from
+ * the folder once and then maintained along with the pictures written, so
+ * deleting the oldest picture does not involve scanning the folder.
+ */
+static ring_entry *ring = NULL;
+static int ring_capacity = 0, ring_head = 0, ring_count = 0;
+static unsigned long long ring_bytes = 0;
+
+/* a frame waiting for the writer thread, the queue holds a reference */
+typedef struct {
+    frame *f;           /* NULL marks the end of a clip */
+    time_t received;    /* the time the file name is made of */
+    int forced;         /* queued regardless of the queue size */
+} write_job;
+
+/*
+ * Frames are written by a separate thread, so slow storage does not stall
+ * the worker thread that receives them. If the queue is full the frame is
+ * dropped and counted, instead of blocking. The pre-roll of a clip is queued
+ * at once and does not count against the queue size, the queue grows for it.
+ */
+static write_job *queue = NULL;
+static int queue_size = 32, queue_capacity = 0, queue_head = 0, queue_count = 0, queue_forced = 0;
+static int writer_quit = 0;
+static int batch_size = 8, sync_interval = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* a received frame, kept in case an event happens */
+typedef struct {
+    frame *f;
+    time_t received;
+    long long clock;    /* frame_clock() when it was received */
+} preroll_entry;
+
+/*
+ * With a pre-roll or post-roll only clips around events get saved. The frames
+ * of the last "preroll" seconds are held by reference; when a clip gets
+ * triggered they are written, followed by the frames of "postroll" seconds.
+ */
+static int preroll = 0, postroll = 0;
+static preroll_entry *pre = NULL;
+static int pre_capacity = 0, pre_head = 0, pre_count = 0;
+static int triggered = 0;
 
 /******************************************************************************
 Description.: print a help message
@@ -66,7 +132,11 @@ void help(void)
             " ---------------------------------------------------------------\n" \
             " The following parameters can be passed to this plugin:\n\n" \
             " [-f | --folder ]........: folder to save pictures\n" \
-            " [-m | --mjpeg ].........: save the frames to an mjpg file \n" \
+            " [-m | --mjpeg ].........: save the frames to an mjpg file, a name\n" \
+            "                           ending with .avi records an AVI file\n" \
+            " [-st | --segment-time ].: start a new file after this many seconds\n" \
+            " [-ss | --segment-size ].: start a new file before it exceeds this\n" \
+            "                           many MB\n" \
             " [-l | --link ]..........: link the last picture in ringbuffer as this fixed named file\n" \
             " [-d | --delay ].........: delay after saving pictures in ms\n" \
             " [-i | --input ].........: read frames from the specified input plugin\n" \
@@ -74,6 +144,19 @@ void help(void)
             " [-s | --size ]..........: size of ring buffer (max number of pictures to hold)\n" \
             " [-e | --exceed ]........: allow ringbuffer to exceed limit by this amount\n" \
             " [-c | --command ].......: execute command after saving picture\n"\
+            " [-k | --hook ]..........: start this command once, it gets a line\n" \
+            "                           on stdin for every saved frame\n" \
+            " [-hook-json ]...........: the lines are JSON objects\n" \
+            " [-hook-queue ]..........: events waiting for the hook, further\n" \
+            "                           events are dropped (default 64)\n" \
+            " [-q | --queue ].........: frames waiting to be written, further\n" \
+            "                           frames are dropped (default 32)\n" \
+            " [-b | --batch ].........: frames written at once (default 8)\n" \
+            " [-sync ]................: ms between two fdatasync calls,\n" \
+            "                           0 leaves it to the system (default)\n" \
+            " [-pre | --preroll ].....: only save clips when triggered, starting\n" \
+            "                           this many seconds before the trigger\n" \
+            " [-post | --postroll ]...: and ending this many seconds after it\n" \
             " ---------------------------------------------------------------\n");
 }
 
@@ -86,10 +169,6 @@ void worker_cleanup(void *arg)
 {
     static unsigned char first_run = 1;
 
-    if (mjpgFileName != NULL) {
-        close(fd);
-    }
-
     if(!first_run) {
         DBG("already cleaned up resources\n");
         return;
@@ -98,10 +177,16 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    if(frame != NULL) {
-        free(frame);
+    frame_unref(current);
+    current = NULL;
+
+    while(pre_count > 0) {
+        frame_unref(pre[pre_head].f);
+        pre_head = (pre_head + 1) % pre_capacity;
+        pre_count--;
     }
-    close(fd);
+    free(pre);
+    pre = NULL;
 }
 
 /******************************************************************************
@@ -145,194 +230,469 @@ int check_for_filename(const struct dirent *entry)
 }
 
 /******************************************************************************
-Description.: delete oldest files, just keep "size" most recent files
-              This funtion MAY delete the wrong files if the time is not valid
-Input Value.: how many files to keep
-Return Value: -
+Description.: append a picture to the ring buffer index, the index grows if
+              it is full
+Input Value.: * name...: file name within the folder
+              * bytes..: size of the file
+Return Value: 0 if OK, -1 if memory is missing
 ******************************************************************************/
-void maintain_ringbuffer(int size)
+static int ring_push(const char *name, off_t bytes)
+{
+    ring_entry *entries;
+    int i, capacity;
+
+    if(ring_count == ring_capacity) {
+        capacity = (ring_capacity > 0) ? 2 * ring_capacity : 1024;
+        if((entries = malloc(capacity * sizeof(ring_entry))) == NULL)
+            return -1;
+
+        /* unwrap the entries while copying, the oldest goes first */
+        for(i = 0; i < ring_count; i++)
+            entries[i] = ring[(ring_head + i) % ring_capacity];
+
+        free(ring);
+        ring = entries;
+        ring_capacity = capacity;
+        ring_head = 0;
+    }
+
+    i = (ring_head + ring_count) % ring_capacity;
+    snprintf(ring[i].name, sizeof(ring[i].name), "%s", name);
+    ring[i].bytes = bytes;
+    ring_count++;
+    ring_bytes += bytes;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: build the ring buffer index from the pictures already in the
+              folder, this is the only time the folder gets scanned
+Input Value.: -
+Return Value: 0 if OK, -1 if the folder can not be read
+******************************************************************************/
+static int ring_load(void)
 {
     struct dirent **namelist;
-    int n, i;
+    struct stat stats;
     char buffer[1<<16];
+    int n, i;
 
-    /* do nothing if ringbuffer is not set or wrong value is set */
-    if(size < 0) return;
-
-    /* get a sorted list of directory items */
+    /* get a sorted list of directory items, the names start with the time */
     n = scandir(folder, &namelist, check_for_filename, alphasort);
     if(n < 0) {
         perror("scandir");
-        return;
+        return -1;
     }
 
     DBG("found %d directory entries\n", n);
 
-    /* delete the first (thus oldest) number of files */
-    for(i = 0; i < (n - size); i++) {
+    for(i = 0; i < n; i++) {
+        snprintf(buffer, sizeof(buffer), "%s/%s", folder, namelist[i]->d_name);
+        if(stat(buffer, &stats) == 0)
+            ring_push(namelist[i]->d_name, stats.st_size);
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: delete oldest files, just keep "size" most recent files
+Input Value.: how many files to keep
+Return Value: -
+******************************************************************************/
+void maintain_ringbuffer(int size)
+{
+    char buffer[1<<16];
+    ring_entry *oldest;
+
+    /* do nothing if ringbuffer is not set or wrong value is set */
+    if(size < 0) return;
+
+    while(ring_count > size) {
+        oldest = &ring[ring_head];
 
         /* put together the folder name and the directory item */
-        snprintf(buffer, sizeof(buffer), "%s/%s", folder, namelist[i]->d_name);
+        snprintf(buffer, sizeof(buffer), "%s/%s", folder, oldest->name);
 
         DBG("delete: %s\n", buffer);
 
-        /* mark item for deletion */
-        if(unlink(buffer) == -1) {
+        /* somebody else may have deleted it already */
+        if(unlink(buffer) == -1 && errno != ENOENT) {
             perror("could not delete file");
         }
 
-        /* free allocated memory for name */
-        free(namelist[i]);
+        ring_bytes -= oldest->bytes;
+        ring_head = (ring_head + 1) % ring_capacity;
+        ring_count--;
     }
+}
 
-    /* keep the rest, but we still have to free every result */
-    for(i = MAX(n - size, 0); i < n; i++) {
-        DBG("keep: %s\n", namelist[i]->d_name);
-        free(namelist[i]);
+/******************************************************************************
+Description.: hand a frame over to the writer thread
+Input Value.: * f......: frame, the queue takes over the reference, NULL ends
+                         the current clip
+              * received: time the frame was received
+              * forced.: queue it even if the queue is full
+Return Value: 0 if queued, -1 if the queue is full or memory is missing
+******************************************************************************/
+static int queue_push(frame *f, time_t received, int forced)
+{
+    write_job *job, *jobs;
+    int i, capacity;
+
+    pthread_mutex_lock(&queue_mutex);
+    if(!forced && queue_count - queue_forced >= queue_size) {
+        pthread_mutex_unlock(&queue_mutex);
+        return -1;
     }
 
-    /* free last just allocated resources */
-    free(namelist);
+    if(queue_count == queue_capacity) {
+        capacity = 2 * queue_capacity;
+        if((jobs = malloc(capacity * sizeof(write_job))) == NULL) {
+            pthread_mutex_unlock(&queue_mutex);
+            return -1;
+        }
+
+        /* unwrap the jobs while copying, the oldest goes first */
+        for(i = 0; i < queue_count; i++)
+            jobs[i] = queue[(queue_head + i) % queue_capacity];
+
+        free(queue);
+        queue = jobs;
+        queue_capacity = capacity;
+        queue_head = 0;
+    }
+
+    job = &queue[(queue_head + queue_count) % queue_capacity];
+    job->f = f;
+    job->received = received;
+    job->forced = forced;
+    queue_count++;
+    if(forced)
+        queue_forced++;
+
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+
+    return 0;
 }
 
 /******************************************************************************
-Description.: this is the main worker thread
-              it loops forever, grabs a fresh frame and stores it to file
-Input Value.:
-Return Value:
+Description.: keep a frame for the pre-roll and drop the frames that became
+              too old for it
+Input Value.: * f......: frame, the pre-roll takes over the reference
+              * now....: frame_clock() when it was received
+Return Value: -
 ******************************************************************************/
-void *worker_thread(void *arg)
+static void preroll_add(frame *f, long long now)
+{
+    preroll_entry *entries;
+    int i, capacity;
+
+    while(pre_count > 0 && now - pre[pre_head].clock > preroll * 1000000000LL) {
+        frame_unref(pre[pre_head].f);
+        pre_head = (pre_head + 1) % pre_capacity;
+        pre_count--;
+    }
+
+    if(pre_count == pre_capacity) {
+        capacity = (pre_capacity > 0) ? 2 * pre_capacity : 64;
+        if((entries = malloc(capacity * sizeof(preroll_entry))) == NULL) {
+            frame_unref(f);
+            return;
+        }
+
+        for(i = 0; i < pre_count; i++)
+            entries[i] = pre[(pre_head + i) % pre_capacity];
+
+        free(pre);
+        pre = entries;
+        pre_capacity = capacity;
+        pre_head = 0;
+    }
+
+    i = (pre_head + pre_count) % pre_capacity;
+    pre[i].f = f;
+    pre[i].received = time(NULL);
+    pre[i].clock = now;
+    pre_count++;
+}
+
+/******************************************************************************
+Description.: a clip starts, hand the pre-roll over to the writer thread
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void preroll_flush(void)
+{
+    while(pre_count > 0) {
+        if(queue_push(pre[pre_head].f, pre[pre_head].received, 1) < 0)
+            frame_unref(pre[pre_head].f);
+        pre_head = (pre_head + 1) % pre_capacity;
+        pre_count--;
+    }
+}
+
+/******************************************************************************
+Description.: save a frame as a single picture of the ringbuffer, link it and
+              run the command
+Input Value.: * job....: the frame and the time it was received
+              * counter: number of the picture for its file name
+Return Value: 0 if OK, -1 in case of an error
+******************************************************************************/
+static int write_picture(write_job *job, unsigned long long counter)
 {
-    int ok = 1, frame_size = 0, rc = 0;
     char buffer1[1024] = {0}, buffer2[1024] = {0};
-    unsigned long long counter = 0;
-    time_t t;
+    struct iovec iov;
     struct tm *now;
-    unsigned char *tmp_framebuffer = NULL;
+    long long start;
+    int rc, file;
 
-    /* set cleanup handler to cleanup allocated resources */
-    pthread_cleanup_push(worker_cleanup, NULL);
+    now = localtime(&job->received);
+    if(now == NULL) {
+        perror("localtime");
+        return -1;
+    }
 
-    while(ok >= 0 && !pglobal->stop) {
-        DBG("waiting for fresh frame\n");
+    /* prepare string, add time and date values */
+    if(strftime(buffer1, sizeof(buffer1), "%%s/%Y_%m_%d_%H_%M_%S_picture_%%09llu.jpg", now) == 0) {
+        OPRINT("strftime returned 0\n");
+        return -1;
+    }
 
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    /* finish filename by adding the foldername and a counter value */
+    snprintf(buffer2, sizeof(buffer2), buffer1, folder, counter);
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+    DBG("writing file: %s\n", buffer2);
 
-        /* check if buffer for frame is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+    /* open file for write */
+    if((file = open(buffer2, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        OPRINT("could not open the file %s\n", buffer2);
+        return -1;
+    }
 
-            max_frame_size = frame_size + (1 << 16);
-            if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                LOG("not enough memory\n");
-                return NULL;
-            }
+    /* save picture to file */
+    start = frame_clock();
+    iov.iov_base = job->f->buf;
+    iov.iov_len = job->f->size;
+    if(write_all(file, &iov, 1) < 0) {
+        OPRINT("could not write to file %s\n", buffer2);
+        perror("write()");
+        close(file);
+        return -1;
+    }
+    metrics_sent(&pglobal->out[plugin_id], job->f->size);
+    trace_send(plugin_id, job->f, start);
 
-            frame = tmp_framebuffer;
-        }
+    close(file);
 
-        /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+    if(events.command != NULL)
+        hook_event(&events, buffer2, job->f);
 
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+    if(ringbuffer_size >= 0 && ring_push(buffer2 + strlen(folder) + 1, job->f->size) < 0) {
+        LOG("not enough memory for the ringbuffer index\n");
+    }
 
-        if (mjpgFileName == NULL) { // single files with ringbuffer mode
-            /* prepare filename */
-            memset(buffer1, 0, sizeof(buffer1));
-            memset(buffer2, 0, sizeof(buffer2));
+    /* link the picture as fixed name file */
+    if (linkFileName) {
+        snprintf(buffer1, sizeof(buffer1), "%s/%s", folder, linkFileName);
+        unlink(buffer1);
+        (void) link(buffer2, buffer1);
+    }
 
-            /* get current time */
-            t = time(NULL);
-            now = localtime(&t);
-            if(now == NULL) {
-                perror("localtime");
-                return NULL;
-            }
+    /* call the command if user specified one, pass current filename as argument */
+    if(command != NULL) {
+        memset(buffer1, 0, sizeof(buffer1));
 
-            /* prepare string, add time and date values */
-            if(strftime(buffer1, sizeof(buffer1), "%%s/%Y_%m_%d_%H_%M_%S_picture_%%09llu.jpg", now) == 0) {
-                OPRINT("strftime returned 0\n");
-                free(frame); frame = NULL;
-                return NULL;
-            }
+        /* buffer2 still contains the filename, pass it to the command as parameter */
+        snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, buffer2);
+        DBG("calling command %s", buffer1);
 
-            /* finish filename by adding the foldername and a counter value */
-            snprintf(buffer2, sizeof(buffer2), buffer1, folder, counter);
+        /* in addition provide the filename as environment variable */
+        if((rc = setenv("MJPG_FILE", buffer2, 1)) != 0) {
+            LOG("setenv failed (return value %d)\n", rc);
+        }
 
-            counter++;
+        /* execute the command now */
+        if((rc = system(buffer1)) != 0) {
+            LOG("command failed (return value %d)\n", rc);
+        }
+    }
 
-            DBG("writing file: %s\n", buffer2);
+    /*
+     * maintain ringbuffer
+     * with an exceed value the oldest pictures are deleted in batches,
+     * once the ringbuffer has grown by that amount
+     */
+    if(ring_count > ringbuffer_size + MAX(ringbuffer_exceed, 0)) {
+        DBG("counter: %llu, will clean-up now\n", counter);
+        maintain_ringbuffer(ringbuffer_size);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: the writer thread takes batches of frames from the queue and
+              writes them, either as single pictures or appended to the MJPG
+              file with a single call. The data gets synced periodically if
+              configured. It exits once the queue is empty after output_stop.
+Input Value.: unused
+Return Value: NULL
+******************************************************************************/
+void *writer_thread(void *arg)
+{
+    write_job jobs[BATCH_MAX];
+    frame *frames[BATCH_MAX];
+    unsigned long long counter = 0;
+    long long start, synced = frame_clock();
+    int i, j, k, m, n, dir = -1;
+
+    /* the pictures of the ringbuffer are synced all at once by their file system */
+    if(mjpgFileName == NULL && sync_interval > 0 &&
+       (dir = open(folder, O_RDONLY | O_DIRECTORY)) < 0) {
+        perror("could not open the folder for syncing");
+    }
+
+    while(1) {
+        pthread_mutex_lock(&queue_mutex);
+        while(queue_count == 0 && !writer_quit)
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+
+        if(queue_count == 0) {
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
 
-            /* open file for write */
-            if((fd = open(buffer2, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-                OPRINT("could not open the file %s\n", buffer2);
-                return NULL;
+        n = MIN(queue_count, batch_size);
+        for(i = 0; i < n; i++) {
+            jobs[i] = queue[(queue_head + i) % queue_capacity];
+            if(jobs[i].forced)
+                queue_forced--;
+        }
+        queue_head = (queue_head + n) % queue_capacity;
+        queue_count -= n;
+        pthread_mutex_unlock(&queue_mutex);
+
+        if(mjpgFileName == NULL) {
+            for(i = 0; i < n; i++) {
+                if(jobs[i].f != NULL)
+                    write_picture(&jobs[i], counter++);
             }
+        } else {
+            for(i = 0; i < n; i = j + 1) {
+                /* the frames up to the end of a clip */
+                for(j = i, m = 0; j < n && jobs[j].f != NULL; j++)
+                    frames[m++] = jobs[j].f;
+
+                start = frame_clock();
+                if(m > 0 && recording_write(&rec, frames, m) < 0) {
+                    OPRINT("could not write to the recording %s in %s\n", rec.name, rec.folder);
+                    perror("write()");
+                } else {
+                    for(k = 0; k < m; k++) {
+                        metrics_sent(&pglobal->out[plugin_id], frames[k]->size);
+                        trace_send(plugin_id, frames[k], start);
+                        if(events.command != NULL)
+                            hook_event(&events, rec.path, frames[k]);
+                    }
+                }
 
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
-                OPRINT("could not write to file %s\n", buffer2);
-                perror("write()");
-                close(fd);
-                return NULL;
+                /* every clip is a file of its own */
+                if(j < n)
+                    recording_close(&rec);
             }
+        }
 
-            close(fd);
+        for(i = 0; i < n; i++)
+            frame_unref(jobs[i].f);
 
-            /* link the picture as fixed name file */
-            if (linkFileName) {
-                snprintf(buffer1, sizeof(buffer1), "%s/%s", folder, linkFileName);
-                unlink(buffer1);
-                (void) link(buffer2, buffer1);
-            }
+        if(sync_interval > 0 && frame_clock() - synced >= sync_interval * 1000000LL) {
+            if(mjpgFileName != NULL)
+                recording_sync(&rec);
+            else if(dir >= 0)
+                syncfs(dir);
+            synced = frame_clock();
+        }
+    }
 
-            /* call the command if user specified one, pass current filename as argument */
-            if(command != NULL) {
-                memset(buffer1, 0, sizeof(buffer1));
+    if(mjpgFileName != NULL)
+        recording_close(&rec);
+    if(dir >= 0) {
+        syncfs(dir);
+        close(dir);
+    }
 
-                /* buffer2 still contains the filename, pass it to the command as parameter */
-                snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, buffer2);
-                DBG("calling command %s", buffer1);
+    /* only this thread uses the ringbuffer index */
+    free(ring);
+    ring = NULL;
+    ring_capacity = ring_count = ring_head = 0;
 
-                /* in addition provide the filename as environment variable */
-                if((rc = setenv("MJPG_FILE", buffer2, 1)) != 0) {
-                    LOG("setenv failed (return value %d)\n", rc);
-                }
+    return NULL;
+}
 
-                /* execute the command now */
-                if((rc = system(buffer1)) != 0) {
-                    LOG("command failed (return value %d)\n", rc);
-                }
+/******************************************************************************
+Description.: this is the main worker thread
+              it loops forever, grabs a fresh frame and queues it for the
+              writer thread
+Input Value.:
+Return Value:
+******************************************************************************/
+void *worker_thread(void *arg)
+{
+    unsigned long long seq = FRAME_SEQ_FRESH;
+    long long now, clip_end = 0;
+    int clip = 0;
+
+    /* set cleanup handler to cleanup allocated resources */
+    pthread_cleanup_push(worker_cleanup, NULL);
+
+    while(!pglobal->stop) {
+        DBG("waiting for fresh frame\n");
+
+        /* the frame is not copied, the queue holds a reference until it is written */
+        if((current = frame_ring_next(&pglobal->in[input_number], seq)) == NULL) {
+            LOG("not enough memory\n");
+            return NULL;
+        }
+        seq = current->seq;
+        now = frame_clock();
+
+        if(preroll > 0 || postroll > 0) {
+            /* a new trigger starts a clip or makes the current one longer */
+            if(__sync_lock_test_and_set(&triggered, 0)) {
+                DBG("clip triggered\n");
+                if(!clip)
+                    preroll_flush();
+                clip = 1;
+                clip_end = now + postroll * 1000000000LL;
             }
 
-            /*
-             * maintain ringbuffer
-             * do not maintain ringbuffer for each picture, this saves resources since
-             * each run of the maintainance function involves sorting/malloc/free operations
-             */
-            if(ringbuffer_exceed <= 0) {
-                /* keep ringbuffer excactly at specified siOUTPUT_PLUGIN_NAMEze */
-                maintain_ringbuffer(ringbuffer_size);
-            } else if(counter == 1 || counter % (ringbuffer_exceed + 1) == 0) {
-                DBG("counter: %llu, will clean-up now\n", counter);
-                maintain_ringbuffer(ringbuffer_size);
+            if(clip && now > clip_end) {
+                DBG("clip ends\n");
+                clip = 0;
+                if(queue_push(NULL, 0, 1) < 0)
+                    LOG("not enough memory\n");
             }
-        } else { // recording to MJPG file
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
-                OPRINT("could not write to file %s\n", buffer2);
-                perror("write()");
-                close(fd);
-                return NULL;
+
+            if(!clip) {
+                preroll_add(current, now);
+                current = NULL;
+                continue;
             }
         }
 
+        /* the storage does not keep up */
+        if(queue_push(current, time(NULL), 0) < 0) {
+            DBG("write queue is full, dropping frame %llu\n", seq);
+            metrics_output_drop(&pglobal->out[plugin_id]);
+            frame_unref(current);
+        }
+        current = NULL;
+
         /* if specified, wait now */
         if(delay > 0) {
             usleep(1000 * delay);
@@ -357,6 +717,7 @@ int output_init(output_parameter *param, int id)
 	int i;
     delay = 0;
     pglobal = param->global;
+    plugin_id = id;
     pglobal->out[id].name = malloc((1+strlen(OUTPUT_PLUGIN_NAME))*sizeof(char));
     sprintf(pglobal->out[id].name, "%s", OUTPUT_PLUGIN_NAME);
     DBG("OUT plugin %d name: %s\n", id, pglobal->out[id].name);
@@ -390,6 +751,23 @@ int output_init(output_parameter *param, int id)
             {"link", required_argument, 0, 0},
             {"c", required_argument, 0, 0},
             {"command", required_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"queue", required_argument, 0, 0},
+            {"b", required_argument, 0, 0},
+            {"batch", required_argument, 0, 0},
+            {"sync", required_argument, 0, 0},
+            {"st", required_argument, 0, 0},
+            {"segment-time", required_argument, 0, 0},
+            {"ss", required_argument, 0, 0},
+            {"segment-size", required_argument, 0, 0},
+            {"pre", required_argument, 0, 0},
+            {"preroll", required_argument, 0, 0},
+            {"post", required_argument, 0, 0},
+            {"postroll", required_argument, 0, 0},
+            {"k", required_argument, 0, 0},
+            {"hook", required_argument, 0, 0},
+            {"hook-json", no_argument, 0, 0},
+            {"hook-queue", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -467,6 +845,63 @@ int output_init(output_parameter *param, int id)
             DBG("case 16,17\n");
             command = strdup(optarg);
             break;
+            /* q queue */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            queue_size = atoi(optarg);
+            break;
+            /* b batch */
+        case 20:
+        case 21:
+            DBG("case 20,21\n");
+            batch_size = atoi(optarg);
+            break;
+            /* sync */
+        case 22:
+            DBG("case 22\n");
+            sync_interval = atoi(optarg);
+            break;
+            /* st segment-time */
+        case 23:
+        case 24:
+            DBG("case 23,24\n");
+            rec.segment_seconds = atoi(optarg);
+            break;
+            /* ss segment-size */
+        case 25:
+        case 26:
+            DBG("case 25,26\n");
+            rec.segment_bytes = atoll(optarg) * 1024 * 1024;
+            break;
+            /* pre preroll */
+        case 27:
+        case 28:
+            DBG("case 27,28\n");
+            preroll = atoi(optarg);
+            break;
+            /* post postroll */
+        case 29:
+        case 30:
+            DBG("case 29,30\n");
+            postroll = atoi(optarg);
+            break;
+            /* k hook */
+        case 31:
+        case 32:
+            DBG("case 31,32\n");
+            events.command = strdup(optarg);
+            break;
+            /* hook-json */
+        case 33:
+            DBG("case 33\n");
+            events.json = 1;
+            break;
+            /* hook-queue */
+        case 34:
+            DBG("case 34\n");
+            events.capacity = atoi(optarg);
+            break;
         }
     }
 
@@ -478,28 +913,70 @@ int output_init(output_parameter *param, int id)
     OPRINT("output folder.....: %s\n", folder);
     OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
     OPRINT("delay after save..: %d\n", delay);
+
+    if(queue_size < 1 || batch_size < 1) {
+        OPRINT("ERROR: queue and batch must hold at least one frame\n");
+        return 1;
+    }
+    batch_size = MIN(batch_size, BATCH_MAX);
+    queue_capacity = queue_size;
+    if((queue = calloc(queue_capacity, sizeof(write_job))) == NULL) {
+        OPRINT("ERROR: not enough memory for the write queue\n");
+        return 1;
+    }
+
+    OPRINT("write queue.......: %d frames, batches of %d\n", queue_size, batch_size);
+    if(sync_interval > 0) {
+        OPRINT("fdatasync.........: every %d ms\n", sync_interval);
+    } else {
+        OPRINT("fdatasync.........: %s\n", "left to the system");
+    }
+    if(events.command != NULL) {
+        OPRINT("hook..............: %s, %d events queued as %s\n", events.command, events.capacity, events.json ? "JSON" : "lines");
+        if(events.capacity < 1) {
+            OPRINT("ERROR: the hook queue must hold at least one event\n");
+            return 1;
+        }
+        events.out = &pglobal->out[id];
+    }
+    if(preroll > 0 || postroll > 0) {
+        OPRINT("clips.............: %d s before to %d s after a trigger\n", preroll, postroll);
+    }
     if  (mjpgFileName == NULL) {
         if(ringbuffer_size > 0) {
             OPRINT("ringbuffer size...: %d to %d\n", ringbuffer_size, ringbuffer_size + ringbuffer_exceed);
         } else {
             OPRINT("ringbuffer size...: %s\n", "no ringbuffer");
         }
-    } else {
-        char *fnBuffer = malloc(strlen(mjpgFileName) + strlen(folder) + 3);
-        sprintf(fnBuffer, "%s/%s", folder, mjpgFileName);
 
-        OPRINT("output file.......: %s\n", fnBuffer);
-        if((fd = open(fnBuffer, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-            OPRINT("could not open the file %s\n", fnBuffer);
-            free(fnBuffer);
+        if(ringbuffer_size >= 0) {
+            if(ring_load() < 0)
+                return 1;
+            OPRINT("pictures in folder: %d, %llu bytes\n", ring_count, ring_bytes);
+        }
+    } else {
+        rec.folder = folder;
+        rec.name = mjpgFileName;
+        rec.sync = (sync_interval > 0);
+        rec.avi = (strlen(mjpgFileName) > 4 && strcasecmp(mjpgFileName + strlen(mjpgFileName) - 4, ".avi") == 0);
+        rec.clips = (preroll > 0 || postroll > 0);
+
+        /* clips open their files when they start */
+        if(!rec.clips && recording_open(&rec) < 0) {
+            OPRINT("could not open the file %s in %s\n", rec.name, rec.folder);
             return 1;
         }
-        free(fnBuffer);
+
+        OPRINT("output file.......: %s\n", rec.name);
+        OPRINT("container.........: %s\n", rec.avi ? "AVI/MJPEG" : "concatenated JPG");
+        if(rec.segment_seconds > 0 || rec.segment_bytes > 0) {
+            OPRINT("segments..........: %d s, %lld MB\n", rec.segment_seconds, rec.segment_bytes / (1024 * 1024));
+        }
     }
 
-    param->global->out[id].parametercount = 2;
+    param->global->out[id].parametercount = 3;
 
-    param->global->out[id].out_parameters = (control*) calloc(2, sizeof(control));
+    param->global->out[id].out_parameters = (control*) calloc(3, sizeof(control));
 
     control take_ctrl;
 	take_ctrl.group = IN_CMD_GENERIC;
@@ -533,6 +1010,22 @@ int output_init(output_parameter *param, int id)
 
 	param->global->out[id].out_parameters[1] = filename_ctrl;
 
+    control trigger_ctrl;
+	trigger_ctrl.group = IN_CMD_GENERIC;
+	trigger_ctrl.menuitems = NULL;
+	trigger_ctrl.value = 1;
+	trigger_ctrl.class_id = 0;
+
+	trigger_ctrl.ctrl.id = OUT_FILE_CMD_TRIGGER;
+	trigger_ctrl.ctrl.type = V4L2_CTRL_TYPE_BUTTON;
+	strcpy((char*) trigger_ctrl.ctrl.name, "Trigger clip");
+	trigger_ctrl.ctrl.minimum = 0;
+	trigger_ctrl.ctrl.maximum = 1;
+	trigger_ctrl.ctrl.step = 1;
+	trigger_ctrl.ctrl.default_value = 0;
+
+	param->global->out[id].out_parameters[2] = trigger_ctrl;
+
 
     return 0;
 }
@@ -546,6 +1039,22 @@ int output_stop(int id)
 {
     DBG("will cancel worker thread\n");
     pthread_cancel(worker);
+
+    /* the writer finishes the frames it has got */
+    pthread_mutex_lock(&queue_mutex);
+    if(writer_quit) {
+        pthread_mutex_unlock(&queue_mutex);
+        return 0;
+    }
+    writer_quit = 1;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_join(writer, NULL);
+
+    /* the hook gets the events of the last frames written */
+    if(events.command != NULL)
+        hook_stop(&events);
+
     return 0;
 }
 
@@ -556,7 +1065,12 @@ Return Value: always 0
 ******************************************************************************/
 int output_run(int id)
 {
-    DBG("launching worker thread\n");
+    DBG("launching writer and worker thread\n");
+    if(events.command != NULL && hook_start(&events) < 0) {
+        OPRINT("could not set up the hook\n");
+        events.command = NULL;
+    }
+    pthread_create(&writer, 0, writer_thread, NULL);
     pthread_create(&worker, 0, worker_thread, NULL);
     pthread_detach(worker);
     return 0;
@@ -574,35 +1088,13 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
 					switch(control_id) {
                             case OUT_FILE_CMD_TAKE: {
                                 if (valueStr != NULL) {
-                                    int frame_size = 0;
-                                    unsigned char *tmp_framebuffer = NULL;
+                                    frame *f;
 
-                                    if(pthread_mutex_lock(&pglobal->in[input_number].db)) {
-                                        DBG("Unable to lock mutex\n");
+                                    /* the worker thread may use the latest frame as well, both just hold a reference */
+                                    if((f = frame_ring_latest(&pglobal->in[input_number])) == NULL) {
+                                        DBG("No frame available\n");
                                         return -1;
                                     }
-                                    /* read buffer */
-                                    frame_size = pglobal->in[input_number].size;
-
-                                    /* check if buffer for frame is large enough, increase it if necessary */
-                                    if(frame_size > max_frame_size) {
-                                        DBG("increasing buffer size to %d\n", frame_size);
-
-                                        max_frame_size = frame_size + (1 << 16);
-                                        if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                                            pthread_mutex_unlock(&pglobal->in[input_number].db);
-                                            LOG("not enough memory\n");
-                                            return -1;
-                                        }
-
-                                        frame = tmp_framebuffer;
-                                    }
-
-                                    /* copy frame to our local buffer now */
-                                    memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-                                    /* allow others to access the global buffer again */
-                                    pthread_mutex_unlock(&pglobal->in[input_number].db);
 
                                     DBG("writing file: %s\n", valueStr);
 
@@ -610,18 +1102,21 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                     /* open file for write */
                                     if((fd = open(valueStr, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
                                         OPRINT("could not open the file %s\n", valueStr);
+                                        frame_unref(f);
                                         return -1;
                                     }
 
                                     /* save picture to file */
-                                    if(write(fd, frame, frame_size) < 0) {
+                                    if(write(fd, f->buf, f->size) < 0) {
                                         OPRINT("could not write to file %s\n", valueStr);
                                         perror("write()");
                                         close(fd);
+                                        frame_unref(f);
                                         return -1;
                                     }
 
                                     close(fd);
+                                    frame_unref(f);
                                 } else {
                                     DBG("No filename specified\n");
                                     return -1;
@@ -631,6 +1126,15 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                 DBG("Not yet implemented\n");
                                 return -1;
                             } break;
+                            case OUT_FILE_CMD_TRIGGER: {
+                                if(preroll <= 0 && postroll <= 0) {
+                                    DBG("Clips are not enabled\n");
+                                    return -1;
+                                }
+
+                                /* the worker thread starts the clip with its next frame */
+                                __sync_lock_test_and_set(&triggered, 1);
+                            } break;
                             default: {
                                 DBG("Unknown command\n");
                                 return -1;
@@ -0,0 +1,482 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Recording of frames into a single file or into rolling segments.
+
+  An AVI file is written in a single pass: the header gets written with
+  placeholders first, the frames follow as "00dc" chunks of the "movi" list.
+  When the file is closed the "idx1" index is appended and the sizes, the
+  number of frames and the frame rate in the header are filled in. The frame
+  rate is the average of the recorded frames, since the input plugins do not
+  have a fixed one.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "../../utils.h"
+
+#include "recording.h"
+
+/* size of the AVI header up to and including the fourcc of the "movi" list */
+#define AVI_HEADER_SIZE 224
+
+/* position of the "movi" fourcc, the "idx1" offsets are relative to it */
+#define AVI_MOVI 220
+
+#define AVIF_HASINDEX 0x10
+#define AVIIF_KEYFRAME 0x10
+
+/******************************************************************************
+Description.: write several buffers completely
+Input Value.: * fd.....: file to write to
+              * iov....: buffers, they get modified
+              * count..: number of buffers
+Return Value: 0 if OK, -1 in case of an error
+******************************************************************************/
+int write_all(int fd, struct iovec *iov, int count)
+{
+    ssize_t rc;
+
+    while(count > 0) {
+        if((rc = writev(fd, iov, MIN(count, IOV_MAX))) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        /* skip what was written, a buffer may be written partly */
+        while(count > 0 && rc >= (ssize_t)iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
+/* little endian values for the AVI file and the index */
+static void put_le16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put_le32(unsigned char *p, unsigned int v)
+{
+    put_le16(p, v & 0xFFFF);
+    put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(unsigned char *p, unsigned long long v)
+{
+    put_le32(p, v & 0xFFFFFFFF);
+    put_le32(p + 4, v >> 32);
+}
+
+/******************************************************************************
+Description.: read the dimensions of a JPG picture from its frame header
+Input Value.: * buf....: the picture
+              * size...: its size
+              * width..: receives the width
+              * height.: receives the height
+Return Value: 0 if found, -1 otherwise
+******************************************************************************/
+static int jpeg_dimensions(const unsigned char *buf, int size, int *width, int *height)
+{
+    int i = 2, m;
+
+    while(i + 9 < size) {
+        if(buf[i] != 0xFF) {
+            i++;
+            continue;
+        }
+        m = buf[i + 1];
+
+        /* SOF0 to SOF15, except DHT, JPG and DAC */
+        if(m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC) {
+            *height = (buf[i + 5] << 8) | buf[i + 6];
+            *width = (buf[i + 7] << 8) | buf[i + 8];
+            return 0;
+        }
+
+        /* markers without a length */
+        if(m == 0xFF || m == 0x01 || (m >= 0xD0 && m <= 0xD8)) {
+            i += (m == 0xFF) ? 1 : 2;
+            continue;
+        }
+        if(m == 0xDA)
+            break;
+
+        i += 2 + ((buf[i + 2] << 8) | buf[i + 3]);
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+Description.: fill in the AVI header from what was recorded so far
+Input Value.: recording and a buffer of AVI_HEADER_SIZE bytes
+Return Value: -
+******************************************************************************/
+static void avi_header(recording *r, unsigned char *h)
+{
+    long long duration;
+    unsigned int usec = 33333;
+
+    /* average frame rate of the recorded frames */
+    if(r->frames > 1) {
+        duration = (r->last.tv_sec - r->first.tv_sec) * 1000000LL + (r->last.tv_usec - r->first.tv_usec);
+        if(duration > 0)
+            usec = duration / (r->frames - 1);
+    }
+    if(usec == 0)
+        usec = 1;
+
+    memset(h, 0, AVI_HEADER_SIZE);
+
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, r->bytes - 8);
+    memcpy(h + 8, "AVI ", 4);
+
+    memcpy(h + 12, "LIST", 4);
+    put_le32(h + 16, 192);
+    memcpy(h + 20, "hdrl", 4);
+
+    /* main header */
+    memcpy(h + 24, "avih", 4);
+    put_le32(h + 28, 56);
+    put_le32(h + 32, usec);
+    put_le32(h + 36, (unsigned long long)r->largest * 1000000 / usec);
+    put_le32(h + 44, AVIF_HASINDEX);
+    put_le32(h + 48, r->frames);
+    put_le32(h + 56, 1);
+    put_le32(h + 60, r->largest);
+    put_le32(h + 64, r->width);
+    put_le32(h + 68, r->height);
+
+    memcpy(h + 88, "LIST", 4);
+    put_le32(h + 92, 116);
+    memcpy(h + 96, "strl", 4);
+
+    /* stream header, the rate is 1000000 / usec frames per second */
+    memcpy(h + 100, "strh", 4);
+    put_le32(h + 104, 56);
+    memcpy(h + 108, "vids", 4);
+    memcpy(h + 112, "MJPG", 4);
+    put_le32(h + 128, usec);
+    put_le32(h + 132, 1000000);
+    put_le32(h + 140, r->frames);
+    put_le32(h + 144, r->largest);
+    put_le32(h + 148, 0xFFFFFFFF);
+    put_le16(h + 160, r->width);
+    put_le16(h + 162, r->height);
+
+    /* stream format, a BITMAPINFOHEADER */
+    memcpy(h + 164, "strf", 4);
+    put_le32(h + 168, 40);
+    put_le32(h + 172, 40);
+    put_le32(h + 176, r->width);
+    put_le32(h + 180, r->height);
+    put_le16(h + 184, 1);
+    put_le16(h + 186, 24);
+    memcpy(h + 188, "MJPG", 4);
+    put_le32(h + 192, r->width * r->height * 3);
+
+    memcpy(h + 212, "LIST", 4);
+    put_le32(h + 216, r->bytes - AVI_MOVI);
+    memcpy(h + 220, "movi", 4);
+}
+
+/******************************************************************************
+Description.: open a new file, segments and clips get the time of their start
+              in the name: "record.avi" becomes "record_2024_01_31_12_00_00.avi"
+Input Value.: recording with its configuration set
+Return Value: 0 if OK, -1 in case of an error
+******************************************************************************/
+int recording_open(recording *r)
+{
+    unsigned char header[AVI_HEADER_SIZE];
+    char stamp[32], *ext;
+    struct iovec iov;
+    struct tm tm;
+    time_t t;
+    int n, stem, flags = O_CREAT | O_WRONLY | O_TRUNC;
+
+    r->bytes = 0;
+    r->frames = 0;
+    r->largest = 0;
+    r->width = r->height = 0;
+    r->opened = frame_clock();
+
+    if(r->segment_seconds > 0 || r->segment_bytes > 0 || r->clips || r->segments > 0) {
+        t = time(NULL);
+        localtime_r(&t, &tm);
+        strftime(stamp, sizeof(stamp), "%Y_%m_%d_%H_%M_%S", &tm);
+
+        ext = strrchr(r->name, '.');
+        stem = (ext != NULL) ? ext - r->name : (int)strlen(r->name);
+        if(ext == NULL)
+            ext = "";
+
+        /* segments must not overwrite each other within the same second */
+        flags = O_CREAT | O_WRONLY | O_EXCL;
+        for(n = 0; ; n++) {
+            if(n == 0)
+                snprintf(r->path, sizeof(r->path), "%s/%.*s_%s%s", r->folder, stem, r->name, stamp, ext);
+            else
+                snprintf(r->path, sizeof(r->path), "%s/%.*s_%s_%d%s", r->folder, stem, r->name, stamp, n, ext);
+
+            if((r->fd = open(r->path, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) >= 0 || errno != EEXIST)
+                break;
+        }
+    } else {
+        snprintf(r->path, sizeof(r->path), "%s/%s", r->folder, r->name);
+        r->fd = open(r->path, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+
+    if(r->fd < 0)
+        return -1;
+    r->segments++;
+
+    /* placeholder, completed by recording_close() */
+    if(r->avi) {
+        r->bytes = AVI_HEADER_SIZE;
+        avi_header(r, header);
+        iov.iov_base = header;
+        iov.iov_len = AVI_HEADER_SIZE;
+        if(write_all(r->fd, &iov, 1) < 0) {
+            close(r->fd);
+            r->fd = -1;
+            return -1;
+        }
+    }
+
+    /* the sidecar index */
+    r->index_fd = -1;
+    n = strlen(r->path);
+    if(n + 5 <= (int)sizeof(r->path)) {
+        strcpy(r->path + n, ".idx");
+        r->index_fd = open(r->path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        r->path[n] = '\0';
+        if(r->index_fd >= 0 && write(r->index_fd, INDEX_MAGIC, strlen(INDEX_MAGIC)) < 0)
+            perror("could not write the index");
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: append the "idx1" index to an AVI file and complete its header,
+              then close the file and its sidecar index
+Input Value.: recording
+Return Value: -
+******************************************************************************/
+void recording_close(recording *r)
+{
+    unsigned char header[AVI_HEADER_SIZE], *idx;
+    struct iovec iov;
+    int i;
+
+    if(r->fd < 0)
+        return;
+
+    if(r->avi) {
+        /* the movi list ends here */
+        if((idx = malloc(8 + 16 * r->frames)) != NULL) {
+            memcpy(idx, "idx1", 4);
+            put_le32(idx + 4, 16 * r->frames);
+            for(i = 0; i < r->frames; i++) {
+                memcpy(idx + 8 + 16 * i, "00dc", 4);
+                put_le32(idx + 12 + 16 * i, AVIIF_KEYFRAME);
+                put_le32(idx + 16 + 16 * i, r->entries[i].offset);
+                put_le32(idx + 20 + 16 * i, r->entries[i].size);
+            }
+
+            avi_header(r, header);
+            put_le32(header + 4, r->bytes + 8 + 16 * r->frames - 8);
+
+            iov.iov_base = idx;
+            iov.iov_len = 8 + 16 * r->frames;
+            if(write_all(r->fd, &iov, 1) < 0 ||
+               pwrite(r->fd, header, AVI_HEADER_SIZE, 0) != AVI_HEADER_SIZE)
+                perror("could not complete the AVI file");
+            free(idx);
+        }
+    }
+
+    if(r->sync)
+        recording_sync(r);
+
+    close(r->fd);
+    r->fd = -1;
+
+    if(r->index_fd >= 0)
+        close(r->index_fd);
+    r->index_fd = -1;
+}
+
+/******************************************************************************
+Description.: flush data to the storage
+Input Value.: recording
+Return Value: -
+******************************************************************************/
+void recording_sync(recording *r)
+{
+    if(r->fd >= 0)
+        fdatasync(r->fd);
+    if(r->index_fd >= 0)
+        fdatasync(r->index_fd);
+}
+
+/******************************************************************************
+Description.: check if a frame still fits into the current segment
+Input Value.: recording and the size of the frame
+Return Value: 1 if a new segment has to be started, 0 otherwise
+******************************************************************************/
+static int recording_full(recording *r, int size)
+{
+    long long limit = r->segment_bytes, needed = r->bytes + size;
+
+    if(r->frames == 0)
+        return 0;
+
+    if(r->segment_seconds > 0 && frame_clock() - r->opened >= r->segment_seconds * 1000000000LL)
+        return 1;
+
+    /* the AVI chunk header, padding and the index have to fit as well */
+    if(r->avi) {
+        needed += 8 + 1 + 8 + 16 * (r->frames + 1);
+        if(limit <= 0 || limit > AVI_MAX_BYTES)
+            limit = AVI_MAX_BYTES;
+    }
+
+    return (limit > 0 && needed > limit);
+}
+
+/******************************************************************************
+Description.: write frames, a new segment is started when needed
+Input Value.: * r......: recording
+              * frames.: the frames
+              * count..: their number
+Return Value: 0 if OK, -1 in case of an error
+******************************************************************************/
+int recording_write(recording *r, frame **frames, int count)
+{
+    static unsigned char pad = 0;
+    unsigned char chunks[RECORDING_BATCH][8], records[RECORDING_BATCH][INDEX_RECORD_SIZE];
+    struct iovec iov[3 * RECORDING_BATCH], index;
+    avi_entry *entries;
+    frame *f;
+    int i, n = 0, pending = 0, full;
+
+    for(i = 0; i <= count; i++) {
+        f = (i < count) ? frames[i] : NULL;
+
+        /* decided once, the pending frames must end up in the segment they were counted in */
+        full = (f != NULL && r->fd >= 0 && recording_full(r, f->size));
+
+        /* write what was collected before a new segment starts, at the end or when the batch is full */
+        if(pending > 0 && (f == NULL || pending == RECORDING_BATCH || full)) {
+            if(write_all(r->fd, iov, n) < 0)
+                return -1;
+
+            index.iov_base = records;
+            index.iov_len = pending * INDEX_RECORD_SIZE;
+            if(r->index_fd >= 0 && write_all(r->index_fd, &index, 1) < 0)
+                perror("could not write the index");
+
+            n = pending = 0;
+        }
+
+        if(f == NULL)
+            break;
+
+        if(full)
+            recording_close(r);
+
+        if(r->fd < 0 && recording_open(r) < 0)
+            return -1;
+
+        if(r->frames == 0) {
+            r->first = f->timestamp;
+            if(r->avi && jpeg_dimensions(f->buf, f->size, &r->width, &r->height) < 0)
+                r->width = r->height = 0;
+        }
+        r->last = f->timestamp;
+        r->largest = MAX(r->largest, f->size);
+
+        if(r->avi) {
+            if(r->frames == r->capacity) {
+                if((entries = realloc(r->entries, (r->capacity + 1024) * sizeof(avi_entry))) == NULL)
+                    return -1;
+                r->entries = entries;
+                r->capacity += 1024;
+            }
+            r->entries[r->frames].offset = r->bytes - AVI_MOVI;
+            r->entries[r->frames].size = f->size;
+
+            memcpy(chunks[pending], "00dc", 4);
+            put_le32(chunks[pending] + 4, f->size);
+            iov[n].iov_base = chunks[pending];
+            iov[n++].iov_len = 8;
+            r->bytes += 8;
+        }
+
+        put_le64(records[pending], frame_walltime(f));
+        put_le64(records[pending] + 8, r->bytes);
+        put_le32(records[pending] + 16, f->size);
+        put_le32(records[pending] + 20, 0);
+
+        iov[n].iov_base = f->buf;
+        iov[n++].iov_len = f->size;
+        r->bytes += f->size;
+
+        /* chunks start at even offsets */
+        if(r->avi && (f->size & 1)) {
+            iov[n].iov_base = &pad;
+            iov[n++].iov_len = 1;
+            r->bytes++;
+        }
+
+        r->frames++;
+        pending++;
+    }
+
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "../../frame.h"
+
+/*
+ * Recording of the frames into one file or rolling segments, either as plain
+ * concatenated JPG pictures or as AVI/MJPEG with an "idx1" index. Every file
+ * gets a sidecar index "<file>.idx" that is appended while recording:
+ *
+ *   "MJPGIDX1" followed by one little endian record per frame
+ *   u64 capture time in microseconds since the epoch, see frame_walltime()
+ *   u64 offset of the JPG data within the file
+ *   u32 size of the JPG data
+ *   u32 reserved, 0
+ *
+ * The records are ordered by time, a binary search finds any point in time.
+ */
+
+#define INDEX_MAGIC "MJPGIDX1"
+#define INDEX_RECORD_SIZE 24
+
+/* AVI 1.0 stores offsets with 32 bits, segments are closed before this size */
+#define AVI_MAX_BYTES (1024LL * 1024 * 1024)
+
+/* frames written with a single call */
+#define RECORDING_BATCH 16
+
+/* an entry of the "idx1" index of an AVI file */
+typedef struct {
+    unsigned int offset;        /* of the chunk, relative to the "movi" list */
+    unsigned int size;
+} avi_entry;
+
+typedef struct _recording recording;
+struct _recording {
+    /* configuration */
+    char *folder;
+    char *name;                 /* file name, segments and clips get the time inserted */
+    int avi;                    /* AVI container instead of concatenated JPGs */
+    int segment_seconds;        /* start a new segment after this time, 0 = never */
+    long long segment_bytes;    /* or before it exceeds this size, 0 = no limit */
+    int sync;                   /* flush a file to the storage when it is closed */
+    int clips;                  /* every clip is a file of its own */
+
+    /* the current file */
+    int fd;
+    int index_fd;
+    char path[1024];
+    int segments;               /* files opened so far */
+    long long opened;           /* frame_clock() when it was opened */
+    long long bytes;            /* size of the file so far */
+    int frames;
+    int width, height;
+    int largest;                /* size of the largest frame */
+    struct timeval first, last; /* capture time of the first and last frame */
+    avi_entry *entries;
+    int capacity;
+};
+
+int write_all(int fd, struct iovec *iov, int count);
+
+int recording_open(recording *r);
+int recording_write(recording *r, frame **frames, int count);
+void recording_sync(recording *r);
+void recording_close(recording *r);
+
+#endif
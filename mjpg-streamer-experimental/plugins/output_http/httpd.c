@@ -21,6 +21,7 @@
 #                                                                              #
 *******************************************************************************/
 #include <string.h>
+#include <stdarg.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -29,13 +30,20 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
 
 #include <linux/version.h>
 #include <linux/types.h>          /* for videodev2.h */
@@ -57,145 +65,6 @@ static globals *pglobal;
 extern context servers[MAX_OUTPUT_PLUGINS];
 int piggy_fine = 2; // FIXME make it command line parameter
 
-/******************************************************************************
-Description.: initializes the iobuffer structure properly
-Input Value.: pointer to already allocated iobuffer
-Return Value: iobuf
-******************************************************************************/
-void init_iobuffer(iobuffer *iobuf)
-{
-    memset(iobuf->buffer, 0, sizeof(iobuf->buffer));
-    iobuf->level = 0;
-}
-
-/******************************************************************************
-Description.: initializes the request structure properly
-Input Value.: pointer to already allocated req
-Return Value: req
-******************************************************************************/
-void init_request(request *req)
-{
-    req->type        = A_UNKNOWN;
-    req->parameter   = NULL;
-    req->client      = NULL;
-    req->credentials = NULL;
-}
-
-/******************************************************************************
-Description.: If strings were assigned to the different members free them
-              This will fail if strings are static, so always use strdup().
-Input Value.: req: pointer to request structure
-Return Value: -
-******************************************************************************/
-void free_request(request *req)
-{
-    if(req->parameter != NULL) free(req->parameter);
-    if(req->client != NULL) free(req->client);
-    if(req->credentials != NULL) free(req->credentials);
-    if(req->query_string != NULL) free(req->query_string);
-}
-
-/******************************************************************************
-Description.: read with timeout, implemented without using signals
-              tries to read len bytes and returns if enough bytes were read
-              or the timeout was triggered. In case of timeout the return
-              value may differ from the requested bytes "len".
-Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
-******************************************************************************/
-int _read(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
-{
-    int copied = 0, rc, i;
-    fd_set fds;
-    struct timeval tv;
-
-    memset(buffer, 0, len);
-
-    while((copied < len)) {
-        i = MIN(iobuf->level, len - copied);
-        memcpy(buffer + copied, iobuf->buffer + IO_BUFFER - iobuf->level, i);
-
-        iobuf->level -= i;
-        copied += i;
-        if(copied >= len)
-            return copied;
-
-        /* select will return in case of timeout or new data arrived */
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        if((rc = select(fd + 1, &fds, NULL, NULL, &tv)) <= 0) {
-            if(rc < 0)
-                exit(EXIT_FAILURE);
-
-            /* this must be a timeout */
-            return copied;
-        }
-
-        init_iobuffer(iobuf);
-
-        /*
-         * there should be at least one byte, because select signalled it.
-         * But: It may happen (very seldomly), that the socket gets closed remotly between
-         * the select() and the following read. That is the reason for not relying
-         * on reading at least one byte.
-         */
-        if((iobuf->level = read(fd, &iobuf->buffer, IO_BUFFER)) <= 0) {
-            /* an error occured */
-            return -1;
-        }
-
-        /* align data to the end of the buffer if less than IO_BUFFER bytes were read */
-        memmove(iobuf->buffer + (IO_BUFFER - iobuf->level), iobuf->buffer, iobuf->level);
-    }
-
-    return 0;
-}
-
-/******************************************************************************
-Description.: Read a single line from the provided fildescriptor.
-              This funtion will return under two conditions:
-              * line end was reached
-              * timeout occured
-Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
-******************************************************************************/
-/* read just a single line or timeout */
-int _readline(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
-{
-    char c = '\0', *out = buffer;
-    int i;
-
-    memset(buffer, 0, len);
-
-    for(i = 0; i < len && c != '\n'; i++) {
-        if(_read(fd, iobuf, &c, 1, timeout) <= 0) {
-            /* timeout or error occured */
-            return -1;
-        }
-        *out++ = c;
-    }
-
-    return i;
-}
-
 /******************************************************************************
 Description.: Decodes the data and stores the result to the same buffer.
               The buffer will be large enough, because base64 requires more
@@ -395,145 +264,546 @@ void update_client_timestamp(client_info *client)
 #endif
 
 /******************************************************************************
-Description.: Send a complete HTTP response and a single JPG-frame.
-Input Value.: fildescriptor fd to send the answer to
+Description.: drop a reference to a snapshot answer, the last one frees it
+Input Value.: snapshot, may be NULL
 Return Value: -
 ******************************************************************************/
-void send_snapshot(cfd *context_fd, int input_number)
+static void snapshot_unref(snapshot *s)
 {
-    unsigned char *frame = NULL;
-    int frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
+    if(s == NULL)
+        return;
+
+    if(__sync_sub_and_fetch(&s->refcount, 1) == 0) {
+        frame_unref(s->f);
+        free(s);
+    }
+}
 
-    /* wait for a fresh frame */
-    pthread_mutex_lock(&pglobal->in[input_number].db);
-    pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+/******************************************************************************
+Description.: return the answer for the current frame of an input. The header
+              gets formatted only once per frame, all further requests for
+              the same frame share it.
+Input Value.: * pc...........: server context, holds the cached answers
+              * input_number.: input plugin to take the frame from
+Return Value: a referenced snapshot the caller has to release with
+              snapshot_unref() or NULL in case of an error
+******************************************************************************/
+static snapshot *snapshot_get(context *pc, int input_number)
+{
+    input *in = &pglobal->in[input_number];
+    snapshot *s;
+    frame *f = NULL;
+    char etag[64];
+
+    /* send the current frame right away unless told to wait for a new one */
+    if(!pc->conf.fresh)
+        f = frame_ring_latest(in);
+    if(f == NULL && (f = frame_ring_next(in, FRAME_SEQ_FRESH)) == NULL)
+        return NULL;
 
-    /* read buffer */
-    frame_size = pglobal->in[input_number].size;
+    /*
+     * the sequence number starts again with every run of the program, the
+     * capture time does not, so the tag remains valid across restarts
+     */
+    snprintf(etag, sizeof(etag), "\"%ld.%06ld-%d\"",
+             (long) f->timestamp.tv_sec, (long) f->timestamp.tv_usec, f->size);
+
+    pthread_mutex_lock(&pc->snapshots_mutex);
+    s = pc->snapshots[input_number];
+    if(s != NULL && strcmp(s->etag, etag) == 0) {
+        frame_unref(f);
+    } else if((s = malloc(sizeof(snapshot))) != NULL) {
+        s->f = f;
+        strcpy(s->etag, etag);
+        s->header_len = snprintf(s->header, sizeof(s->header),
+                                 "HTTP/1.1 200 OK\r\n" \
+                                 "Access-Control-Allow-Origin: *\r\n" \
+                                 SNAPSHOT_HEADER \
+                                 "Content-type: image/jpeg\r\n" \
+                                 "Content-Length: %d\r\n" \
+                                 "ETag: %s\r\n" \
+                                 "X-Timestamp: %d.%06d\r\n", f->size, etag,
+                                 (int) f->timestamp.tv_sec, (int) f->timestamp.tv_usec);
+        s->refcount = 1;
+
+        /* the cache holds one reference */
+        snapshot_unref(pc->snapshots[input_number]);
+        pc->snapshots[input_number] = s;
+    } else {
+        frame_unref(f);
+    }
 
-    /* allocate a buffer for this single frame */
-    if((frame = malloc(frame_size + 1)) == NULL) {
-        free(frame);
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-        send_error(context_fd->fd, 500, "not enough memory");
-        return;
+    if(s != NULL)
+        __sync_add_and_fetch(&s->refcount, 1);
+    pthread_mutex_unlock(&pc->snapshots_mutex);
+
+    return s;
+}
+
+/******************************************************************************
+Description.: drop the cached snapshot answers of a server
+Input Value.: server context
+Return Value: -
+******************************************************************************/
+static void snapshot_flush(context *pc)
+{
+    int i;
+
+    pthread_mutex_lock(&pc->snapshots_mutex);
+    for(i = 0; i < MAX_INPUT_PLUGINS; i++) {
+        snapshot_unref(pc->snapshots[i]);
+        pc->snapshots[i] = NULL;
     }
-    /* copy v4l2_buffer timeval to user space */
-    timestamp = pglobal->in[input_number].timestamp;
+    pthread_mutex_unlock(&pc->snapshots_mutex);
+}
 
-    memcpy(frame, pglobal->in[input_number].buf, frame_size);
-    DBG("got frame (size: %d kB)\n", frame_size / 1024);
+/******************************************************************************
+Description.: Send a complete HTTP response and a single JPG-frame.
+              If the client already has this frame (If-None-Match matches
+              the ETag) only "304 Not Modified" gets sent.
+Input Value.: * context_fd...: fildescriptor to send the answer to
+              * input_number.: input plugin to take the frame from
+              * etag.........: value of the If-None-Match header or NULL
+Return Value: -
+******************************************************************************/
+void send_snapshot(cfd *context_fd, int input_number, char *etag)
+{
+    snapshot *s;
+    struct iovec iov[3];
+    char buffer[BUFFER_SIZE] = {0};
+    long long start;
 
-    pthread_mutex_unlock(&pglobal->in[input_number].db);
+    if((s = snapshot_get(context_fd->pc, input_number)) == NULL) {
+        send_error(context_fd, 500, "not enough memory");
+        return;
+    }
+    DBG("got frame (size: %d kB)\n", s->f->size / 1024);
 
     #ifdef MANAGMENT
     update_client_timestamp(context_fd->client);
     #endif
 
-    /* write the response */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Access-Control-Allow-Origin: *\r\n" \
-            STD_HEADER \
-            "Content-type: image/jpeg\r\n" \
-            "X-Timestamp: %d.%06d\r\n" \
-            "\r\n", (int) timestamp.tv_sec, (int) timestamp.tv_usec);
-
-    /* send header and image now */
-    if (write(context_fd->fd, buffer, strlen(buffer)) < 0 ||
-        write(context_fd->fd, frame, frame_size) < 0) {
-        free(frame);
+    if(etag != NULL && (strstr(etag, s->etag) != NULL || strcmp(etag, "*") == 0)) {
+        DBG("client has the frame already, ETag: %s\n", s->etag);
+        sprintf(buffer, "HTTP/1.1 304 Not Modified\r\n" \
+                "Access-Control-Allow-Origin: *\r\n" \
+                SNAPSHOT_HEADER \
+                "ETag: %s\r\n" \
+                "%s", s->etag, (context_fd->keepalive) ? CONNECTION_KEEPALIVE : CONNECTION_CLOSE);
+        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
+            DBG("write failed, done anyway\n");
+        }
+        snapshot_unref(s);
         return;
     }
 
-    free(frame);
+    /* send header and image with a single call, the frame stays valid as long as we hold a reference */
+    iov[0].iov_base = s->header;
+    iov[0].iov_len = s->header_len;
+    iov[1].iov_base = (context_fd->keepalive) ? CONNECTION_KEEPALIVE : CONNECTION_CLOSE;
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2].iov_base = s->f->buf;
+    iov[2].iov_len = s->f->size;
+    start = frame_clock();
+    if(send_iov(context_fd->pc, context_fd->fd, iov, 3, 0) < 0) {
+        DBG("sending the snapshot failed\n");
+    } else {
+        metrics_sent(&pglobal->out[context_fd->pc->id], s->f->size);
+        trace_send(context_fd->pc->id, s->f, start);
+    }
+
+    snapshot_unref(s);
 }
 
 /******************************************************************************
-Description.: Send a complete HTTP response and a stream of JPG-frames.
-Input Value.: fildescriptor fd to send the answer to
+Description.: format the numeric address of a client, this never does a
+              reverse lookup
+Input Value.: * addr...: address as returned by accept() or getpeername()
+              * name...: buffer for the text
+              * len....: size of that buffer
 Return Value: -
 ******************************************************************************/
-void send_stream(cfd *context_fd, int input_number)
+static void client_address(struct sockaddr_storage *addr, char *name, size_t len)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
+    name[0] = '\0';
 
-    DBG("preparing header\n");
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Access-Control-Allow-Origin: *\r\n" \
-            STD_HEADER \
-            "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n" \
-            "\r\n" \
-            "--" BOUNDARY "\r\n");
+    if(addr->ss_family == AF_INET)
+        inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr, name, len);
+    else if(addr->ss_family == AF_INET6)
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)addr)->sin6_addr, name, len);
+}
 
-    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
-        free(frame);
+/******************************************************************************
+Description.: add a stream client to the list of the server
+Input Value.: * pc.....: server context
+              * st.....: statistics, owned by the caller
+              * fd.....: connected socket, used to look up the peer address
+              * input_number: input plugin the client streams from
+Return Value: -
+******************************************************************************/
+void stream_stats_register(context *pc, stream_stats *st, int fd, int input_number)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    memset(st, 0, sizeof(stream_stats));
+    st->input = input_number;
+
+    if(getpeername(fd, (struct sockaddr *)&addr, &len) == 0)
+        client_address(&addr, st->address, sizeof(st->address));
+
+    pthread_mutex_lock(&pc->streams_mutex);
+    st->next = pc->streams;
+    pc->streams = st;
+    pthread_mutex_unlock(&pc->streams_mutex);
+}
+
+/******************************************************************************
+Description.: remove a stream client from the list of the server
+Input Value.: server context and the statistics passed to register
+Return Value: -
+******************************************************************************/
+void stream_stats_unregister(context *pc, stream_stats *st)
+{
+    stream_stats **p;
+
+    pthread_mutex_lock(&pc->streams_mutex);
+    for(p = &pc->streams; *p != NULL; p = &(*p)->next) {
+        if(*p == st) {
+            *p = st->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pc->streams_mutex);
+}
+
+/******************************************************************************
+Description.: account a frame that is about to be sent, a gap in the sequence
+              numbers means frames were skipped because the client was slow
+Input Value.: statistics of the client and the frame
+Return Value: -
+******************************************************************************/
+void stream_stats_frame(stream_stats *st, frame *f)
+{
+    if(st->last_seq != 0 && f->seq > st->last_seq + 1)
+        st->frames_dropped += f->seq - st->last_seq - 1;
+
+    st->last_seq = f->seq;
+    st->frames_sent++;
+}
+
+/******************************************************************************
+Description.: a blocking send fails with EAGAIN once the client did not accept
+              any data for the configured number of seconds
+Input Value.: server context and socket
+Return Value: -
+******************************************************************************/
+void stream_kick_timeout(context *pc, int fd)
+{
+    struct timeval tv;
+
+    if(pc->conf.kick <= 0)
         return;
+
+    tv.tv_sec = pc->conf.kick;
+    tv.tv_usec = 0;
+    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("setsockopt(SO_SNDTIMEO) failed\n");
     }
+}
 
-    DBG("Headers send, sending stream now\n");
+/******************************************************************************
+Description.: limit the data a stream socket holds that was not sent yet, so
+              a slow client blocks the sender after about one frame and
+              gets the latest frame next instead of a backlog
+Input Value.: socket
+Return Value: -
+******************************************************************************/
+void stream_limit_buffer(int fd)
+{
+    #ifdef TCP_NOTSENT_LOWAT
+    int lowat = STREAM_NOTSENT_LOWAT;
 
-    while(!pglobal->stop) {
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0) {
+        perror("setsockopt(TCP_NOTSENT_LOWAT) failed\n");
+    }
+    #endif
+}
+
+/******************************************************************************
+Description.: bytes a socket holds that the client did not acknowledge yet.
+              A send waits until the unsent data dropped well below the
+              limit, so a slow client may not accept new data for a while;
+              this shrinking tells it still reads.
+Input Value.: socket
+Return Value: number of bytes, -1 in case of an error
+******************************************************************************/
+int stream_unacked(int fd)
+{
+    int bytes;
+
+    if(ioctl(fd, SIOCOUTQ, &bytes) < 0)
+        return -1;
+
+    return bytes;
+}
+
+/******************************************************************************
+Description.: send a complete iovec array, one sendmsg() for all parts unless
+              the socket accepts less. The statistics of the server get
+              updated to allow checking the bytes transferred per syscall.
+Input Value.: * pc.....: server context, holds the statistics
+              * fd.....: filedescriptor to send to
+              * iov....: array to send, gets modified
+              * iovcnt.: number of entries
+              * flags..: flags for the first sendmsg() call, e.g. MSG_ZEROCOPY
+Return Value: 0 if everything was sent, -1 in case of an error
+******************************************************************************/
+int send_iov(context *pc, int fd, struct iovec *iov, int iovcnt, int flags)
+{
+    struct msghdr msg;
+    struct timespec start, end;
+    ssize_t rc;
+    int unacked = -1;
+
+    while(iovcnt > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        if(pc->conf.kick > 0)
+            unacked = stream_unacked(fd);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if((rc = sendmsg(fd, &msg, MSG_NOSIGNAL | flags)) < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* the client acknowledged data in the meantime, it is slow but alive */
+                if(unacked >= 0 && stream_unacked(fd) < unacked)
+                    continue;
+                DBG("client did not accept data for %d seconds, kicking it\n", pc->conf.kick);
+            }
+            return -1;
+        }
+
+        __sync_add_and_fetch(&pc->stats.send_calls, 1);
+        __sync_add_and_fetch(&pc->stats.send_bytes, rc);
+
+        /*
+         * with SO_SNDTIMEO a send returns the bytes accepted so far once the
+         * timeout expired, so a send that blocked that long means stalled,
+         * unless the client acknowledged data meanwhile
+         */
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if(pc->conf.kick > 0 && end.tv_sec - start.tv_sec >= pc->conf.kick &&
+           (unacked < 0 || stream_unacked(fd) >= unacked + rc)) {
+            DBG("client did not accept data for %d seconds, kicking it\n", pc->conf.kick);
+            return -1;
+        }
+
+        /* a partial send continues with a regular copy */
+        flags = 0;
+
+        while(iovcnt > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
 
-        /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    return 0;
+}
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+#ifdef MSG_ZEROCOPY
+/*
+ * Frames sent with MSG_ZEROCOPY are still read by the kernel after sendmsg()
+ * returned, so they stay referenced until the completion arrived on the error
+ * queue of the socket. The part header is stored alongside for the same reason.
+ */
+#define ZEROCOPY_PENDING 4
+
+typedef struct {
+    frame *f[ZEROCOPY_PENDING];
+    char header[ZEROCOPY_PENDING][IO_BUFFER];
+    int head;
+    int count;
+    unsigned int first_id;      /* completion id of the entry at "head" */
+} zerocopy_queue;
 
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+/******************************************************************************
+Description.: release the frames the kernel is done with
+Input Value.: * fd.....: socket
+              * zq.....: queue of frames in flight
+              * timeout: ms to wait for a completion, 0 to just poll
+Return Value: -
+******************************************************************************/
+static void zerocopy_reap(int fd, zerocopy_queue *zq, int timeout)
+{
+    struct pollfd pfd;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    char control[128];
+
+    if(timeout > 0) {
+        pfd.fd = fd;
+        pfd.events = 0;
+        if(poll(&pfd, 1, timeout) <= 0)
+            return;
+    }
 
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
+    while(zq->count > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+
+        for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* ee_info..ee_data is the range of completed sendmsg() calls */
+            while(zq->count > 0 && (int)(serr->ee_data - zq->first_id) >= 0) {
+                frame_unref(zq->f[zq->head]);
+                zq->f[zq->head] = NULL;
+                zq->head = (zq->head + 1) % ZEROCOPY_PENDING;
+                zq->first_id++;
+                zq->count--;
             }
+        }
+    }
+}
+#endif
 
-            frame = tmp;
+/******************************************************************************
+Description.: Send a complete HTTP response and a stream of JPG-frames.
+              Part header, picture and boundary go out with a single
+              sendmsg() straight from the frame, optionally with MSG_ZEROCOPY.
+Input Value.: fildescriptor fd to send the answer to
+Return Value: -
+******************************************************************************/
+void send_stream(cfd *context_fd, int input_number)
+{
+    frame *f = NULL;
+    unsigned long long seq = FRAME_SEQ_FRESH;
+    char buffer[BUFFER_SIZE] = {0}, *header = buffer;
+    static const char boundary[] = "\r\n--" BOUNDARY "\r\n";
+    struct iovec iov[3];
+    int flags = 0;
+    stream_stats st;
+    long long start;
+    #ifdef MSG_ZEROCOPY
+    zerocopy_queue zq;
+    int on = 1, slot = 0;
+
+    memset(&zq, 0, sizeof(zq));
+    if(context_fd->pc->conf.zerocopy) {
+        if(setsockopt(context_fd->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+            flags = MSG_ZEROCOPY;
+        } else {
+            DBG("SO_ZEROCOPY not supported, falling back to copying\n");
         }
+    }
+    #endif
+
+    DBG("preparing header\n");
+    sprintf(buffer, STREAM_HEADER);
+
+    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
+        return;
+    }
+
+    DBG("Headers send, sending stream now\n");
 
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
+    stream_kick_timeout(context_fd->pc, context_fd->fd);
+    stream_limit_buffer(context_fd->fd);
+    stream_stats_register(context_fd->pc, &st, context_fd->fd, input_number);
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
+    while(!pglobal->stop) {
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        /* wait for a frame newer than the last one, frames we were too slow for are skipped */
+        if((f = frame_ring_next(&pglobal->in[input_number], seq)) == NULL) {
+            send_error(context_fd, 500, "not enough memory");
+            break;
+        }
+        seq = f->seq;
+        stream_stats_frame(&st, f);
+        DBG("got frame (size: %d kB)\n", f->size / 1024);
 
         #ifdef MANAGMENT
         update_client_timestamp(context_fd->client);
         #endif
 
+        #ifdef MSG_ZEROCOPY
+        if(flags) {
+            /* do not queue more frames than the ring can spare */
+            zerocopy_reap(context_fd->fd, &zq, 0);
+            while(zq.count == ZEROCOPY_PENDING && !pglobal->stop)
+                zerocopy_reap(context_fd->fd, &zq, 1000);
+            if(zq.count == ZEROCOPY_PENDING)
+                break;
+
+            slot = (zq.head + zq.count) % ZEROCOPY_PENDING;
+            header = zq.header[slot];
+        }
+        #endif
+
         /*
          * print the individual mimetype and the length
          * sending the content-length fixes random stream disruption observed
          * with firefox
          */
-        sprintf(buffer, "Content-Type: image/jpeg\r\n" \
-                "Content-Length: %d\r\n" \
-                "X-Timestamp: %d.%06d\r\n" \
-                "\r\n", frame_size, (int)timestamp.tv_sec, (int)timestamp.tv_usec);
-        DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+        iov[0].iov_base = header;
+        iov[0].iov_len = snprintf(header, IO_BUFFER, "Content-Type: image/jpeg\r\n" \
+                                  "Content-Length: %d\r\n" \
+                                  "X-Timestamp: %d.%06d\r\n" \
+                                  "\r\n", f->size, (int)f->timestamp.tv_sec, (int)f->timestamp.tv_usec);
+        iov[1].iov_base = f->buf;
+        iov[1].iov_len = f->size;
+        iov[2].iov_base = (void *)boundary;
+        iov[2].iov_len = sizeof(boundary) - 1;
 
         DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+        start = frame_clock();
+        if(send_iov(context_fd->pc, context_fd->fd, iov, 3, flags) < 0) break;
+        metrics_sent(&pglobal->out[context_fd->pc->id], f->size);
+        trace_send(context_fd->pc->id, f, start);
+
+        #ifdef MSG_ZEROCOPY
+        if(flags) {
+            /* the kernel still reads from the frame, keep it until completion */
+            zq.f[slot] = f;
+            zq.count++;
+            f = NULL;
+            continue;
+        }
+        #endif
 
-        DBG("sending boundary\n");
-        sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+        frame_unref(f);
+        f = NULL;
     }
 
-    free(frame);
+    frame_unref(f);
+    stream_stats_unregister(context_fd->pc, &st);
+
+    #ifdef MSG_ZEROCOPY
+    /* give the kernel a moment to finish, then release whatever is left */
+    if(zq.count > 0)
+        zerocopy_reap(context_fd->fd, &zq, 100);
+    while(zq.count > 0) {
+        frame_unref(zq.f[zq.head]);
+        zq.head = (zq.head + 1) % ZEROCOPY_PENDING;
+        zq.count--;
+    }
+    #endif
 }
 
 #ifdef WXP_COMPAT
@@ -544,10 +814,9 @@ Return Value: -
 ******************************************************************************/
 void send_stream_wxp(cfd *context_fd, int input_number)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
+    frame *f = NULL;
+    unsigned long long seq = FRAME_SEQ_FRESH;
     char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
 
     DBG("preparing header\n");
 
@@ -574,7 +843,6 @@ void send_stream_wxp(cfd *context_fd, int input_number)
                     expDateBuffer);
 
     if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
-        free(frame);
         return;
     }
 
@@ -582,151 +850,306 @@ void send_stream_wxp(cfd *context_fd, int input_number)
 
     while(!pglobal->stop) {
 
-        /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
-
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
-
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
-            }
-
-            frame = tmp;
+        /* wait for a frame newer than the last one */
+        if((f = frame_ring_next(&pglobal->in[input_number], seq)) == NULL) {
+            send_error(context_fd, 500, "not enough memory");
+            return;
         }
-
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
+        seq = f->seq;
 
         #ifdef MANAGMENT
         update_client_timestamp(context_fd->client);
         #endif
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
-
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        DBG("got frame (size: %d kB)\n", f->size / 1024);
 
         memset(buffer, 0, 50*sizeof(char));
-        sprintf(buffer, "mjpeg %07d12345", frame_size);
+        sprintf(buffer, "mjpeg %07d12345", f->size);
         DBG("sending intemdiate header\n");
         if(write(context_fd->fd, buffer, 50) < 0) break;
 
         DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+        if(write(context_fd->fd, f->buf, f->size) < 0) break;
+
+        frame_unref(f);
+        f = NULL;
     }
 
-    free(frame);
+    frame_unref(f);
 }
 #endif
 
+/******************************************************************************
+Description.: Send an answer with a body of known length. The status line and
+              the header fields that depend on the connection are added here.
+Input Value.: * context_fd: client to send the answer to
+              * status....: status code and reason phrase, e.g. "200 OK"
+              * fields....: further header fields, each terminated by "\r\n"
+              * body......: content to send, NULL if the caller sends it itself
+              * length....: size of the content, -1 to leave out the
+                            Content-Length, e.g. for "304 Not Modified"
+Return Value: 0 if everything was sent, -1 in case of an error
+******************************************************************************/
+int send_answer(cfd *context_fd, const char *status, const char *fields, const void *body, int length)
+{
+    char header[BUFFER_SIZE];
+    struct iovec iov[3];
+    int len;
+
+    if(length >= 0)
+        len = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\n%sContent-Length: %d\r\n", status, fields, length);
+    else
+        len = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\n%s", status, fields);
+    if(len < 0 || len >= sizeof(header))
+        return -1;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = len;
+    iov[1].iov_base = (context_fd->keepalive) ? CONNECTION_KEEPALIVE : CONNECTION_CLOSE;
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2].iov_base = (void *)body;
+    iov[2].iov_len = length;
+
+    return send_iov(context_fd->pc, context_fd->fd, iov, (body != NULL && length > 0) ? 3 : 2, 0);
+}
+
 /******************************************************************************
 Description.: Send error messages and headers.
-Input Value.: * fd.....: is the filedescriptor to send the message to
-              * which..: HTTP error code, most popular is 404
-              * message: append this string to the displayed response
+Input Value.: * context_fd: client to send the message to
+              * which.....: HTTP error code, most popular is 404
+              * message...: append this string to the displayed response
 Return Value: -
 ******************************************************************************/
-void send_error(int fd, int which, char *message)
+void send_error(cfd *context_fd, int which, char *message)
 {
     char buffer[BUFFER_SIZE] = {0};
+    char *status, *fields = "Content-type: text/plain\r\n" STD_HEADER;
 
     if(which == 401) {
-        sprintf(buffer, "HTTP/1.0 401 Unauthorized\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "WWW-Authenticate: Basic realm=\"MJPG-Streamer\"\r\n" \
-                "\r\n" \
-                "401: Not Authenticated!\r\n" \
-                "%s", message);
+        status = "401 Unauthorized";
+        fields = "Content-type: text/plain\r\n" \
+                 STD_HEADER \
+                 "WWW-Authenticate: Basic realm=\"MJPG-Streamer\"\r\n";
+        snprintf(buffer, sizeof(buffer), "401: Not Authenticated!\r\n%s", message);
     } else if(which == 404) {
-        sprintf(buffer, "HTTP/1.0 404 Not Found\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "404: Not Found!\r\n" \
-                "%s", message);
+        status = "404 Not Found";
+        snprintf(buffer, sizeof(buffer), "404: Not Found!\r\n%s", message);
     } else if(which == 500) {
-        sprintf(buffer, "HTTP/1.0 500 Internal Server Error\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "500: Internal Server Error!\r\n" \
-                "%s", message);
+        status = "500 Internal Server Error";
+        snprintf(buffer, sizeof(buffer), "500: Internal Server Error!\r\n%s", message);
     } else if(which == 400) {
-        sprintf(buffer, "HTTP/1.0 400 Bad Request\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "400: Not Found!\r\n" \
-                "%s", message);
+        status = "400 Bad Request";
+        snprintf(buffer, sizeof(buffer), "400: Not Found!\r\n%s", message);
     } else if (which == 403) {
-        sprintf(buffer, "HTTP/1.0 403 Forbidden\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "403: Forbidden!\r\n" \
-                "%s", message);
+        status = "403 Forbidden";
+        snprintf(buffer, sizeof(buffer), "403: Forbidden!\r\n%s", message);
+    } else if(which == 426) {
+        status = "426 Upgrade Required";
+        fields = "Content-type: text/plain\r\n" \
+                 STD_HEADER \
+                 "Sec-WebSocket-Version: 13\r\n";
+        snprintf(buffer, sizeof(buffer), "426: Upgrade Required!\r\n%s", message);
     } else {
-        sprintf(buffer, "HTTP/1.0 501 Not Implemented\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "501: Not Implemented!\r\n" \
-                "%s", message);
+        status = "501 Not Implemented";
+        snprintf(buffer, sizeof(buffer), "501: Not Implemented!\r\n%s", message);
     }
 
-    if(write(fd, buffer, strlen(buffer)) < 0) {
+    if(send_answer(context_fd, status, fields, buffer, strlen(buffer)) < 0) {
         DBG("write failed, done anyway\n");
     }
 }
 
 /******************************************************************************
-Description.: Send HTTP header and copy the content of a file. To keep things
+Description.: drop a reference to a cached file, the last one frees it
+Input Value.: cached file, may be NULL
+Return Value: -
+******************************************************************************/
+static void static_file_unref(static_file *sf)
+{
+    if(sf == NULL)
+        return;
+
+    if(__sync_sub_and_fetch(&sf->refcount, 1) == 0) {
+        free(sf->data);
+        free(sf->gzip);
+        free(sf);
+    }
+}
+
+/******************************************************************************
+Description.: read a complete file into memory
+Input Value.: * path...: file to read
+              * size...: expected size
+Return Value: allocated buffer or NULL in case of an error
+******************************************************************************/
+static char *static_file_read(const char *path, off_t size)
+{
+    char *data;
+    int lfd;
+    ssize_t rc;
+    off_t done = 0;
+
+    if((lfd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    if((data = malloc(size + 1)) != NULL) {
+        while(done < size && (rc = read(lfd, data + done, size - done)) > 0)
+            done += rc;
+        if(done != size) {
+            free(data);
+            data = NULL;
+        }
+    }
+
+    close(lfd);
+    return data;
+}
+
+/******************************************************************************
+Description.: Look up a file of the www-folder. Files are kept in memory along
+              with a precompressed "name.gz" next to them, they are compared
+              with the disk at most once per second. Files larger than
+              FILE_CACHE_MAX are not kept, just their validators.
+Input Value.: * pc.......: server context, holds the cache
+              * name.....: file name within the www-folder
+              * mimetype.: type to send the file with
+Return Value: a referenced entry the caller has to release with
+              static_file_unref() or NULL if the file is not accessible
+******************************************************************************/
+static static_file *static_file_get(context *pc, const char *name, const char *mimetype)
+{
+    static_file *sf, **prev;
+    struct stat st, gz;
+    struct timespec now;
+    char path[BUFFER_SIZE];
+    int has_gz;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&pc->files_mutex);
+    for(prev = &pc->files; (sf = *prev) != NULL; prev = &sf->next) {
+        if(strcmp(sf->name, name) == 0)
+            break;
+    }
+
+    if(sf != NULL && now.tv_sec == sf->checked) {
+        __sync_add_and_fetch(&sf->refcount, 1);
+        pthread_mutex_unlock(&pc->files_mutex);
+        return sf;
+    }
+
+    snprintf(path, sizeof(path), "%s%s", pc->conf.www_folder, name);
+    if(stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        DBG("file %s not accessible\n", path);
+        if(sf != NULL) {
+            *prev = sf->next;
+            static_file_unref(sf);
+        }
+        pthread_mutex_unlock(&pc->files_mutex);
+        return NULL;
+    }
+
+    strncat(path, ".gz", sizeof(path) - strlen(path) - 1);
+    has_gz = (stat(path, &gz) == 0 && S_ISREG(gz.st_mode) && gz.st_size <= FILE_CACHE_MAX && st.st_size <= FILE_CACHE_MAX);
+
+    /* still the same as on disk */
+    if(sf != NULL && sf->mtime == st.st_mtime && sf->size == st.st_size &&
+       (sf->gzip != NULL) == has_gz && (!has_gz || (sf->gzip_mtime == gz.st_mtime && sf->gzip_size == gz.st_size))) {
+        sf->checked = now.tv_sec;
+        __sync_add_and_fetch(&sf->refcount, 1);
+        pthread_mutex_unlock(&pc->files_mutex);
+        return sf;
+    }
+
+    /* the old entry stays valid for requests that still use it */
+    if(sf != NULL) {
+        *prev = sf->next;
+        static_file_unref(sf);
+    }
+
+    if((sf = calloc(1, sizeof(static_file))) == NULL) {
+        pthread_mutex_unlock(&pc->files_mutex);
+        return NULL;
+    }
+
+    snprintf(sf->name, sizeof(sf->name), "%s", name);
+    sf->mimetype = mimetype;
+    sf->size = st.st_size;
+    sf->mtime = st.st_mtime;
+    sf->checked = now.tv_sec;
+    snprintf(sf->etag, sizeof(sf->etag), "%lx-%lx", (long) st.st_mtime, (long) st.st_size);
+    strftime(sf->modified, sizeof(sf->modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&st.st_mtime));
+
+    if(has_gz && (sf->gzip = static_file_read(path, gz.st_size)) != NULL) {
+        sf->gzip_size = gz.st_size;
+        sf->gzip_mtime = gz.st_mtime;
+    }
+
+    path[strlen(path) - strlen(".gz")] = '\0';
+    if(st.st_size <= FILE_CACHE_MAX && (sf->data = static_file_read(path, st.st_size)) == NULL) {
+        static_file_unref(sf);
+        pthread_mutex_unlock(&pc->files_mutex);
+        return NULL;
+    }
+
+    /* one reference for the cache, one for the caller */
+    sf->refcount = 2;
+    sf->next = pc->files;
+    pc->files = sf;
+    pthread_mutex_unlock(&pc->files_mutex);
+
+    return sf;
+}
+
+/******************************************************************************
+Description.: drop the cached files of a server
+Input Value.: server context
+Return Value: -
+******************************************************************************/
+static void static_file_flush(context *pc)
+{
+    static_file *sf;
+
+    pthread_mutex_lock(&pc->files_mutex);
+    while((sf = pc->files) != NULL) {
+        pc->files = sf->next;
+        static_file_unref(sf);
+    }
+    pthread_mutex_unlock(&pc->files_mutex);
+}
+
+/******************************************************************************
+Description.: Send HTTP header and the content of a file. To keep things
               simple, just a single folder gets searched for the file. Just
               files with known extension and supported mimetype get served.
-              If no parameter was given, the file "index.html" will be copied.
-Input Value.: * fd.......: filedescriptor to send data to
-              * id.......: specifies which server-context is the right one
-              * parameter: string that consists of the filename
+              If no file was requested, the file "index.html" will be sent.
+              Files come from memory, a precompressed "name.gz" is preferred
+              if the client accepts gzip. Files too large to be kept in
+              memory are sent with sendfile().
+Input Value.: * context_fd: client to send data to
+              * req.......: the request, its path names the file
 Return Value: -
 ******************************************************************************/
-void send_file(int id, int fd, char *parameter)
+void send_file(cfd *context_fd, request *req)
 {
-    char buffer[BUFFER_SIZE] = {0};
-    char *extension, *mimetype = NULL;
-    int i, lfd;
-    config conf = servers[id].conf;
+    char buffer[BUFFER_SIZE] = {0}, path[BUFFER_SIZE], etag[80];
+    char *extension, *mimetype = NULL, *parameter = req->path + 1;
+    char *body;
+    off_t length;
+    int i, lfd, gzip;
+    ssize_t rc;
+    static_file *sf;
 
     /* in case no parameter was given */
-    if(parameter == NULL || strlen(parameter) == 0)
+    if(strlen(parameter) == 0)
         parameter = "index.html";
 
     /* find file-extension */
-    char * pch;
-    pch = strchr(parameter, '.');
-    int lastDot = 0;
-    while(pch != NULL) {
-        lastDot = pch - parameter;
-        pch = strchr(pch + 1, '.');
-    }
-
-    if(lastDot == 0) {
-        send_error(fd, 400, "No file extension found");
+    if((extension = strrchr(parameter, '.')) == NULL || extension == parameter) {
+        send_error(context_fd, 400, "No file extension found");
         return;
-    } else {
-        extension = parameter + lastDot;
-        DBG("%s EXTENSION: %s\n", parameter, extension);
     }
+    DBG("%s EXTENSION: %s\n", parameter, extension);
 
     /* determine mime-type */
     for(i = 0; i < LENGTH_OF(mimetypes); i++) {
@@ -738,60 +1161,95 @@ void send_file(int id, int fd, char *parameter)
 
     /* in case of unknown mimetype or extension leave */
     if(mimetype == NULL) {
-        send_error(fd, 404, "MIME-TYPE not known");
+        send_error(context_fd, 404, "MIME-TYPE not known");
         return;
     }
 
     /* now filename, mimetype and extension are known */
     DBG("trying to serve file \"%s\", extension: \"%s\" mime: \"%s\"\n", parameter, extension, mimetype);
 
-    /* build the absolute path to the file */
-    strncat(buffer, conf.www_folder, sizeof(buffer) - 1);
-    strncat(buffer, parameter, sizeof(buffer) - strlen(buffer) - 1);
+    if((sf = static_file_get(context_fd->pc, parameter, mimetype)) == NULL) {
+        send_error(context_fd, 404, "Could not open file");
+        return;
+    }
 
-    /* try to open that file */
-    if((lfd = open(buffer, O_RDONLY)) < 0) {
-        DBG("file %s not accessible\n", buffer);
-        send_error(fd, 404, "Could not open file");
+    gzip = (sf->gzip != NULL && req->accept_encoding != NULL && strstr(req->accept_encoding, "gzip") != NULL);
+    body = (gzip) ? sf->gzip : sf->data;
+    length = (gzip) ? sf->gzip_size : sf->size;
+    snprintf(etag, sizeof(etag), "\"%s%s\"", sf->etag, (gzip) ? "-gz" : "");
+
+    snprintf(buffer, sizeof(buffer),
+             "Content-type: %s\r\n" \
+             "%s" \
+             STATIC_HEADER \
+             "ETag: %s\r\n" \
+             "Last-Modified: %s\r\n",
+             sf->mimetype,
+             (gzip) ? "Content-Encoding: gzip\r\n" : "",
+             etag, sf->modified);
+
+    /* the client has this version already */
+    if((req->etag != NULL && strstr(req->etag, etag) != NULL) ||
+       (req->etag == NULL && req->modified_since != NULL && strcmp(req->modified_since, sf->modified) == 0)) {
+        DBG("file %s not modified\n", parameter);
+        if(send_answer(context_fd, "304 Not Modified", buffer, NULL, -1) < 0)
+            context_fd->keepalive = 0;
+        static_file_unref(sf);
         return;
     }
-    DBG("opened file: %s\n", buffer);
 
-    /* prepare HTTP header */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", mimetype);
-    i = strlen(buffer);
+    if(body != NULL) {
+        if(send_answer(context_fd, "200 OK", buffer, body, length) < 0)
+            context_fd->keepalive = 0;
+        static_file_unref(sf);
+        return;
+    }
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    do {
-        if(write(fd, buffer, i) < 0) {
-            close(lfd);
-            return;
+    /* too large to be kept in memory, let the kernel copy it */
+    snprintf(path, sizeof(path), "%s%s", context_fd->pc->conf.www_folder, parameter);
+    if((lfd = open(path, O_RDONLY)) < 0) {
+        static_file_unref(sf);
+        send_error(context_fd, 404, "Could not open file");
+        return;
+    }
+
+    if(send_answer(context_fd, "200 OK", buffer, NULL, length) < 0) {
+        length = -1;
+    }
+
+    while(length > 0) {
+        if((rc = sendfile(context_fd->fd, lfd, NULL, length)) <= 0) {
+            if(rc < 0 && errno == EINTR)
+                continue;
+            break;
         }
-    } while((i = read(lfd, buffer, sizeof(buffer))) > 0);
+        length -= rc;
+    }
 
-    /* close file, job done */
+    /* the client can not tell a file that got shorter meanwhile from a complete one */
+    if(length != 0)
+        context_fd->keepalive = 0;
+
+    static_file_unref(sf);
     close(lfd);
 }
 
 /******************************************************************************
 Description.: Executes the specified CGI file if exists
-Input Value.: * fd...........: filedescriptor to send data to
-              * id...........: specifies which server-context is the right one
+Input Value.: * context_fd...: client to send data to
               * parameter....: the requested file name
               * query_string.: query parameters
 Return Value: -
 ******************************************************************************/
-void execute_cgi(int id, int fd, char *parameter, char *query_string)
+void execute_cgi(cfd *context_fd, char *parameter, char *query_string)
 {
+    int fd = context_fd->fd;
     int lfd = 0, i;
     int buffer_length = 0;
     char *buffer = NULL;
     char fn_buffer[BUFFER_SIZE] = {0};
     FILE *f = NULL;
-    config conf = servers[id].conf;
+    config conf = context_fd->pc->conf;
 
     /* build the absolute path to the file */
     strncat(fn_buffer, conf.www_folder, sizeof(fn_buffer) - 1);
@@ -799,7 +1257,7 @@ void execute_cgi(int id, int fd, char *parameter, char *query_string)
 
     if((lfd = open(fn_buffer, O_RDONLY)) < 0) {
         DBG("file %s not accessible\n", fn_buffer);
-        send_error(fd, 404, "Could not open file");
+        send_error(context_fd, 404, "Could not open file");
         return;
     }
 
@@ -834,7 +1292,7 @@ void execute_cgi(int id, int fd, char *parameter, char *query_string)
     f = popen(buffer, "r");
     if(f == NULL) {
         DBG("Unable to execute the requested CGI script\n");
-        send_error(fd, 403, "CGI script cannot be executed");
+        send_error(context_fd, 403, "CGI script cannot be executed");
         free(buffer);
         close(lfd);
         return;
@@ -856,29 +1314,35 @@ void execute_cgi(int id, int fd, char *parameter, char *query_string)
 
 
 /******************************************************************************
-Description.: Perform a command specified by parameter. Send response to fd.
-Input Value.: * fd.......: filedescriptor to send HTTP response to.
-              * parameter: contains the command and value as string.
-              * id.......: specifies which server-context to choose.
+Description.: read an integer query parameter
+Input Value.: * req....: parsed request
+              * name...: name of the parameter
+              * value..: set to the value if the parameter is present
 Return Value: -
 ******************************************************************************/
-void command(int id, int fd, char *parameter)
+static void request_param_int(request *req, const char *name, int *value)
 {
-    char buffer[BUFFER_SIZE] = {0};
-    char *command = NULL, *svalue = NULL, *value, *command_id_string;
-    int res = 0, ivalue = 0, command_id = -1,  len = 0;
+    char *svalue;
 
-    DBG("parameter is: %s\n", parameter);
+    if((svalue = request_param(req, name)) != NULL)
+        *value = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
+}
 
-    /* sanity check of parameter-string */
-    if(parameter == NULL || strlen(parameter) >= 255 || strlen(parameter) == 0) {
-        DBG("parameter string looks bad\n");
-        send_error(fd, 400, "Parameter-string of command does not look valid.");
-        return;
-    }
+/******************************************************************************
+Description.: Perform a command specified by the query parameters. Send
+              response to the client.
+Input Value.: * context_fd: client to send HTTP response to.
+              * req.......: request with the command and value as parameters.
+Return Value: -
+******************************************************************************/
+void command(cfd *context_fd, request *req)
+{
+    char buffer[BUFFER_SIZE] = {0};
+    char *command = NULL;
+    int res = 0, ivalue = 0, command_id = -1;
 
     /* command format:
-        ?control&dest=0plugin=0&id=0&group=0&value=0
+        ?action=command&dest=0&plugin=0&id=0&group=0&value=0
         where:
         dest: specifies the command destination (input, output, program itself) 0-1-2
         plugin specifies the plugin id  (not acceptable at the commands sent to the program itself)
@@ -888,115 +1352,55 @@ void command(int id, int fd, char *parameter)
     */
 
     /* search for required variable "command" */
-    if((command = strstr(parameter, "id=")) == NULL) {
+    if((command = request_param(req, "id")) == NULL || strlen(command) == 0) {
         DBG("no command id specified\n");
-        send_error(fd, 400, "no GET variable \"id=...\" found, it is required to specify which command id to execute");
-        return;
-    }
-
-    /* allocate and copy command string */
-    command += strlen("id=");
-    len = strspn(command, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_1234567890");
-    if((command = strndup(command, len)) == NULL) {
-        send_error(fd, 500, "could not allocate memory");
-        LOG("could not allocate memory\n");
+        send_error(context_fd, 400, "no GET variable \"id=...\" found, it is required to specify which command id to execute");
         return;
     }
 
     /* convert the command to id */
-    command_id_string = command;
-    len = strspn(command_id_string, "-1234567890");
-    if((svalue = strndup(command_id_string, len)) == NULL) {
-        if(command != NULL) free(command);
-        send_error(fd, 500, "could not allocate memory");
-        LOG("could not allocate memory\n");
-        return;
-    }
-
-    command_id = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
+    request_param_int(req, "id", &command_id);
     DBG("command id string: %s converted to int = %d\n", command, command_id);
 
     /* find and convert optional parameter "value" */
-    if((value = strstr(parameter, "value=")) != NULL) {
-        value += strlen("value=");
-        len = strspn(value, "-1234567890");
-        if((svalue = strndup(value, len)) == NULL) {
-            if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
-            LOG("could not allocate memory\n");
-            return;
-        }
-        ivalue = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
-        DBG("The command value converted value form string %s to integer %d\n", svalue, ivalue);
-    }
+    request_param_int(req, "value", &ivalue);
+    DBG("The command value converted to integer %d\n", ivalue);
 
     int group = IN_CMD_GENERIC;
-    if((value = strstr(parameter, "group=")) != NULL) {
-        value += strlen("group=");
-        len = strspn(value, "-1234567890");
-        if((svalue = strndup(value, len)) == NULL) {
-            if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
-            LOG("could not allocate memory\n");
-            return;
-        }
-        group = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
-        DBG("The command type value converted value form string %s to integer %d\n", svalue, group);
-    }
+    request_param_int(req, "group", &group);
+    DBG("The command type value converted to integer %d\n", group);
 
     int dest = Dest_Input;
-    if((value = strstr(parameter, "dest=")) != NULL) {
-        value += strlen("dest=");
-        len = strspn(value, "-1234567890");
-        if((svalue = strndup(value, len)) == NULL) {
-            if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
-            LOG("could not allocate memory\n");
-            return;
-        }
-        dest = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
-        #ifdef DEBUG
-        switch (dest) {
-            case Dest_Input:
-                DBG("The command destination value converted form the string \"%s\" to integer %d -> INPUT\n", svalue, dest );
-                break;
-            case Dest_Output:
-                DBG("The command destination value converted form the string \"%s\" to integer %d -> OUTPUT\n", svalue, dest );
-                break;
-            case Dest_Program:
-                DBG("The command destination value converted form the string \"%s\" to integer %d -> PROGRAM\n", svalue, dest );
-                break;
-        }
-        #endif
+    request_param_int(req, "dest", &dest);
+    #ifdef DEBUG
+    switch (dest) {
+        case Dest_Input:
+            DBG("The command destination value converted to integer %d -> INPUT\n", dest );
+            break;
+        case Dest_Output:
+            DBG("The command destination value converted to integer %d -> OUTPUT\n", dest );
+            break;
+        case Dest_Program:
+            DBG("The command destination value converted to integer %d -> PROGRAM\n", dest );
+            break;
     }
+    #endif
 
     int plugin_no = 0; // default plugin no = 0 for compatibility reasons
-    if((value = strstr(parameter, "plugin=")) != NULL) {
-        value += strlen("plugin=");
-        len = strspn(value, "-1234567890");
-        if((svalue = strndup(value, len)) == NULL) {
-            if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
-            LOG("could not allocate memory\n");
-            return;
-        }
-        plugin_no = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
-        DBG("The plugin number value converted value form string %s to integer %d\n", svalue, plugin_no);
-    } else {
-        value = NULL;
-    }
+    request_param_int(req, "plugin", &plugin_no);
+    DBG("The plugin number value converted to integer %d\n", plugin_no);
 
     switch(dest) {
     case Dest_Input:
-        if(plugin_no < pglobal->incnt) {
-            res = pglobal->in[plugin_no].cmd(plugin_no, command_id, group, ivalue, value);
+        if(plugin_no >= 0 && plugin_no < pglobal->incnt && pglobal->in[plugin_no].cmd != NULL) {
+            res = pglobal->in[plugin_no].cmd(plugin_no, command_id, group, ivalue, request_param(req, "value"));
         } else {
             DBG("Invalid plugin number: %d because only %d input plugins loaded", plugin_no,  pglobal->incnt-1);
         }
         break;
     case Dest_Output:
-        if(plugin_no < pglobal->outcnt) {
-            res = pglobal->out[plugin_no].cmd(plugin_no, command_id, group, ivalue, value);
+        if(plugin_no >= 0 && plugin_no < pglobal->outcnt && pglobal->out[plugin_no].cmd != NULL) {
+            res = pglobal->out[plugin_no].cmd(plugin_no, command_id, group, ivalue, request_param(req, "value"));
         } else {
             DBG("Invalid plugin number: %d because only %d output plugins loaded", plugin_no,  pglobal->incnt-1);
         }
@@ -1008,360 +1412,230 @@ void command(int id, int fd, char *parameter)
     }
 
     /* Send HTTP-response */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: text/plain\r\n" \
-            STD_HEADER \
-            "\r\n" \
-            "%s: %d", command, res);
+    snprintf(buffer, sizeof(buffer), "%s: %d", command, res);
 
-    if(write(fd, buffer, strlen(buffer)) < 0) {
+    if(send_answer(context_fd, "200 OK", "Content-type: text/plain\r\n" STD_HEADER, buffer, strlen(buffer)) < 0) {
         DBG("write failed, done anyway\n");
     }
-
-    if(command != NULL) free(command);
-    if(svalue != NULL) free(svalue);
 }
 
 /******************************************************************************
-Description.: Serve a connected TCP-client. This thread function is called
-              for each connect of a HTTP client like a webbrowser. It determines
-              if it is a valid HTTP request and dispatches between the different
-              response options.
-Input Value.: arg is the filedescriptor and server-context of the connected TCP
-              socket. It must have been allocated so it is freeable by this
-              thread function.
-Return Value: always NULL
+Description.: Read the header of the next request. Bytes of pipelined requests
+              that were read before get parsed first.
+Input Value.: * fd.....: fildescriptor to read from
+              * iobuf..: read buffer of the connection
+              * req....: request to fill
+              * timeout: seconds to wait for the request to begin
+Return Value: 1 if the header is complete, 0 if the client closed the
+              connection or did not send anything in time, -1 if the request
+              is malformed or too long
 ******************************************************************************/
-/* thread for clients that connected to this server */
-void *client_thread(void *arg)
+static int request_read(int fd, iobuffer *iobuf, request *req, int timeout)
 {
-    int cnt;
-    char query_suffixed = 0;
-    int input_number = 0;
-    char buffer[BUFFER_SIZE] = {0}, *pb = buffer;
-    iobuffer iobuf;
-    request req;
-    cfd lcfd; /* local-connected-file-descriptor */
-
-    /* we really need the fildescriptor and it must be freeable by us */
-    if(arg != NULL) {
-        memcpy(&lcfd, arg, sizeof(cfd));
-        free(arg);
-    } else
-        return NULL;
-
-    /* initializes the structures */
-    init_iobuffer(&iobuf);
-    init_request(&req);
-
-    /* What does the client want to receive? Read the request. */
-    memset(buffer, 0, sizeof(buffer));
-    if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-        close(lcfd.fd);
-        return NULL;
-    }
-
-    req.query_string = NULL;
-
-    /* determine what to deliver */
-    if(strstr(buffer, "GET /?action=snapshot") != NULL) {
-        req.type = A_SNAPSHOT;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #ifdef WXP_COMPAT
-    } else if((strstr(buffer, "GET /cam") != NULL) && (strstr(buffer, ".jpg") != NULL)) {
-        req.type = A_SNAPSHOT_WXP;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #endif
-    } else if(strstr(buffer, "POST /stream") != NULL) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    } else if(strstr(buffer, "GET /?action=stream") != NULL) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #ifdef WXP_COMPAT
-    } else if((strstr(buffer, "GET /cam") != NULL) && (strstr(buffer, ".mjpg") != NULL)) {
-        req.type = A_STREAM_WXP;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #endif
-    } else if(strstr(buffer, "GET /?action=take") != NULL) {
-        int len;
-        req.type = A_TAKE;
-        query_suffixed = 255;
-
-        /* advance by the length of known string */
-        if((pb = strstr(buffer, "GET /?action=take")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            query_suffixed = 0;
-            return NULL;
+    struct pollfd pfd;
+    int rc;
+
+    /* drop the previous request */
+    iobuf->level -= iobuf->parsed;
+    memmove(iobuf->buffer, iobuf->buffer + iobuf->parsed, iobuf->level);
+    iobuf->parsed = 0;
+    iobuf->token = 0;
+    iobuf->state = PARSE_METHOD;
+    memset(req, 0, sizeof(request));
+
+    while((rc = request_parse(iobuf, req)) == 0) {
+        if(iobuf->level == sizeof(iobuf->buffer)) {
+            DBG("request header too long\n");
+            return -1;
         }
-        pb += strlen("GET /?action=take"); // a pb points to thestring after the first & after command
 
-        /* only accept certain characters */
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
-        }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
-
-        if(unescape(req.parameter) == -1) {
-            free(req.parameter);
-            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
-            LOG("could not properly unescape command parameter string\n");
-            close(lcfd.fd);
-            return NULL;
-        }
-    } else if((strstr(buffer, "GET /input") != NULL) && (strstr(buffer, ".json") != NULL)) {
-        req.type = A_INPUT_JSON;
-        query_suffixed = 255;
-    } else if((strstr(buffer, "GET /output") != NULL) && (strstr(buffer, ".json") != NULL)) {
-        req.type = A_OUTPUT_JSON;
-        query_suffixed = 255;
-    } else if(strstr(buffer, "GET /program.json") != NULL) {
-        req.type = A_PROGRAM_JSON;
-    #ifdef MANAGMENT
-    } else if(strstr(buffer, "GET /clients.json") != NULL) {
-        req.type = A_CLIENTS_JSON;
-    #endif
-    } else if(strstr(buffer, "GET /?action=command") != NULL) {
-        int len;
-        req.type = A_COMMAND;
-
-        /* advance by the length of known string */
-        if((pb = strstr(buffer, "GET /?action=command")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            return NULL;
-        }
-        pb += strlen("GET /?action=command"); // a pb points to thestring after the first & after command
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if((rc = poll(&pfd, 1, timeout * 1000)) < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return 0;
 
-        /* only accept certain characters */
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
+        /* the socket may get closed remotly between poll() and read() */
+        if((rc = read(fd, iobuf->buffer + iobuf->level, sizeof(iobuf->buffer) - iobuf->level)) <= 0)
+            return 0;
+        iobuf->level += rc;
 
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
-        }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
-
-        if(unescape(req.parameter) == -1) {
-            free(req.parameter);
-            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
-            LOG("could not properly unescape command parameter string\n");
-            close(lcfd.fd);
-            return NULL;
-        }
+        /* once the request began the rest of the header must follow soon */
+        timeout = 5;
+    }
 
-        DBG("command parameter (len: %d): \"%s\"\n", len, req.parameter);
-    } else {
-        int len;
+    return rc;
+}
 
-        DBG("try to serve a file\n");
-        req.type = A_FILE;
+/******************************************************************************
+Description.: Read and answer a single HTTP request of a connected client.
+              The routing table determines the answer.
+Input Value.: * lcfd...: the connected client
+              * iobuf..: read buffer of the connection, bytes of pipelined
+                         requests stay in there for the next call
+              * timeout: seconds to wait for the request line
+Return Value: 0 if the connection stays open for the next request,
+              1 if it was handed over to a stream event loop,
+              -1 if it has to be closed
+******************************************************************************/
+static int handle_request(cfd *lcfd, iobuffer *iobuf, int timeout)
+{
+    int rc;
+    request req;
 
-        if((pb = strstr(buffer, "GET /")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            return NULL;
-        }
+    /* each answer closes the connection until the request header allows otherwise */
+    lcfd->keepalive = 0;
 
-        pb += strlen("GET /");
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
-        }
+    /* What does the client want to receive? Read the request. */
+    if((rc = request_read(lcfd->fd, iobuf, &req, timeout)) <= 0) {
+        if(rc < 0)
+            send_error(lcfd, 400, "Malformed HTTP request");
+        return -1;
+    }
 
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
-
-        if (strstr(pb, ".cgi") != NULL) {
-            req.type = A_CGI;
-            pb = strchr(pb, '?');
-            if (pb != NULL) {
-                pb++; // skip the ?
-                len = strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890=&");
-                req.query_string = malloc(len + 1);
-                if (req.query_string == NULL)
-                    exit(EXIT_FAILURE);
-                memset(req.query_string, 0, len + 1);
-                strncpy(req.query_string, pb, len);
-            } else {
-                req.query_string = malloc(2);
-                if (req.query_string == NULL)
-                    exit(EXIT_FAILURE);
-                sprintf(req.query_string, " ");
-            }
-        }
-        DBG("parameter (len: %d): \"%s\"\n", len, req.parameter);
+    /* determine what to deliver */
+    if(request_route(&req) == -1) {
+        send_error(lcfd, 400, "could not properly unescape the query");
+        LOG("could not properly unescape the query\n");
+        return -1;
     }
 
-    /*
-     * Since when we are working with multiple input plugins
-     * there are some url which could have a _[plugin number suffix]
-     * For compatibility reasons it could be left in that case the output will be
-     * generated from the 0. input plugin
-     */
-    if(query_suffixed) {
-        char *sch = strchr(buffer, '_');
-        if(sch != NULL) {  // there is an _ in the url so the input number should be present
-            DBG("Suffix character: %s\n", sch + 1); // FIXME if more than 10 input plugin is added
-            char numStr[3];
-            memset(numStr, 0, 3);
-            strncpy(numStr, sch + 1, 1);
-            input_number = atoi(numStr);
-
-            if ((req.type == A_SNAPSHOT_WXP) || (req.type == A_STREAM_WXP)) { // webcamxp adds offset to the camera number
-                input_number--;
-            }
+    #ifdef MANAGMENT
+    switch(req.type) {
+    case A_SNAPSHOT:
+    case A_SNAPSHOT_WXP:
+    case A_STREAM:
+    case A_STREAM_WXP:
+    case A_WEBSOCKET:
+        if (check_client_status(lcfd->client)) {
+            lcfd->client->last_take_time.tv_sec += piggy_fine;
+            send_error(lcfd, 403, "frame already sent");
+            return -1;
         }
-        DBG("plugin_no: %d\n", input_number);
+    default:
+        break;
     }
+    #endif
 
     /*
-     * parse the rest of the HTTP-request
-     * the end of the request-header is marked by a single, empty line with "\r\n"
+     * HTTP/1.1 clients keep the connection unless they ask to close it,
+     * HTTP/1.0 clients only if they ask for it. A request body is never read,
+     * it would be taken for the next request, so such connections get closed.
+     * Streams and CGI scripts end with the connection anyway.
      */
-    do {
-        memset(buffer, 0, sizeof(buffer));
-
-        if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-            free_request(&req);
-            close(lcfd.fd);
-            return NULL;
-        }
-
-        if(strcasestr(buffer, "User-Agent: ") != NULL) {
-            req.client = strdup(buffer + strlen("User-Agent: "));
-        } else if(strcasestr(buffer, "Authorization: Basic ") != NULL) {
-            req.credentials = strdup(buffer + strlen("Authorization: Basic "));
-            decodeBase64(req.credentials);
-            DBG("username:password: %s\n", req.credentials);
+    if(lcfd->pc->conf.keepalive > 0 && req.content_length == 0) {
+        switch(req.type) {
+        case A_STREAM:
+        case A_STREAM_WXP:
+        case A_WEBSOCKET:
+        case A_CGI:
+            break;
+        default:
+            if(req.http11)
+                lcfd->keepalive = (req.connection == NULL || strcasestr(req.connection, "close") == NULL);
+            else
+                lcfd->keepalive = (req.connection != NULL && strcasestr(req.connection, "keep-alive") != NULL);
         }
-
-    } while(cnt > 2 && !(buffer[0] == '\r' && buffer[1] == '\n'));
+    }
 
     /* check for username and password if parameter -c was given */
-    if(lcfd.pc->conf.credentials != NULL) {
-        if(req.credentials == NULL || strcmp(lcfd.pc->conf.credentials, req.credentials) != 0) {
+    if(lcfd->pc->conf.credentials != NULL) {
+        if(req.credentials == NULL || strcmp(lcfd->pc->conf.credentials, req.credentials) != 0) {
             DBG("access denied\n");
-            send_error(lcfd.fd, 401, "username and password do not match to configuration");
-            close(lcfd.fd);
-            free_request(&req);
-            return NULL;
+            send_error(lcfd, 401, "username and password do not match to configuration");
+            return lcfd->keepalive ? 0 : -1;
         }
         DBG("access granted\n");
     }
 
     /* now it's time to answer */
-    if (query_suffixed) {
-        if (req.type == A_OUTPUT_JSON) {
-            if(!(input_number < pglobal->outcnt)) {
-                DBG("Output number: %d out of range (valid: 0..%d)\n", input_number, pglobal->outcnt-1);
-                send_error(lcfd.fd, 404, "Invalid output plugin number");
-                req.type = A_UNKNOWN;
-            }
-        } else {
-            if(!(input_number < pglobal->incnt)) {
-                DBG("Input number: %d out of range (valid: 0..%d)\n", input_number, pglobal->incnt-1);
-                send_error(lcfd.fd, 404, "Invalid input plugin number");
-                req.type = A_UNKNOWN;
-            }
+    switch(req.type) {
+    case A_OUTPUT_JSON:
+        if(req.number < 0 || !(req.number < pglobal->outcnt)) {
+            DBG("Output number: %d out of range (valid: 0..%d)\n", req.number, pglobal->outcnt-1);
+            send_error(lcfd, 404, "Invalid output plugin number");
+            return lcfd->keepalive ? 0 : -1;
         }
+        break;
+    case A_SNAPSHOT:
+    case A_SNAPSHOT_WXP:
+    case A_STREAM:
+    case A_STREAM_WXP:
+    case A_TAKE:
+    case A_INPUT_JSON:
+    case A_WEBSOCKET:
+        if(req.number < 0 || !(req.number < pglobal->incnt)) {
+            DBG("Input number: %d out of range (valid: 0..%d)\n", req.number, pglobal->incnt-1);
+            send_error(lcfd, 404, "Invalid input plugin number");
+            return lcfd->keepalive ? 0 : -1;
+        }
+        break;
+    default:
+        break;
     }
 
     switch(req.type) {
     case A_SNAPSHOT_WXP:
     case A_SNAPSHOT:
-        DBG("Request for snapshot from input: %d\n", input_number);
-        send_snapshot(&lcfd, input_number);
+        DBG("Request for snapshot from input: %d\n", req.number);
+        send_snapshot(lcfd, req.number, req.etag);
         break;
     case A_STREAM:
-        DBG("Request for stream from input: %d\n", input_number);
-        send_stream(&lcfd, input_number);
+        DBG("Request for stream from input: %d\n", req.number);
+        /* with event loops enabled the socket is handed over, this thread is done */
+        if(stream_loop_add(lcfd, req.number) == 0)
+            return 1;
+        send_stream(lcfd, req.number);
+        break;
+    case A_WEBSOCKET:
+        DBG("Request for WebSocket stream from input: %d\n", req.number);
+        send_websocket(lcfd, &req, iobuf, req.number);
         break;
     #ifdef WXP_COMPAT
     case A_STREAM_WXP:
-        DBG("Request for WXP compat stream from input: %d\n", input_number);
-        send_stream_wxp(&lcfd, input_number);
+        DBG("Request for WXP compat stream from input: %d\n", req.number);
+        send_stream_wxp(lcfd, req.number);
         break;
     #endif
     case A_COMMAND:
-        if(lcfd.pc->conf.nocommands) {
-            send_error(lcfd.fd, 501, "this server is configured to not accept commands");
+        if(lcfd->pc->conf.nocommands) {
+            send_error(lcfd, 501, "this server is configured to not accept commands");
             break;
         }
-        command(lcfd.pc->id, lcfd.fd, req.parameter);
+        command(lcfd, &req);
         break;
     case A_INPUT_JSON:
         DBG("Request for the Input plugin descriptor JSON file\n");
-        send_input_JSON(lcfd.fd, input_number);
+        send_input_JSON(lcfd, req.number);
         break;
     case A_OUTPUT_JSON:
         DBG("Request for the Output plugin descriptor JSON file\n");
-        send_output_JSON(lcfd.fd, input_number);
+        send_output_JSON(lcfd, req.number);
         break;
     case A_PROGRAM_JSON:
         DBG("Request for the program descriptor JSON file\n");
-        send_program_JSON(lcfd.fd);
+        send_program_JSON(lcfd);
+        break;
+    case A_METRICS:
+        DBG("Request for the metrics\n");
+        send_metrics(lcfd);
+        break;
+    case A_TRACE:
+        DBG("Request for the latency trace\n");
+        send_trace(lcfd);
         break;
     #ifdef MANAGMENT
     case A_CLIENTS_JSON:
         DBG("Request for the clients JSON file\n");
-        send_clients_JSON(lcfd.fd);
+        send_clients_JSON(lcfd);
         break;
     #endif
     case A_FILE:
-        if(lcfd.pc->conf.www_folder == NULL)
-            send_error(lcfd.fd, 501, "no www-folder configured");
+        if(lcfd->pc->conf.www_folder == NULL)
+            send_error(lcfd, 501, "no www-folder configured");
         else
-            send_file(lcfd.pc->id, lcfd.fd, req.parameter);
+            send_file(lcfd, &req);
         break;
     /*
         With the take argument we try to save the current image to file before we transmit it to the user.
@@ -1369,31 +1643,21 @@ void *client_thread(void *arg)
         If it not loaded, or the file could not be saved then we won't transmit the frame.
     */
     case A_TAKE: {
-        int i, ret = 0, found = 0;
+        int i, ret = 0, found = 0, answered = 0;
         for (i = 0; i<pglobal->outcnt; i++) {
             if (pglobal->out[i].name != NULL) {
                 if (strstr(pglobal->out[i].name, "FILE output plugin")) {
                     found = 255;
                     DBG("output_file found id: %d\n", i);
                     char *filename = NULL;
-                    char *filenamearg = NULL;
-                    int len = 0;
-                    DBG("Buffer: %s \n", req.parameter);
-                    if((filename = strstr(req.parameter, "filename=")) != NULL) {
-                        filename += strlen("filename=");
-                        char *fn = strchr(filename, '&');
-                        if (fn == NULL)
-                            len = strlen(filename);
-                        else
-                            len = (int)(fn - filename);
-                        filenamearg = (char*)calloc(len, sizeof(char));
-                        memcpy(filenamearg, filename, len);
-                        DBG("Filename = %s\n", filenamearg);
+                    if((filename = request_param(&req, "filename")) != NULL && *filename != '\0') {
+                        DBG("Filename = %s\n", filename);
                         //int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int value, char *valueStr)
-                        ret = pglobal->out[i].cmd(i, OUT_FILE_CMD_TAKE, IN_CMD_GENERIC, 0, filenamearg);
+                        ret = pglobal->out[i].cmd(i, OUT_FILE_CMD_TAKE, IN_CMD_GENERIC, 0, filename);
                     } else {
                         DBG("filename is not specified int the URL\n");
-                        send_error(lcfd.fd, 404, "The &filename= must present for the take command in the URL");
+                        send_error(lcfd, 404, "The &filename= must present for the take command in the URL");
+                        answered = 1;
                     }
                     break;
                 }
@@ -1402,25 +1666,61 @@ void *client_thread(void *arg)
 
         if (found == 0) {
             LOG("FILE CHANGE TEST output plugin not loaded\n");
-            send_error(lcfd.fd, 404, "FILE output plugin not loaded, taking snapshot not possible");
-        } else {
+            send_error(lcfd, 404, "FILE output plugin not loaded, taking snapshot not possible");
+        } else if (!answered) {
             if (ret == 0) {
-                send_snapshot(&lcfd, input_number);
+                send_snapshot(lcfd, req.number, NULL);
             } else {
-                send_error(lcfd.fd, 404, "Taking snapshot failed!");
+                send_error(lcfd, 404, "Taking snapshot failed!");
             }
         }
         } break;
     case A_CGI:
-        DBG("cgi script: %s requested\n", req.parameter);
-        execute_cgi(lcfd.pc->id, lcfd.fd, req.parameter, req.query_string);
+        DBG("cgi script: %s requested\n", req.path + 1);
+        execute_cgi(lcfd, req.path + 1, req.query_string);
         break;
     default:
         DBG("unknown request\n");
+        send_error(lcfd, 404, "Unknown request");
     }
 
-    close(lcfd.fd);
-    free_request(&req);
+
+    return lcfd->keepalive ? 0 : -1;
+}
+
+/******************************************************************************
+Description.: Serve a connected TCP-client. This thread function is called
+              for each connect of a HTTP client like a webbrowser. Requests
+              get answered one after the other as long as the client keeps
+              the connection open.
+Input Value.: arg is the filedescriptor and server-context of the connected TCP
+              socket. It must have been allocated so it is freeable by this
+              thread function.
+Return Value: always NULL
+******************************************************************************/
+/* thread for clients that connected to this server */
+void *client_thread(void *arg)
+{
+    int rc, timeout = 5;
+    iobuffer iobuf;
+    cfd lcfd; /* local-connected-file-descriptor */
+
+    /* we really need the fildescriptor and it must be freeable by us */
+    if(arg != NULL) {
+        memcpy(&lcfd, arg, sizeof(cfd));
+        free(arg);
+    } else
+        return NULL;
+
+    /* the buffer lives as long as the connection, it may hold pipelined requests */
+    init_iobuffer(&iobuf);
+
+    /* an idle persistent connection gets closed after the keep-alive timeout */
+    while((rc = handle_request(&lcfd, &iobuf, timeout)) == 0)
+        timeout = lcfd.pc->conf.keepalive;
+
+    if(rc < 0)
+        close(lcfd.fd);
 
     DBG("leaving HTTP client thread\n");
     return NULL;
@@ -1438,29 +1738,188 @@ void server_cleanup(void *arg)
 
     OPRINT("cleaning up resources allocated by server thread #%02d\n", pcontext->id);
 
+    /* the first acceptor is the server thread itself */
+    for(i = 1; i < pcontext->acceptor_count; i++) {
+        pthread_cancel(pcontext->acceptors[i].threadID);
+        pthread_join(pcontext->acceptors[i].threadID, NULL);
+    }
+    free(pcontext->acceptors);
+    pcontext->acceptors = NULL;
+    pcontext->acceptor_count = 0;
+
     for(i = 0; i < MAX_SD_LEN; i++)
         close(pcontext->sd[i]);
+
+    snapshot_flush(pcontext);
+    static_file_flush(pcontext);
+}
+
+/******************************************************************************
+Description.: Open one listening socket per address family. Several sets of
+              sockets can be bound to the same port with SO_REUSEPORT, the
+              kernel then spreads new connections over them.
+Input Value.: * pc.....: server context
+              * aip....: addresses to listen on
+              * sd.....: array that receives the sockets
+              * max....: size of that array
+              * reuseport: bind with SO_REUSEPORT
+Return Value: number of sockets that listen
+******************************************************************************/
+static int server_listen(context *pc, struct addrinfo *aip, int *sd, int max, int reuseport)
+{
+    struct addrinfo *aip2;
+    int on, i = 0;
+
+    for(aip2 = aip; aip2 != NULL && i < max; aip2 = aip2->ai_next) {
+        /* accept() must not block if another thread took the connection */
+        if((sd[i] = socket(aip2->ai_family, aip2->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+            continue;
+        }
+
+        /* ignore "socket already in use" errors */
+        on = 1;
+        if(setsockopt(sd[i], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+            perror("setsockopt(SO_REUSEADDR) failed\n");
+        }
+
+        #ifdef SO_REUSEPORT
+        on = 1;
+        if(reuseport && setsockopt(sd[i], SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            perror("setsockopt(SO_REUSEPORT) failed\n");
+        }
+        #endif
+
+        /* IPv6 socket should listen to IPv6 only, otherwise we will get "socket already in use" */
+        on = 1;
+        if(aip2->ai_family == AF_INET6 && setsockopt(sd[i], IPPROTO_IPV6, IPV6_V6ONLY,
+                (const void *)&on , sizeof(on)) < 0) {
+            perror("setsockopt(IPV6_V6ONLY) failed\n");
+        }
+
+        if(bind(sd[i], aip2->ai_addr, aip2->ai_addrlen) < 0) {
+            perror("bind");
+            close(sd[i]);
+            sd[i] = -1;
+            continue;
+        }
+
+        if(listen(sd[i], pc->conf.backlog) < 0) {
+            perror("listen");
+            close(sd[i]);
+            sd[i] = -1;
+            continue;
+        }
+
+        i++;
+    }
+
+    if(aip2 != NULL && i >= max) {
+        OPRINT("%s(): maximum number of server sockets exceeded", __FUNCTION__);
+    }
+
+    return i;
+}
+
+/******************************************************************************
+Description.: Wait for clients to connect to the sockets of one acceptor and
+              start a new thread for each accepted connection.
+Input Value.: arg is the acceptor
+Return Value: always NULL, returns when the server stops
+******************************************************************************/
+static void *acceptor_thread(void *arg)
+{
+    acceptor *a = arg;
+    context *pcontext = a->pc;
+    struct pollfd fds[MAX_SD_LEN];
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len;
+    pthread_t client;
+    int fd, err, i;
+    #if defined(MANAGMENT)
+    char name[NI_MAXHOST];
+    #endif
+
+    for(i = 0; i < a->count; i++) {
+        fds[i].fd = pcontext->sd[a->first + i];
+        fds[i].events = POLLIN;
+    }
+
+    /* create a child for every client that connects */
+    while(!pglobal->stop) {
+        DBG("waiting for clients to connect\n");
+
+        if((err = poll(fds, a->count, -1)) < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        for(i = 0; i < a->count; i++) {
+            if(!(fds[i].revents & POLLIN))
+                continue;
+
+            /* take all pending connections, a reconnect storm fills the backlog quickly */
+            while(1) {
+                addr_len = sizeof(client_addr);
+                fd = accept4(fds[i].fd, (struct sockaddr *)&client_addr, &addr_len, SOCK_CLOEXEC);
+                if(fd < 0) {
+                    if(errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                        /* out of file descriptors, give the clients a moment to leave */
+                        perror("accept4");
+                        poll(NULL, 0, 100);
+                    }
+                    break;
+                }
+
+                cfd *pcfd = malloc(sizeof(cfd));
+                if(pcfd == NULL) {
+                    fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                memset(pcfd, 0, sizeof(cfd));
+                pcfd->fd = fd;
+                pcfd->pc = pcontext;
+
+                #if defined(MANAGMENT)
+                client_address(&client_addr, name, sizeof(name));
+                pcfd->client = add_client(name);
+                #endif
+
+                /* start new thread that will handle this TCP connected client */
+                DBG("create thread to handle client that just established a connection\n");
+
+                if(pthread_create(&client, NULL, &client_thread, pcfd) != 0) {
+                    DBG("could not launch another client thread\n");
+                    close(pcfd->fd);
+                    free(pcfd);
+                    continue;
+                }
+                pthread_detach(client);
+            }
+        }
+    }
+
+    return NULL;
 }
 
 /******************************************************************************
-Description.: Open a TCP socket and wait for clients to connect. If clients
-              connect, start a new thread for each accepted connection.
+Description.: Open the TCP sockets and wait for clients to connect. Each
+              acceptor thread listens on its own sockets, the server thread
+              is the first of them.
 Input Value.: arg is a pointer to the globals struct
 Return Value: always NULL, will only return on exit
 ******************************************************************************/
 void *server_thread(void *arg)
 {
-    int on;
-    pthread_t client;
-    struct addrinfo *aip, *aip2;
+    struct addrinfo *aip;
     struct addrinfo hints;
-    struct sockaddr_storage client_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_storage);
-    fd_set selectfds;
-    int max_fds = 0;
     char name[NI_MAXHOST];
     int err;
-    int i;
+    int i, n, count;
 
     context *pcontext = arg;
     pglobal = pcontext->pglobal;
@@ -1492,49 +1951,32 @@ void *server_thread(void *arg)
     client_infos.infos = NULL;
     #endif
 
-    /* open sockets for server (1 socket / address family) */
-    i = 0;
-    for(aip2 = aip; aip2 != NULL; aip2 = aip2->ai_next) {
-        if((pcontext->sd[i] = socket(aip2->ai_family, aip2->ai_socktype, 0)) < 0) {
-            continue;
-        }
-
-        /* ignore "socket already in use" errors */
-        on = 1;
-        if(setsockopt(pcontext->sd[i], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
-            perror("setsockopt(SO_REUSEADDR) failed\n");
-        }
-
-        /* IPv6 socket should listen to IPv6 only, otherwise we will get "socket already in use" */
-        on = 1;
-        if(aip2->ai_family == AF_INET6 && setsockopt(pcontext->sd[i], IPPROTO_IPV6, IPV6_V6ONLY,
-                (const void *)&on , sizeof(on)) < 0) {
-            perror("setsockopt(IPV6_V6ONLY) failed\n");
-        }
+    n = pcontext->conf.acceptors;
+    if(n <= 0 && (n = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        n = 1;
+    if(n > MAX_ACCEPTORS)
+        n = MAX_ACCEPTORS;
 
-        /* perhaps we will use this keep-alive feature oneday */
-        /* setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)); */
+    pcontext->acceptors = calloc(n, sizeof(acceptor));
+    if(pcontext->acceptors == NULL) {
+        fprintf(stderr, "could not allocate memory for the acceptors\n");
+        exit(EXIT_FAILURE);
+    }
 
-        if(bind(pcontext->sd[i], aip2->ai_addr, aip2->ai_addrlen) < 0) {
-            perror("bind");
-            pcontext->sd[i] = -1;
-            continue;
-        }
+    /* open sockets for server (1 socket / address family / acceptor) */
+    pcontext->sd_len = 0;
+    for(i = 0; i < n; i++) {
+        count = server_listen(pcontext, aip, &pcontext->sd[pcontext->sd_len],
+                              MAX_SD_LEN - pcontext->sd_len, n > 1);
+        if(count < 1)
+            break;
 
-        if(listen(pcontext->sd[i], 10) < 0) {
-            perror("listen");
-            pcontext->sd[i] = -1;
-        } else {
-            i++;
-            if(i >= MAX_SD_LEN) {
-                OPRINT("%s(): maximum number of server sockets exceeded", __FUNCTION__);
-                i--;
-                break;
-            }
-        }
+        pcontext->acceptors[i].pc = pcontext;
+        pcontext->acceptors[i].first = pcontext->sd_len;
+        pcontext->acceptors[i].count = count;
+        pcontext->sd_len += count;
     }
-
-    pcontext->sd_len = i;
+    freeaddrinfo(aip);
 
     if(pcontext->sd_len < 1) {
         OPRINT("%s(): bind(%d) failed\n", __FUNCTION__, htons(pcontext->conf.port));
@@ -1542,65 +1984,37 @@ void *server_thread(void *arg)
         exit(EXIT_FAILURE);
     }
 
-    /* create a child for every client that connects */
-    while(!pglobal->stop) {
-        //int *pfd = (int *)malloc(sizeof(int));
-        cfd *pcfd = malloc(sizeof(cfd));
-
-        if(pcfd == NULL) {
-            fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
-            exit(EXIT_FAILURE);
-        }
-
-        DBG("waiting for clients to connect\n");
-
-        do {
-            FD_ZERO(&selectfds);
-
-            for(i = 0; i < MAX_SD_LEN; i++) {
-                if(pcontext->sd[i] != -1) {
-                    FD_SET(pcontext->sd[i], &selectfds);
-
-                    if(pcontext->sd[i] > max_fds)
-                        max_fds = pcontext->sd[i];
-                }
-            }
-
-            err = select(max_fds + 1, &selectfds, NULL, NULL, NULL);
-
-            if(err < 0 && errno != EINTR) {
-                perror("select");
-                exit(EXIT_FAILURE);
-            }
-        } while(err <= 0);
-
-        for(i = 0; i < max_fds + 1; i++) {
-            if(pcontext->sd[i] != -1 && FD_ISSET(pcontext->sd[i], &selectfds)) {
-                pcfd->fd = accept(pcontext->sd[i], (struct sockaddr *)&client_addr, &addr_len);
-                pcfd->pc = pcontext;
-
-                /* start new thread that will handle this TCP connected client */
-                DBG("create thread to handle client that just established a connection\n");
+    /* without SO_REUSEPORT only the first set of sockets could be bound */
+    if(i < n) {
+        OPRINT("%s(): only %d of %d acceptors could listen\n", __FUNCTION__, i, n);
+    }
+    pcontext->acceptor_count = i;
 
-                if(getnameinfo((struct sockaddr *)&client_addr, addr_len, name, sizeof(name), NULL, 0, NI_NUMERICHOST) == 0) {
-                    DBG("serving client: %s\n", name);
-                }
+    if(pcontext->conf.workers > 0 && stream_loops_start(pcontext) != 0) {
+        OPRINT("%s(): could not start the stream event loops\n", __FUNCTION__);
+        closelog();
+        exit(EXIT_FAILURE);
+    }
 
-                #if defined(MANAGMENT)
-                pcfd->client = add_client(name);
-                #endif
+    for(i = 1; i < pcontext->acceptor_count; i++) {
+        if(pthread_create(&pcontext->acceptors[i].threadID, NULL, acceptor_thread, &pcontext->acceptors[i]) != 0) {
+            OPRINT("%s(): could not start acceptor %d\n", __FUNCTION__, i);
+            break;
+        }
+    }
 
-                if(pthread_create(&client, NULL, &client_thread, pcfd) != 0) {
-                    DBG("could not launch another client thread\n");
-                    close(pcfd->fd);
-                    free(pcfd);
-                    continue;
-                }
-                pthread_detach(client);
-            }
+    /* sockets nobody accepts on must not get connections assigned */
+    if(i < pcontext->acceptor_count) {
+        for(count = pcontext->acceptors[i].first; count < pcontext->sd_len; count++) {
+            close(pcontext->sd[count]);
+            pcontext->sd[count] = -1;
         }
+        pcontext->sd_len = pcontext->acceptors[i].first;
+        pcontext->acceptor_count = i;
     }
 
+    acceptor_thread(&pcontext->acceptors[0]);
+
     DBG("leaving server thread, calling cleanup function now\n");
     pthread_cleanup_pop(1);
 
@@ -1613,15 +2027,10 @@ Description.: Send a JSON file which is contains information about the input plu
 Input Value.: fildescriptor fd to send the answer to
 Return Value: -
 ******************************************************************************/
-void send_input_JSON(int fd, int input_number)
+void send_input_JSON(cfd *context_fd, int input_number)
 {
     char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
     int i;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
-
     DBG("Serving the input plugin %d descriptor JSON file\n", input_number);
 
 
@@ -1823,22 +2232,18 @@ void send_input_JSON(int fd, int input_number)
             "}\n");
     i = strlen(buffer);
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
+    if(send_answer(context_fd, "200 OK", "Content-type: application/x-javascript\r\n" STD_HEADER, buffer, i) < 0) {
         DBG("unable to serve the control JSON file\n");
     }
 }
 
 
-void send_program_JSON(int fd)
+void send_program_JSON(cfd *context_fd)
 {
     char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    int i, k;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
-
+    int i, k, id = context_fd->pc->id;
+    unsigned long long calls, bytes;
+    stream_stats *st;
     DBG("Serving the program descriptor JSON file\n");
 
 
@@ -1892,15 +2297,266 @@ void send_program_JSON(int fd)
             /*"]\n"
             "}\n"
             "]\n"*/
-            "]}\n");
+            "],\n");
+
+    /* stream delivery statistics of this server */
+    calls = __sync_add_and_fetch(&servers[id].stats.send_calls, 0);
+    bytes = __sync_add_and_fetch(&servers[id].stats.send_bytes, 0);
+    sprintf(buffer + strlen(buffer),
+            "\"stream\": {\n"
+            "\"send_calls\": %llu,\n"
+            "\"send_bytes\": %llu,\n"
+            "\"bytes_per_call\": %llu,\n"
+            "\"clients\":[\n",
+            calls, bytes, (calls > 0) ? bytes / calls : 0);
+
+    /* connected stream clients, stop early if the buffer is getting full */
+    pthread_mutex_lock(&servers[id].streams_mutex);
+    for(st = servers[id].streams; st != NULL && strlen(buffer) < sizeof(buffer) - BUFFER_SIZE; st = st->next) {
+        sprintf(buffer + strlen(buffer),
+                "%s{\n"
+                "\"address\": \"%s\",\n"
+                "\"input\": %d,\n"
+                "\"frames_sent\": %llu,\n"
+                "\"frames_dropped\": %llu\n"
+                "}",
+                (st != servers[id].streams) ? ",\n" : "",
+                st->address,
+                st->input,
+                st->frames_sent,
+                st->frames_dropped);
+    }
+    pthread_mutex_unlock(&servers[id].streams_mutex);
+
+    sprintf(buffer + strlen(buffer), "\n]\n}}\n");
     i = strlen(buffer);
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
+    if(send_answer(context_fd, "200 OK", "Content-type: application/x-javascript\r\n" STD_HEADER, buffer, i) < 0) {
         DBG("unable to serve the program JSON file\n");
     }
 }
 
+/******************************************************************************
+Description.: append formatted text to the metrics page, text that does not
+              fit anymore is cut off
+Input Value.: * buffer.: page
+              * size...: size of the page
+              * len....: bytes used so far, gets updated
+              * format.: printf format and its arguments
+Return Value: -
+******************************************************************************/
+static void metrics_printf(char *buffer, size_t size, size_t *len, const char *format, ...)
+{
+    va_list args;
+    int rc;
+
+    if(*len >= size - 1)
+        return;
+
+    va_start(args, format);
+    rc = vsnprintf(buffer + *len, size - *len, format, args);
+    va_end(args);
+
+    if(rc > 0)
+        *len = (*len + rc < size - 1) ? *len + rc : size - 1;
+}
+
+/******************************************************************************
+Description.: append a histogram of an input plugin to the metrics page
+Input Value.: * buffer, size, len: page, see metrics_printf()
+              * name...: name of the metric
+              * input..: number of the input plugin
+              * h......: the histogram
+              * bounds.: upper bounds of its buckets
+              * scale..: factor from the unit of the histogram to the one of the metric
+Return Value: -
+******************************************************************************/
+static void metrics_histogram(char *buffer, size_t size, size_t *len, const char *name,
+                              int input, histogram *h, const unsigned long long *bounds, double scale)
+{
+    unsigned long long count = 0;
+    int i;
+
+    for(i = 0; i < METRICS_BUCKETS - 1; i++) {
+        count += __sync_add_and_fetch(&h->bucket[i], 0);
+        metrics_printf(buffer, size, len, "%s_bucket{input=\"%d\",le=\"%.10g\"} %llu\n",
+                       name, input, bounds[i] * scale, count);
+    }
+    count += __sync_add_and_fetch(&h->bucket[i], 0);
+    metrics_printf(buffer, size, len, "%s_bucket{input=\"%d\",le=\"+Inf\"} %llu\n", name, input, count);
+    metrics_printf(buffer, size, len, "%s_sum{input=\"%d\"} %.10g\n", name, input,
+                   __sync_add_and_fetch(&h->sum, 0) * scale);
+    metrics_printf(buffer, size, len, "%s_count{input=\"%d\"} %llu\n", name, input, count);
+}
+
+/******************************************************************************
+Description.: Send the statistics of all plugins in the text format of
+              Prometheus. Counters are read without locking, so values of
+              one page may be a few frames apart.
+Input Value.: fildescriptor fd to send the answer to
+Return Value: -
+******************************************************************************/
+void send_metrics(cfd *context_fd)
+{
+    size_t size = BUFFER_SIZE * 64, len = 0;
+    char *buffer;
+    int i, k, id = context_fd->pc->id, clients = 0;
+    input_metrics *im;
+    output_metrics *om;
+    stream_stats *st;
+
+    DBG("Serving the metrics\n");
+
+    if((buffer = malloc(size)) == NULL) {
+        send_error(context_fd, 500, "not enough memory");
+        return;
+    }
+    buffer[0] = '\0';
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_input_frames_total Frames published by the input plugin.\n"
+                   "# TYPE mjpg_input_frames_total counter\n");
+    for(k = 0; k < pglobal->incnt; k++) {
+        metrics_printf(buffer, size, &len, "mjpg_input_frames_total{input=\"%d\"} %llu\n",
+                       k, __sync_add_and_fetch(&pglobal->in[k].metrics.frames, 0));
+    }
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_input_dropped_frames_total Captured frames the input plugin did not publish.\n"
+                   "# TYPE mjpg_input_dropped_frames_total counter\n");
+    for(k = 0; k < pglobal->incnt; k++) {
+        for(i = 0; i < DROP_REASONS; i++) {
+            metrics_printf(buffer, size, &len, "mjpg_input_dropped_frames_total{input=\"%d\",reason=\"%s\"} %llu\n",
+                           k, drop_reason_names[i], __sync_add_and_fetch(&pglobal->in[k].metrics.drops[i], 0));
+        }
+    }
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_input_encode_seconds Time to compress or copy a frame.\n"
+                   "# TYPE mjpg_input_encode_seconds histogram\n");
+    for(k = 0; k < pglobal->incnt; k++) {
+        im = &pglobal->in[k].metrics;
+        metrics_histogram(buffer, size, &len, "mjpg_input_encode_seconds", k, &im->encode_us, encode_us_bounds, 1e-6);
+    }
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_input_frame_bytes Size of the published frames.\n"
+                   "# TYPE mjpg_input_frame_bytes histogram\n");
+    for(k = 0; k < pglobal->incnt; k++) {
+        im = &pglobal->in[k].metrics;
+        metrics_histogram(buffer, size, &len, "mjpg_input_frame_bytes", k, &im->frame_bytes, frame_bytes_bounds, 1);
+    }
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_input_db_contended_total Times the frame mutex of the input was already locked.\n"
+                   "# TYPE mjpg_input_db_contended_total counter\n");
+    for(k = 0; k < pglobal->incnt; k++) {
+        metrics_printf(buffer, size, &len, "mjpg_input_db_contended_total{input=\"%d\"} %llu\n",
+                       k, __sync_add_and_fetch(&pglobal->in[k].metrics.db_contended, 0));
+    }
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_input_db_wait_seconds_total Time spent waiting for the frame mutex of the input.\n"
+                   "# TYPE mjpg_input_db_wait_seconds_total counter\n");
+    for(k = 0; k < pglobal->incnt; k++) {
+        metrics_printf(buffer, size, &len, "mjpg_input_db_wait_seconds_total{input=\"%d\"} %.10g\n",
+                       k, __sync_add_and_fetch(&pglobal->in[k].metrics.db_wait_ns, 0) * 1e-9);
+    }
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_output_frames_total Frames delivered by the output plugin, each client counts.\n"
+                   "# TYPE mjpg_output_frames_total counter\n");
+    for(k = 0; k < pglobal->outcnt; k++) {
+        om = &pglobal->out[k].metrics;
+        metrics_printf(buffer, size, &len, "mjpg_output_frames_total{output=\"%d\"} %llu\n",
+                       k, __sync_add_and_fetch(&om->frames, 0));
+    }
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_output_bytes_total Picture bytes delivered by the output plugin.\n"
+                   "# TYPE mjpg_output_bytes_total counter\n");
+    for(k = 0; k < pglobal->outcnt; k++) {
+        om = &pglobal->out[k].metrics;
+        metrics_printf(buffer, size, &len, "mjpg_output_bytes_total{output=\"%d\"} %llu\n",
+                       k, __sync_add_and_fetch(&om->bytes, 0));
+    }
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_output_dropped_frames_total Frames the output plugin dropped because it could not keep up.\n"
+                   "# TYPE mjpg_output_dropped_frames_total counter\n");
+    for(k = 0; k < pglobal->outcnt; k++) {
+        om = &pglobal->out[k].metrics;
+        metrics_printf(buffer, size, &len, "mjpg_output_dropped_frames_total{output=\"%d\"} %llu\n",
+                       k, __sync_add_and_fetch(&om->drops, 0));
+    }
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_output_hook_dropped_events_total Events the hook process of the output plugin did not get.\n"
+                   "# TYPE mjpg_output_hook_dropped_events_total counter\n");
+    for(k = 0; k < pglobal->outcnt; k++) {
+        om = &pglobal->out[k].metrics;
+        metrics_printf(buffer, size, &len, "mjpg_output_hook_dropped_events_total{output=\"%d\"} %llu\n",
+                       k, __sync_add_and_fetch(&om->hook_drops, 0));
+    }
+
+    /* clients of this server */
+    pthread_mutex_lock(&servers[id].streams_mutex);
+    for(st = servers[id].streams; st != NULL; st = st->next)
+        clients++;
+    pthread_mutex_unlock(&servers[id].streams_mutex);
+
+    metrics_printf(buffer, size, &len,
+                   "# HELP mjpg_http_stream_clients Connected stream and WebSocket clients.\n"
+                   "# TYPE mjpg_http_stream_clients gauge\n"
+                   "mjpg_http_stream_clients{output=\"%d\"} %d\n"
+                   "# HELP mjpg_http_send_calls_total Send system calls of the server.\n"
+                   "# TYPE mjpg_http_send_calls_total counter\n"
+                   "mjpg_http_send_calls_total{output=\"%d\"} %llu\n"
+                   "# HELP mjpg_http_send_bytes_total Bytes passed to the kernel by them, headers included.\n"
+                   "# TYPE mjpg_http_send_bytes_total counter\n"
+                   "mjpg_http_send_bytes_total{output=\"%d\"} %llu\n",
+                   id, clients,
+                   id, __sync_add_and_fetch(&servers[id].stats.send_calls, 0),
+                   id, __sync_add_and_fetch(&servers[id].stats.send_bytes, 0));
+
+    if(send_answer(context_fd, "200 OK", "Content-type: text/plain; version=0.0.4\r\n" STD_HEADER, buffer, len) < 0) {
+        DBG("unable to serve the metrics\n");
+    }
+
+    free(buffer);
+}
+
+/******************************************************************************
+Description.: Send the latency trace in the Chrome trace format, it can be
+              loaded into chrome://tracing or https://ui.perfetto.dev
+Input Value.: fildescriptor fd to send the answer to
+Return Value: -
+******************************************************************************/
+void send_trace(cfd *context_fd)
+{
+    size_t size = TRACE_EVENTS * 192 + BUFFER_SIZE, len;
+    char *buffer;
+
+    DBG("Serving the latency trace\n");
+
+    if(!trace_enabled()) {
+        send_error(context_fd, 404, "tracing is disabled, start mjpg_streamer with --trace <n>");
+        return;
+    }
+
+    if((buffer = malloc(size)) == NULL) {
+        send_error(context_fd, 500, "not enough memory");
+        return;
+    }
+
+    len = trace_json(buffer, size);
+    if(send_answer(context_fd, "200 OK", "Content-type: application/json\r\n" STD_HEADER, buffer, len) < 0) {
+        DBG("unable to serve the trace\n");
+    }
+
+    free(buffer);
+}
+
 /******************************************************************************
 Description.:   checks the source string for non printable characters and replaces them with space
                 the two arguments should be the same size allocated memory areas
@@ -1926,15 +2582,10 @@ Description.: Send a JSON file which is contains information about the output pl
 Input Value.: fildescriptor fd to send the answer to
 Return Value: -
 ******************************************************************************/
-void send_output_JSON(int fd, int input_number)
+void send_output_JSON(cfd *context_fd, int input_number)
 {
     char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
     int i;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
-
     DBG("Serving the output plugin %d descriptor JSON file\n", input_number);
 
     sprintf(buffer + strlen(buffer),
@@ -2024,22 +2675,16 @@ void send_output_JSON(int fd, int input_number)
             "}\n");
     i = strlen(buffer);
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
+    if(send_answer(context_fd, "200 OK", "Content-type: application/x-javascript\r\n" STD_HEADER, buffer, i) < 0) {
         DBG("unable to serve the control JSON file\n");
     }
 }
 
 #ifdef MANAGMENT
-void send_clients_JSON(int fd)
+void send_clients_JSON(cfd *context_fd)
 {
     char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
     unsigned long i = 0 ;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
-
     DBG("Serving the clients JSON file\n");
 
     sprintf(buffer + strlen(buffer),
@@ -2067,8 +2712,7 @@ void send_clients_JSON(int fd)
             "\n}\n");
     i = strlen(buffer);
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
+    if(send_answer(context_fd, "200 OK", "Content-type: application/x-javascript\r\n" STD_HEADER, buffer, i) < 0) {
         DBG("unable to serve the control JSON file\n");
     }
 }
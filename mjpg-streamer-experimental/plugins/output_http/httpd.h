@@ -43,17 +43,73 @@
  * Many browser seem to ignore, or at least not always obey those headers
  * since i observed caching of files from time to time.
  */
-#define STD_HEADER "Connection: close\r\n" \
-    "Server: MJPG-Streamer/0.2\r\n" \
+#define STD_HEADER "Server: MJPG-Streamer/0.2\r\n" \
     "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
     "Pragma: no-cache\r\n" \
     "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
 
+/*
+ * Snapshots carry an ETag, browsers may keep them but have to ask each time
+ * whether the picture changed. An unchanged one is answered with 304.
+ */
+#define SNAPSHOT_HEADER "Server: MJPG-Streamer/0.2\r\n" \
+    "Cache-Control: no-cache, max-age=0\r\n"
+
+/*
+ * Last header field of an answer, it tells whether the connection stays open
+ * for further requests. The empty line that ends the header is part of it.
+ */
+#define CONNECTION_CLOSE "Connection: close\r\n\r\n"
+#define CONNECTION_KEEPALIVE "Connection: keep-alive\r\n\r\n"
+
+/*
+ * Files of the www-folder carry validators, browsers keep them and ask
+ * whether they changed. A changed file is sent again, otherwise 304.
+ */
+#define STATIC_HEADER "Server: MJPG-Streamer/0.2\r\n" \
+    "Cache-Control: no-cache\r\n" \
+    "Vary: Accept-Encoding\r\n"
+
+/* files of the www-folder up to this size are kept in memory */
+#define FILE_CACHE_MAX (1024*1024)
+
+/* response header of a M-JPEG stream, the first boundary is part of it */
+#define STREAM_HEADER "HTTP/1.0 200 OK\r\n" \
+    "Access-Control-Allow-Origin: *\r\n" \
+    "Connection: close\r\n" \
+    STD_HEADER \
+    "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n" \
+    "\r\n" \
+    "--" BOUNDARY "\r\n"
+
+/*
+ * Every picture sent over a WebSocket starts with a header of this size,
+ * httpd_websocket.c describes the layout.
+ */
+#define WS_HEADER_VERSION 1
+#define WS_HEADER_SIZE 20
+
+/* pictures a WebSocket client may have unacknowledged, "?window=N" changes it */
+#define WS_WINDOW 2
+#define WS_WINDOW_MAX 16
+
+/*
+ * Unsent bytes a stream socket may hold, about one frame. Without a limit the
+ * kernel buffers megabytes for a slow client before frames get skipped.
+ */
+#define STREAM_NOTSENT_LOWAT (64*1024)
+
 /*
  * Maximum number of server sockets (i.e. protocol families) to listen.
  */
 #define MAX_SD_LEN 50
 
+/*
+ * Maximum number of threads accepting connections of one server, each has
+ * its own set of listening sockets bound with SO_REUSEPORT.
+ */
+#define MAX_ACCEPTORS 16
+
 /*
  * Only the following fileypes are supported.
  *
@@ -94,27 +150,76 @@ typedef enum {
     A_INPUT_JSON,
     A_OUTPUT_JSON,
     A_PROGRAM_JSON,
+    A_WEBSOCKET,
+    A_METRICS,
+    A_TRACE,
     #ifdef MANAGMENT
     A_CLIENTS_JSON
     #endif
 } answer_t;
 
+/* a request header that does not fit into this buffer gets rejected */
+#define REQUEST_HEADER_SIZE 4096
+
+/* query parameters beyond this number are ignored */
+#define MAX_QUERY_PARAMS 16
+
+/* a query parameter, name and value are unescaped */
+typedef struct {
+    char *name;
+    char *value;            /* empty string if the parameter has no "=" */
+} query_param;
+
 /*
  * the client sends information with each request
- * this structure is used to store the important parts
+ * this structure is used to store the important parts, all strings point
+ * into the buffer of the connection and stay valid until the next request
  */
 typedef struct {
     answer_t type;
-    char *parameter;
-    char *client;
-    char *credentials;
-    char *query_string;
+    int number;             /* plugin selected with a "_N" suffix */
+    char *method;
+    char *path;             /* target without the query */
+    char *query_string;     /* raw query, only set for CGI scripts */
+    char http11;            /* the client speaks HTTP/1.1 */
+    char *client;           /* User-Agent */
+    char *credentials;      /* decoded "username:password" of the Authorization */
+    char *etag;             /* If-None-Match */
+    char *modified_since;   /* If-Modified-Since */
+    char *accept_encoding;  /* Accept-Encoding */
+    char *range;            /* Range */
+    char *upgrade;          /* Upgrade */
+    char *connection;       /* Connection */
+    char *ws_key;           /* Sec-WebSocket-Key */
+    char *ws_version;       /* Sec-WebSocket-Version */
+    int content_length;
+    query_param params[MAX_QUERY_PARAMS];
+    int param_count;
 } request;
 
-/* the iobuffer structure is used to read from the HTTP-client */
+/* states of the request parser, it continues where it stopped with more data */
+typedef enum {
+    PARSE_METHOD,
+    PARSE_TARGET,
+    PARSE_VERSION,
+    PARSE_FIELD_START,
+    PARSE_FIELD_NAME,
+    PARSE_FIELD_SPACE,
+    PARSE_FIELD_VALUE,
+    PARSE_DONE
+} parse_state;
+
+/*
+ * the iobuffer structure is used to read from the HTTP-client, it lives as
+ * long as the connection so bytes of pipelined requests stay in there
+ */
 typedef struct {
+    parse_state state;
     int level;              /* how full is the buffer */
-    char buffer[IO_BUFFER]; /* the data */
+    int parsed;             /* bytes the parser is done with */
+    int token;              /* offset of the token the parser is in */
+    int name;               /* offset of the header field name the parser is in */
+    char buffer[REQUEST_HEADER_SIZE]; /* the data */
 } iobuffer;
 
 /* store configuration for each server instance */
@@ -124,8 +229,67 @@ typedef struct {
     char *credentials;
     char *www_folder;
     char nocommands;
+    int workers;            /* number of event loop threads for streams, 0 = one thread per client */
+    char zerocopy;          /* send stream frames with MSG_ZEROCOPY */
+    int kick;               /* drop stream clients that did not accept data for this many seconds, 0 = never */
+    char fresh;             /* snapshots wait for a new frame instead of sending the current one */
+    int keepalive;          /* seconds an idle persistent connection stays open, 0 = close after each answer */
+    int backlog;            /* length of the queue of pending connections of each listening socket */
+    int acceptors;          /* number of threads accepting connections, 0 = one per online CPU */
 } config;
 
+/* statistics of the picture delivery, updated atomically */
+typedef struct {
+    unsigned long long send_calls;  /* number of send syscalls */
+    unsigned long long send_bytes;  /* bytes passed to the kernel by them */
+} send_stats;
+
+/* per connection state of a stream client, listed in program.json */
+typedef struct _stream_stats stream_stats;
+struct _stream_stats {
+    char address[64];
+    int input;
+    unsigned long long last_seq;        /* sequence number of the last frame sent */
+    unsigned long long frames_sent;
+    unsigned long long frames_dropped;  /* frames skipped because the client was too slow */
+    stream_stats *next;
+};
+
+/*
+ * complete answer to a snapshot request, built once per frame and shared by
+ * all clients asking for that frame
+ */
+typedef struct _snapshot snapshot;
+struct _snapshot {
+    frame *f;                   /* the picture, referenced */
+    char etag[64];              /* quoted entity tag of the picture */
+    char header[BUFFER_SIZE];   /* response header without the connection field */
+    int header_len;
+    int refcount;               /* modified atomically */
+};
+
+/* a file of the www-folder, shared by all requests for it */
+typedef struct _static_file static_file;
+struct _static_file {
+    char name[256];
+    const char *mimetype;
+    char *data;                 /* content, NULL if the file is larger than FILE_CACHE_MAX */
+    char *gzip;                 /* content of "name.gz", NULL if there is none */
+    off_t size;
+    off_t gzip_size;
+    time_t mtime;
+    time_t gzip_mtime;
+    time_t checked;             /* monotonic second the file was last compared with the disk */
+    char etag[64];              /* entity tag without quotes */
+    char modified[64];          /* Last-Modified */
+    int refcount;               /* modified atomically */
+    static_file *next;
+};
+
+typedef struct _stream_loop stream_loop;
+typedef struct _stream_dispatcher stream_dispatcher;
+typedef struct _acceptor acceptor;
+
 /* context of each server thread */
 typedef struct {
     int sd[MAX_SD_LEN];
@@ -135,8 +299,38 @@ typedef struct {
     pthread_t threadID;
 
     config conf;
+    send_stats stats;
+
+    /* connected stream clients */
+    pthread_mutex_t streams_mutex;
+    stream_stats *streams;
+
+    /* event loops serving the stream clients, NULL if not enabled */
+    stream_loop *loops;
+    unsigned int next_loop;
+    stream_dispatcher *dispatchers;
+
+    /* answer to the last snapshot request of each input */
+    pthread_mutex_t snapshots_mutex;
+    snapshot *snapshots[MAX_INPUT_PLUGINS];
+
+    /* files of the www-folder that were requested */
+    pthread_mutex_t files_mutex;
+    static_file *files;
+
+    /* threads accepting connections, the first one is the server thread */
+    acceptor *acceptors;
+    int acceptor_count;
 } context;
 
+/* a thread accepting connections on its own listening sockets */
+struct _acceptor {
+    context *pc;
+    int first;              /* index of its first socket in context.sd */
+    int count;              /* number of its sockets */
+    pthread_t threadID;
+};
+
 
 #if defined(MANAGMENT)
 /*
@@ -163,6 +357,7 @@ struct {
 typedef struct {
     context *pc;
     int fd;
+    char keepalive;         /* the connection stays open after the current answer */
     #ifdef MANAGMENT
     client_info *client;
     #endif
@@ -172,17 +367,37 @@ typedef struct {
 
 /* prototypes */
 void *server_thread(void *arg);
-void send_error(int fd, int which, char *message);
-void send_output_JSON(int fd, int plugin_number);
-void send_input_JSON(int fd, int plugin_number);
-void send_program_JSON(int fd);
+int stream_loops_start(context *pc);
+void stream_stats_register(context *pc, stream_stats *st, int fd, int input_number);
+void stream_stats_unregister(context *pc, stream_stats *st);
+void stream_stats_frame(stream_stats *st, frame *f);
+void stream_kick_timeout(context *pc, int fd);
+void stream_limit_buffer(int fd);
+int stream_unacked(int fd);
+int send_iov(context *pc, int fd, struct iovec *iov, int iovcnt, int flags);
+int stream_loop_add(cfd *context_fd, int input_number);
+void send_websocket(cfd *context_fd, request *req, iobuffer *iobuf, int input_number);
+void init_iobuffer(iobuffer *iobuf);
+int request_parse(iobuffer *iobuf, request *req);
+int request_parse_query(request *req);
+char *request_param(request *req, const char *name);
+int request_route(request *req);
+void decodeBase64(char *data);
+int unescape(char *string);
+int send_answer(cfd *context_fd, const char *status, const char *fields, const void *body, int length);
+void send_error(cfd *context_fd, int which, char *message);
+void send_output_JSON(cfd *context_fd, int plugin_number);
+void send_input_JSON(cfd *context_fd, int plugin_number);
+void send_program_JSON(cfd *context_fd);
+void send_metrics(cfd *context_fd);
+void send_trace(cfd *context_fd);
 void check_JSON_string(char *source, char *destination);
 
 #ifdef MANAGMENT
 client_info *add_client(char *address);
 int check_client_status(client_info *client);
 void update_client_timestamp(client_info *client);
-void send_clients_JSON(int fd);
+void send_clients_JSON(cfd *context_fd);
 #endif
 
 
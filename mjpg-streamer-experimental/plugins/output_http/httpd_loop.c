@@ -0,0 +1,588 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Event loops for M-JPEG stream clients.
+
+  Instead of keeping one thread blocked in write() per viewer, the client
+  thread hands the socket of a "?action=stream" request over to one of a
+  fixed number of event loop threads and exits. Every loop multiplexes its
+  sockets with epoll, the sockets are non-blocking. A dispatcher thread per
+  input plugin waits for fresh frames and wakes up all loops through an
+  eventfd. A client that is still busy with a previous frame just picks up
+  the newest one once it is done, frames in between are skipped.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+
+#include "httpd.h"
+
+#define MAX_EVENTS 64
+
+/* state of a single stream client */
+typedef struct _stream_client stream_client;
+struct _stream_client {
+    int fd;
+    int input;
+
+    frame *f;                   /* frame that is sent right now, NULL if idle */
+    long long send_start;       /* frame_clock() when sending it started */
+    unsigned long long seq;     /* sequence number of the last frame sent */
+    time_t last_progress;       /* monotonic seconds of the last successful write */
+    int unacked;                /* bytes the client had not acknowledged at the last check */
+    stream_stats st;
+
+    char header[BUFFER_SIZE];   /* HTTP header or part header of the current frame */
+    struct iovec iov[3];        /* part header, picture and boundary */
+    int iovcnt;
+    int want_out;               /* registered for EPOLLOUT */
+    int dead;                   /* removed, freed at the end of the epoll batch */
+
+    #ifdef MANAGMENT
+    client_info *client;
+    #endif
+
+    stream_client *next;
+};
+
+/* one event loop thread */
+struct _stream_loop {
+    context *pc;
+    int epfd;
+    int evfd;
+    pthread_t threadID;
+
+    stream_client *clients;     /* owned by the loop thread only */
+    stream_client *dead;        /* removed clients, events may still refer to them */
+
+    pthread_mutex_t mutex;      /* protects "pending" */
+    stream_client *pending;     /* handed over by client threads */
+};
+
+/* dispatcher of fresh frames, one per server and input plugin */
+struct _stream_dispatcher {
+    context *pc;
+    int input;
+    pthread_t threadID;
+
+    pthread_mutex_t mutex;      /* protects "latest" */
+    frame *latest;              /* referenced, shared by all clients of this input */
+};
+
+static const char boundary[] = "\r\n--" BOUNDARY "\r\n";
+
+/******************************************************************************
+Description.: wake up an event loop
+Input Value.: loop to signal
+Return Value: -
+******************************************************************************/
+static void loop_wakeup(stream_loop *loop)
+{
+    uint64_t one = 1;
+
+    if(write(loop->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write(eventfd)");
+    }
+}
+
+/******************************************************************************
+Description.: monotonic clock in seconds, not affected by setting the time
+Input Value.: -
+Return Value: seconds
+******************************************************************************/
+static time_t monotonic_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/******************************************************************************
+Description.: close the connection and release everything the client holds
+Input Value.: loop and client to free
+Return Value: -
+******************************************************************************/
+static void client_free(stream_loop *loop, stream_client *sc)
+{
+    DBG("closing stream client fd %d\n", sc->fd);
+    stream_stats_unregister(loop->pc, &sc->st);
+    close(sc->fd);
+    frame_unref(sc->f);
+    free(sc);
+}
+
+/******************************************************************************
+Description.: update the epoll registration if the client has to wait for
+              the socket to become writable again
+Input Value.: loop and client
+Return Value: -
+******************************************************************************/
+static void client_want_out(stream_loop *loop, stream_client *sc, int want)
+{
+    struct epoll_event ev;
+
+    if(sc->want_out == want)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0);
+    ev.data.ptr = sc;
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, sc->fd, &ev) < 0) {
+        perror("epoll_ctl(EPOLL_CTL_MOD)");
+    }
+    sc->want_out = want;
+}
+
+/******************************************************************************
+Description.: prepare the next frame for a client that is idle, if there is a
+              frame newer than the last one sent
+Input Value.: client
+Return Value: 1 if there is something to send, 0 otherwise
+******************************************************************************/
+static int client_next_frame(context *pc, stream_client *sc)
+{
+    stream_dispatcher *sd = &pc->dispatchers[sc->input];
+    frame *f;
+
+    if(sc->iovcnt > 0)
+        return 1;
+
+    pthread_mutex_lock(&sd->mutex);
+    f = frame_ref(sd->latest);
+    pthread_mutex_unlock(&sd->mutex);
+
+    if(f == NULL)
+        return 0;
+
+    if(f->seq <= sc->seq) {
+        frame_unref(f);
+        return 0;
+    }
+
+    #ifdef MANAGMENT
+    update_client_timestamp(sc->client);
+    #endif
+
+    /* latest frame wins, everything in between the last one and this was dropped */
+    stream_stats_frame(&sc->st, f);
+    sc->last_progress = monotonic_seconds();
+
+    /*
+     * print the individual mimetype and the length
+     * sending the content-length fixes random stream disruption observed
+     * with firefox
+     */
+    sc->f = f;
+    sc->seq = f->seq;
+    sc->send_start = frame_clock();
+    sc->iov[0].iov_base = sc->header;
+    sc->iov[0].iov_len = snprintf(sc->header, sizeof(sc->header), "Content-Type: image/jpeg\r\n" \
+                                  "Content-Length: %d\r\n" \
+                                  "X-Timestamp: %d.%06d\r\n" \
+                                  "\r\n", f->size, (int)f->timestamp.tv_sec, (int)f->timestamp.tv_usec);
+    sc->iov[1].iov_base = f->buf;
+    sc->iov[1].iov_len = f->size;
+    sc->iov[2].iov_base = (void *)boundary;
+    sc->iov[2].iov_len = sizeof(boundary) - 1;
+    sc->iovcnt = 3;
+
+    return 1;
+}
+
+/******************************************************************************
+Description.: send as much as the socket accepts without blocking
+Input Value.: loop and client
+Return Value: 0 if the client is still fine, -1 if it should get dropped
+******************************************************************************/
+static int client_send(stream_loop *loop, stream_client *sc)
+{
+    struct iovec *iov;
+    ssize_t rc;
+
+    while(client_next_frame(loop->pc, sc)) {
+        iov = sc->iov + (3 - sc->iovcnt);
+
+        rc = writev(sc->fd, iov, sc->iovcnt);
+        if(rc < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                client_want_out(loop, sc, 1);
+                return 0;
+            }
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        __sync_add_and_fetch(&loop->pc->stats.send_calls, 1);
+        __sync_add_and_fetch(&loop->pc->stats.send_bytes, rc);
+        if(rc > 0)
+            sc->last_progress = monotonic_seconds();
+
+        /* skip the parts that were sent completely */
+        while(sc->iovcnt > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            sc->iovcnt--;
+        }
+
+        if(sc->iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+            continue;
+        }
+
+        /* frame is out, release it, the HTTP header goes out without one */
+        if(sc->f != NULL) {
+            metrics_sent(&loop->pc->pglobal->out[loop->pc->id], sc->f->size);
+            trace_send(loop->pc->id, sc->f, sc->send_start);
+        }
+        frame_unref(sc->f);
+        sc->f = NULL;
+    }
+
+    client_want_out(loop, sc, 0);
+    return 0;
+}
+
+/******************************************************************************
+Description.: remove a client from the list of the loop, it gets freed once
+              the current batch of events is processed
+Input Value.: loop and client
+Return Value: -
+******************************************************************************/
+static void loop_remove(stream_loop *loop, stream_client *sc)
+{
+    stream_client **p;
+
+    for(p = &loop->clients; *p != NULL; p = &(*p)->next) {
+        if(*p == sc) {
+            *p = sc->next;
+            break;
+        }
+    }
+
+    sc->dead = 1;
+    sc->next = loop->dead;
+    loop->dead = sc;
+}
+
+/******************************************************************************
+Description.: adopt the clients that were handed over by the client threads
+Input Value.: loop
+Return Value: -
+******************************************************************************/
+static void loop_adopt(stream_loop *loop)
+{
+    stream_client *sc, *next;
+    struct epoll_event ev;
+
+    pthread_mutex_lock(&loop->mutex);
+    sc = loop->pending;
+    loop->pending = NULL;
+    pthread_mutex_unlock(&loop->mutex);
+
+    for(; sc != NULL; sc = next) {
+        next = sc->next;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+        ev.data.ptr = sc;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sc->fd, &ev) < 0) {
+            perror("epoll_ctl(EPOLL_CTL_ADD)");
+            client_free(loop, sc);
+            continue;
+        }
+        sc->want_out = 1;
+
+        sc->next = loop->clients;
+        loop->clients = sc;
+    }
+}
+
+/******************************************************************************
+Description.: the event loop thread
+Input Value.: arg is the stream_loop to run
+Return Value: always NULL
+******************************************************************************/
+static void *loop_thread(void *arg)
+{
+    stream_loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    stream_client *sc, *next;
+    char discard[IO_BUFFER];
+    uint64_t value;
+    int i, n, unacked, kick = loop->pc->conf.kick;
+    time_t now;
+
+    while(!loop->pc->pglobal->stop) {
+        /* wake up regularly to look for stalled clients */
+        n = epoll_wait(loop->epfd, events, MAX_EVENTS, (kick > 0) ? 1000 : -1);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for(i = 0; i < n; i++) {
+            /* eventfd: new clients or a fresh frame */
+            if(events[i].data.ptr == NULL) {
+                if(read(loop->evfd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                    perror("read(eventfd)");
+                }
+
+                loop_adopt(loop);
+
+                for(sc = loop->clients; sc != NULL; sc = next) {
+                    next = sc->next;
+                    if(sc->iovcnt == 0 && client_send(loop, sc) < 0)
+                        loop_remove(loop, sc);
+                }
+                continue;
+            }
+
+            sc = events[i].data.ptr;
+            if(sc->dead)
+                continue;
+
+            if(events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                loop_remove(loop, sc);
+                continue;
+            }
+
+            /* the client is not expected to send anything, drain it */
+            if(events[i].events & EPOLLIN) {
+                if(read(sc->fd, discard, sizeof(discard)) == 0) {
+                    loop_remove(loop, sc);
+                    continue;
+                }
+            }
+
+            if((events[i].events & EPOLLOUT) && client_send(loop, sc) < 0) {
+                loop_remove(loop, sc);
+            }
+        }
+
+        /* a client that did not accept any data for too long holds a frame and socket buffers hostage */
+        if(kick > 0) {
+            now = monotonic_seconds();
+            for(sc = loop->clients; sc != NULL; sc = next) {
+                next = sc->next;
+                if(sc->iovcnt == 0)
+                    continue;
+
+                /* acknowledged data counts as progress, the socket may take a while to accept more */
+                unacked = stream_unacked(sc->fd);
+                if(unacked >= 0 && unacked < sc->unacked)
+                    sc->last_progress = now;
+                sc->unacked = unacked;
+
+                if(now - sc->last_progress >= kick) {
+                    DBG("client %s did not accept data for %d seconds, kicking it\n", sc->st.address, kick);
+                    loop_remove(loop, sc);
+                }
+            }
+        }
+
+        for(sc = loop->dead; sc != NULL; sc = next) {
+            next = sc->next;
+            client_free(loop, sc);
+        }
+        loop->dead = NULL;
+    }
+
+    DBG("leaving stream loop thread\n");
+    return NULL;
+}
+
+/******************************************************************************
+Description.: waits for fresh frames of one input and wakes up the loops
+Input Value.: arg is the stream_dispatcher
+Return Value: always NULL
+******************************************************************************/
+static void *dispatcher_thread(void *arg)
+{
+    stream_dispatcher *sd = arg;
+    context *pc = sd->pc;
+    unsigned long long seq = FRAME_SEQ_FRESH;
+    frame *f, *old;
+    int i;
+
+    while(!pc->pglobal->stop) {
+        if((f = frame_ring_next(&pc->pglobal->in[sd->input], seq)) == NULL) {
+            usleep(10 * 1000);
+            continue;
+        }
+        seq = f->seq;
+
+        /* the loops only ever see frames provided here, this works for input plugins without a ring too */
+        pthread_mutex_lock(&sd->mutex);
+        old = sd->latest;
+        sd->latest = f;
+        pthread_mutex_unlock(&sd->mutex);
+        frame_unref(old);
+
+        for(i = 0; i < pc->conf.workers; i++)
+            loop_wakeup(&pc->loops[i]);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: create the event loop threads of a server and a dispatcher
+              thread for each input plugin
+Input Value.: server context, conf.workers must be set
+Return Value: 0 if everything is OK, -1 otherwise
+******************************************************************************/
+int stream_loops_start(context *pc)
+{
+    stream_dispatcher *sd;
+    struct epoll_event ev;
+    int i;
+
+    if((pc->loops = calloc(pc->conf.workers, sizeof(stream_loop))) == NULL) {
+        OPRINT("could not allocate memory for stream loops\n");
+        return -1;
+    }
+    pc->next_loop = 0;
+
+    for(i = 0; i < pc->conf.workers; i++) {
+        stream_loop *loop = &pc->loops[i];
+
+        loop->pc = pc;
+        pthread_mutex_init(&loop->mutex, NULL);
+
+        if((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            perror("epoll_create1");
+            return -1;
+        }
+
+        if((loop->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            perror("eventfd");
+            return -1;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) < 0) {
+            perror("epoll_ctl(EPOLL_CTL_ADD)");
+            return -1;
+        }
+
+        if(pthread_create(&loop->threadID, NULL, loop_thread, loop) != 0) {
+            OPRINT("could not start stream loop thread\n");
+            return -1;
+        }
+        pthread_detach(loop->threadID);
+    }
+
+    if((pc->dispatchers = calloc(pc->pglobal->incnt, sizeof(stream_dispatcher))) == NULL) {
+        OPRINT("could not allocate memory for stream dispatchers\n");
+        return -1;
+    }
+
+    for(i = 0; i < pc->pglobal->incnt; i++) {
+        sd = &pc->dispatchers[i];
+        sd->pc = pc;
+        sd->input = i;
+        pthread_mutex_init(&sd->mutex, NULL);
+
+        if(pthread_create(&sd->threadID, NULL, dispatcher_thread, sd) != 0) {
+            OPRINT("could not start stream dispatcher thread\n");
+            return -1;
+        }
+        pthread_detach(sd->threadID);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: hand a stream client over to one of the event loops. On success
+              the loop owns the socket and the calling thread may exit.
+Input Value.: connected client and the input plugin to stream from
+Return Value: 0 if the client was taken over, -1 otherwise
+******************************************************************************/
+int stream_loop_add(cfd *context_fd, int input_number)
+{
+    context *pc = context_fd->pc;
+    stream_client *sc;
+    stream_loop *loop;
+    int flags;
+
+    if(pc->loops == NULL)
+        return -1;
+
+    if((sc = calloc(1, sizeof(stream_client))) == NULL)
+        return -1;
+
+    flags = fcntl(context_fd->fd, F_GETFL, 0);
+    if(flags < 0 || fcntl(context_fd->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl(O_NONBLOCK)");
+        free(sc);
+        return -1;
+    }
+
+    sc->fd = context_fd->fd;
+    stream_limit_buffer(sc->fd);
+    sc->input = input_number;
+    sc->seq = 0;
+    sc->last_progress = monotonic_seconds();
+    stream_stats_register(pc, &sc->st, sc->fd, input_number);
+    #ifdef MANAGMENT
+    sc->client = context_fd->client;
+    #endif
+
+    /* the HTTP header is the first thing to send, no frame attached yet */
+    sc->iov[2].iov_base = sc->header;
+    sc->iov[2].iov_len = snprintf(sc->header, sizeof(sc->header), STREAM_HEADER);
+    sc->iovcnt = 1;
+
+    /* round robin, a lost increment does no harm */
+    loop = &pc->loops[pc->next_loop++ % (unsigned int)pc->conf.workers];
+
+    pthread_mutex_lock(&loop->mutex);
+    sc->next = loop->pending;
+    loop->pending = sc;
+    pthread_mutex_unlock(&loop->mutex);
+
+    loop_wakeup(loop);
+    return 0;
+}
@@ -0,0 +1,408 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Parser and routing of HTTP requests.
+
+  The header of a request gets parsed in a single pass while it arrives, the
+  parser stops at the end of the data read so far and continues from there
+  with the next read. Nothing gets allocated: delimiters are replaced by
+  null-characters and the request structure points into the buffer of the
+  connection. The answer type is looked up in a table afterwards.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+
+#include "httpd.h"
+
+/* a request gets answered according to the first entry that matches */
+typedef struct {
+    const char *method;
+    const char *path;       /* path, or its beginning if "ending" is set */
+    const char *ending;     /* required end of the path, NULL for an exact match,
+                               only a plugin number "_N" may come in between */
+    const char *action;     /* required beginning of the "action" parameter, NULL if none */
+    answer_t type;
+    char numbered;          /* a plugin number may follow as "_N" */
+} route;
+
+static const route routes[] = {
+    { "GET",  "/",             NULL,    "snapshot", A_SNAPSHOT,     1 },
+    { "GET",  "/",             NULL,    "stream",   A_STREAM,       1 },
+    { "GET",  "/",             NULL,    "take",     A_TAKE,         1 },
+    { "GET",  "/",             NULL,    "command",  A_COMMAND,      0 },
+    { "POST", "/stream",       "",      NULL,       A_STREAM,       1 },
+    { "GET",  "/input",        ".json", NULL,       A_INPUT_JSON,   1 },
+    { "GET",  "/output",       ".json", NULL,       A_OUTPUT_JSON,  1 },
+    { "GET",  "/program.json", NULL,    NULL,       A_PROGRAM_JSON, 0 },
+    { "GET",  "/ws",           "",      NULL,       A_WEBSOCKET,    1 },
+    { "GET",  "/metrics",      NULL,    NULL,       A_METRICS,      0 },
+    { "GET",  "/trace.json",   NULL,    NULL,       A_TRACE,        0 },
+    #ifdef MANAGMENT
+    { "GET",  "/clients.json", NULL,    NULL,       A_CLIENTS_JSON, 0 },
+    #endif
+    #ifdef WXP_COMPAT
+    { "GET",  "/cam",          ".jpg",  NULL,       A_SNAPSHOT_WXP, 1 },
+    { "GET",  "/cam",          ".mjpg", NULL,       A_STREAM_WXP,   1 },
+    #endif
+};
+
+/* files and CGI scripts must have names of these characters, no subfolders */
+#define FILE_CHARACTERS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890"
+
+/* the query of a CGI script ends at the first other character, it is passed to a shell */
+#define CGI_QUERY_CHARACTERS FILE_CHARACTERS "=&"
+
+/******************************************************************************
+Description.: initializes the iobuffer structure properly
+Input Value.: pointer to already allocated iobuffer
+Return Value: -
+******************************************************************************/
+void init_iobuffer(iobuffer *iobuf)
+{
+    iobuf->state = PARSE_METHOD;
+    iobuf->level = 0;
+    iobuf->parsed = 0;
+    iobuf->token = 0;
+    iobuf->name = 0;
+}
+
+/******************************************************************************
+Description.: store a header field the server is interested in
+Input Value.: * req....: request to fill
+              * name...: name of the field
+              * value..: its value, without surrounding whitespace
+Return Value: -
+******************************************************************************/
+static void request_field(request *req, char *name, char *value)
+{
+    if(strcasecmp(name, "User-Agent") == 0) {
+        req->client = value;
+    } else if(strcasecmp(name, "Authorization") == 0) {
+        if(strncasecmp(value, "Basic ", strlen("Basic ")) == 0) {
+            req->credentials = value + strlen("Basic ");
+            decodeBase64(req->credentials);
+            DBG("username:password: %s\n", req->credentials);
+        }
+    } else if(strcasecmp(name, "If-None-Match") == 0) {
+        req->etag = value;
+    } else if(strcasecmp(name, "If-Modified-Since") == 0) {
+        req->modified_since = value;
+    } else if(strcasecmp(name, "Accept-Encoding") == 0) {
+        req->accept_encoding = value;
+    } else if(strcasecmp(name, "Range") == 0) {
+        req->range = value;
+    } else if(strcasecmp(name, "Upgrade") == 0) {
+        req->upgrade = value;
+    } else if(strcasecmp(name, "Connection") == 0) {
+        req->connection = value;
+    } else if(strcasecmp(name, "Sec-WebSocket-Key") == 0) {
+        req->ws_key = value;
+    } else if(strcasecmp(name, "Sec-WebSocket-Version") == 0) {
+        req->ws_version = value;
+    } else if(strcasecmp(name, "Content-Length") == 0) {
+        req->content_length = atoi(value);
+    }
+}
+
+/******************************************************************************
+Description.: Parse the header of a request as far as it was read. The request
+              structure must be cleared before the first call for a request.
+              Once the header is complete the parser stops, following bytes
+              belong to the next request and stay in the buffer.
+Input Value.: * iobuf..: buffer of the connection, "level" bytes are valid
+              * req....: request to fill
+Return Value: 1 if the header is complete, 0 if more data is needed,
+              -1 if the request is malformed
+******************************************************************************/
+int request_parse(iobuffer *iobuf, request *req)
+{
+    char *buffer = iobuf->buffer, *p, *end;
+
+    while(iobuf->state != PARSE_DONE && iobuf->parsed < iobuf->level) {
+        p = buffer + iobuf->parsed++;
+
+        switch(iobuf->state) {
+        case PARSE_METHOD:
+            if(*p == ' ') {
+                *p = '\0';
+                req->method = buffer + iobuf->token;
+                iobuf->token = iobuf->parsed;
+                iobuf->state = PARSE_TARGET;
+            } else if(*p == '\r' || *p == '\n') {
+                /* empty lines in front of a request are allowed */
+                if(iobuf->parsed - 1 != iobuf->token)
+                    return -1;
+                iobuf->token = iobuf->parsed;
+            } else if(!isupper((unsigned char)*p)) {
+                return -1;
+            }
+            break;
+
+        case PARSE_TARGET:
+            if(*p == ' ') {
+                *p = '\0';
+                req->path = buffer + iobuf->token;
+                iobuf->token = iobuf->parsed;
+                iobuf->state = PARSE_VERSION;
+            } else if(*p == '\r' || *p == '\n') {
+                return -1;
+            }
+            break;
+
+        case PARSE_VERSION:
+            if(*p == '\r') {
+                *p = '\0';
+            } else if(*p == '\n') {
+                *p = '\0';
+                if(strncmp(buffer + iobuf->token, "HTTP/1.", strlen("HTTP/1.")) != 0)
+                    return -1;
+                req->http11 = (strcmp(buffer + iobuf->token, "HTTP/1.0") != 0);
+                iobuf->state = PARSE_FIELD_START;
+            }
+            break;
+
+        case PARSE_FIELD_START:
+            if(*p == '\r') {
+                *p = '\0';
+            } else if(*p == '\n') {
+                iobuf->state = PARSE_DONE;
+            } else {
+                iobuf->name = iobuf->parsed - 1;
+                iobuf->state = PARSE_FIELD_NAME;
+            }
+            break;
+
+        case PARSE_FIELD_NAME:
+            if(*p == ':') {
+                *p = '\0';
+                iobuf->state = PARSE_FIELD_SPACE;
+            } else if(*p == '\r' || *p == '\n') {
+                return -1;
+            }
+            break;
+
+        case PARSE_FIELD_SPACE:
+            if(*p == ' ' || *p == '\t')
+                break;
+            iobuf->token = iobuf->parsed - 1;
+            iobuf->state = PARSE_FIELD_VALUE;
+            /* this character is part of the value already */
+
+        case PARSE_FIELD_VALUE:
+            if(*p == '\r') {
+                *p = '\0';
+            } else if(*p == '\n') {
+                *p = '\0';
+
+                /* drop trailing whitespace */
+                for(end = p; end > buffer + iobuf->token && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\0'); end--)
+                    end[-1] = '\0';
+
+                request_field(req, buffer + iobuf->name, buffer + iobuf->token);
+                iobuf->state = PARSE_FIELD_START;
+            }
+            break;
+
+        case PARSE_DONE:
+            break;
+        }
+    }
+
+    return (iobuf->state == PARSE_DONE) ? 1 : 0;
+}
+
+/******************************************************************************
+Description.: split the query of the request into parameters, each one gets
+              unescaped in place
+Input Value.: req....: request with "path" still including the query
+Return Value: 0 if everything is ok, -1 if a parameter could not be unescaped
+******************************************************************************/
+int request_parse_query(request *req)
+{
+    char *query, *next, *value;
+
+    if((query = strchr(req->path, '?')) == NULL)
+        return 0;
+    *query++ = '\0';
+
+    for(; query != NULL && req->param_count < MAX_QUERY_PARAMS; query = next) {
+        if((next = strchr(query, '&')) != NULL)
+            *next++ = '\0';
+        if(*query == '\0')
+            continue;
+
+        if((value = strchr(query, '=')) != NULL)
+            *value++ = '\0';
+        else
+            value = query + strlen(query);
+
+        if(unescape(query) == -1 || unescape(value) == -1)
+            return -1;
+
+        req->params[req->param_count].name = query;
+        req->params[req->param_count].value = value;
+        req->param_count++;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: look up a query parameter
+Input Value.: * req....: parsed request
+              * name...: name of the parameter
+Return Value: the unescaped value or NULL if the parameter is missing
+******************************************************************************/
+char *request_param(request *req, const char *name)
+{
+    int i;
+
+    for(i = 0; i < req->param_count; i++) {
+        if(strcmp(req->params[i].name, name) == 0)
+            return req->params[i].value;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: read the plugin number of a "_N" suffix
+Input Value.: string that may contain the suffix
+Return Value: the number or 0 if there is none
+******************************************************************************/
+static int suffix_number(const char *string)
+{
+    const char *sch = strchr(string, '_');
+
+    if(sch == NULL || !isdigit((unsigned char)sch[1]))
+        return 0;
+
+    return atoi(sch + 1);
+}
+
+/******************************************************************************
+Description.: check what comes between the beginning and the ending of the
+              path of a route, it is either empty or a plugin number
+Input Value.: * rest.....: the characters after the beginning
+              * length...: their number
+              * numbered.: a plugin number is allowed
+Return Value: 1 if the path matches, 0 otherwise
+******************************************************************************/
+static int route_infix(const char *rest, int length, int numbered)
+{
+    int i;
+
+    if(length == 0)
+        return 1;
+
+    if(!numbered || length < 2 || rest[0] != '_')
+        return 0;
+
+    for(i = 1; i < length; i++) {
+        if(!isdigit((unsigned char)rest[i]))
+            return 0;
+    }
+
+    return 1;
+}
+
+/******************************************************************************
+Description.: determine the answer to a request, the query gets parsed too
+Input Value.: req....: request with a complete header
+Return Value: 0 if everything is ok, -1 if the request is malformed
+******************************************************************************/
+int request_route(request *req)
+{
+    const route *r;
+    char *action, *name, *query;
+    int i, len;
+
+    /* CGI scripts get the query as it is */
+    query = strchr(req->path, '?');
+    len = (query != NULL) ? query - req->path : strlen(req->path);
+    if(len > 4 && strncmp(req->path + len - 4, ".cgi", 4) == 0 && strcmp(req->method, "GET") == 0) {
+        if(query != NULL) {
+            *query++ = '\0';
+            query[strspn(query, CGI_QUERY_CHARACTERS)] = '\0';
+            req->query_string = query;
+        } else {
+            req->query_string = " ";
+        }
+    } else if(request_parse_query(req) == -1) {
+        return -1;
+    }
+
+    action = request_param(req, "action");
+
+    for(i = 0; i < LENGTH_OF(routes); i++) {
+        r = &routes[i];
+        if(strcmp(req->method, r->method) != 0)
+            continue;
+
+        if(r->ending == NULL) {
+            if(strcmp(req->path, r->path) != 0)
+                continue;
+        } else {
+            len = (int)strlen(req->path) - (int)strlen(r->path) - (int)strlen(r->ending);
+            if(strncmp(req->path, r->path, strlen(r->path)) != 0 || len < 0 ||
+               strcmp(req->path + strlen(r->path) + len, r->ending) != 0 ||
+               !route_infix(req->path + strlen(r->path), len, r->numbered))
+                continue;
+        }
+
+        if(r->action != NULL && (action == NULL || strncmp(action, r->action, strlen(r->action)) != 0))
+            continue;
+
+        req->type = r->type;
+        if(r->numbered)
+            req->number = suffix_number((r->action != NULL) ? action : req->path);
+
+        /* webcamxp adds an offset to the camera number */
+        if(req->type == A_SNAPSHOT_WXP || req->type == A_STREAM_WXP)
+            req->number--;
+
+        DBG("plugin_no: %d\n", req->number);
+        return 0;
+    }
+
+    if(strcmp(req->method, "GET") != 0)
+        return 0;
+
+    /* everything else is a file of the www-folder, or a script in there */
+    name = req->path + 1;
+    if(strspn(name, FILE_CHARACTERS) != strlen(name))
+        return 0;
+
+    req->type = (req->query_string != NULL) ? A_CGI : A_FILE;
+    DBG("file: \"%s\"\n", name);
+    return 0;
+}
@@ -0,0 +1,466 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  WebSocket stream of JPG frames (RFC 6455).
+
+  A "GET /ws" request with an Upgrade header gets switched to the WebSocket
+  protocol. Every frame of the input plugin is sent as one binary message,
+  the JPG data follows a small header:
+
+      offset  size  content (big endian)
+      0       1     version of the header, WS_HEADER_VERSION
+      1       1     number of the input plugin
+      2       2     length of the header, the JPG data starts there
+      4       8     sequence number of the frame
+      12      8     capture time in microseconds since the epoch
+
+  The client controls the pace: it sends any message once it is done with a
+  picture. At most "window" pictures are unacknowledged at any time, the
+  server skips frames instead of queueing them while it waits.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+
+#include "httpd.h"
+
+/* the client key is concatenated with this GUID to form the accept key */
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT         0x1
+#define WS_OP_BINARY       0x2
+#define WS_OP_CLOSE        0x8
+#define WS_OP_PING         0x9
+#define WS_OP_PONG         0xA
+
+#define WS_CLOSE_GOING_AWAY     1001
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_TOO_BIG        1009
+
+/* largest message accepted from a client, they only send acknowledgements */
+#define WS_MESSAGE_MAX 125
+
+/* the handshake hashes the key of the client and the GUID */
+#define SHA1_MESSAGE_MAX 128
+
+/* state of a WebSocket connection */
+typedef struct {
+    cfd *context_fd;
+    unsigned char in[2 * (WS_MESSAGE_MAX + 14)];  /* received bytes, two complete frames fit */
+    int level;
+    int acked;              /* pictures the client confirmed since the last call */
+} websocket;
+
+/******************************************************************************
+Description.: store a value in network byte order
+Input Value.: * p......: destination
+              * value..: value to store
+              * bytes..: number of bytes to use
+Return Value: -
+******************************************************************************/
+static void put_be(unsigned char *p, uint64_t value, int bytes)
+{
+    while(bytes-- > 0) {
+        p[bytes] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+/******************************************************************************
+Description.: SHA-1 of a short message, only used for the handshake
+Input Value.: * data...: message
+              * len....: its length, at most SHA1_MESSAGE_MAX bytes
+              * digest.: receives the 20 bytes of the hash
+Return Value: -
+******************************************************************************/
+static void sha1(const unsigned char *data, size_t len, unsigned char *digest)
+{
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint32_t w[80], a, b, c, d, e, t;
+    unsigned char msg[SHA1_MESSAGE_MAX + 72], *block;
+    size_t i, total;
+    int j;
+
+    /* append a one bit, zeros and the length in bits up to a multiple of 64 bytes */
+    total = ((len + 8) / 64 + 1) * 64;
+    memset(msg, 0, total);
+    memcpy(msg, data, len);
+    msg[len] = 0x80;
+    put_be(msg + total - 8, (uint64_t)len * 8, 8);
+
+    for(block = msg; block < msg + total; block += 64) {
+        for(j = 0; j < 16; j++)
+            w[j] = (uint32_t)block[j * 4] << 24 | (uint32_t)block[j * 4 + 1] << 16 |
+                   (uint32_t)block[j * 4 + 2] << 8 | block[j * 4 + 3];
+        for(j = 16; j < 80; j++) {
+            t = w[j - 3] ^ w[j - 8] ^ w[j - 14] ^ w[j - 16];
+            w[j] = (t << 1) | (t >> 31);
+        }
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+        for(j = 0; j < 80; j++) {
+            if(j < 20)
+                t = ((b & c) | (~b & d)) + 0x5A827999;
+            else if(j < 40)
+                t = (b ^ c ^ d) + 0x6ED9EBA1;
+            else if(j < 60)
+                t = ((b & c) | (b & d) | (c & d)) + 0x8F1BBCDC;
+            else
+                t = (b ^ c ^ d) + 0xCA62C1D6;
+            t += ((a << 5) | (a >> 27)) + e + w[j];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for(i = 0; i < 20; i++)
+        digest[i] = (unsigned char)(h[i / 4] >> (24 - (i % 4) * 8));
+}
+
+/******************************************************************************
+Description.: base64 encoding
+Input Value.: * data...: bytes to encode
+              * len....: their number
+              * out....: receives the text, 4 * ((len + 2) / 3) + 1 bytes
+Return Value: -
+******************************************************************************/
+static void encodeBase64(const unsigned char *data, int len, char *out)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+    uint32_t v;
+
+    for(i = 0; i < len; i += 3) {
+        v = (uint32_t)data[i] << 16;
+        if(i + 1 < len) v |= (uint32_t)data[i + 1] << 8;
+        if(i + 2 < len) v |= data[i + 2];
+
+        *out++ = table[(v >> 18) & 0x3F];
+        *out++ = table[(v >> 12) & 0x3F];
+        *out++ = (i + 1 < len) ? table[(v >> 6) & 0x3F] : '=';
+        *out++ = (i + 2 < len) ? table[v & 0x3F] : '=';
+    }
+    *out = '\0';
+}
+
+/******************************************************************************
+Description.: send a single unfragmented message, the server never masks
+Input Value.: * ws.....: connection
+              * opcode.: type of the message
+              * head...: first part of the payload, may be NULL
+              * head_len: its length
+              * body...: second part of the payload, may be NULL
+              * body_len: its length
+Return Value: 0 if sent, -1 in case of an error
+******************************************************************************/
+static int websocket_send(websocket *ws, int opcode, const void *head, int head_len, const void *body, int body_len)
+{
+    unsigned char header[10];
+    struct iovec iov[3];
+    uint64_t len = (uint64_t)head_len + body_len;
+    int n = 0, hlen;
+
+    header[0] = 0x80 | opcode;
+    if(len < 126) {
+        header[1] = len;
+        hlen = 2;
+    } else if(len < 65536) {
+        header[1] = 126;
+        put_be(header + 2, len, 2);
+        hlen = 4;
+    } else {
+        header[1] = 127;
+        put_be(header + 2, len, 8);
+        hlen = 10;
+    }
+
+    iov[n].iov_base = header;
+    iov[n++].iov_len = hlen;
+    if(head_len > 0) {
+        iov[n].iov_base = (void *)head;
+        iov[n++].iov_len = head_len;
+    }
+    if(body_len > 0) {
+        iov[n].iov_base = (void *)body;
+        iov[n++].iov_len = body_len;
+    }
+
+    return send_iov(ws->context_fd->pc, ws->context_fd->fd, iov, n, 0);
+}
+
+/******************************************************************************
+Description.: send a close message with a status code
+Input Value.: * ws.....: connection
+              * code...: status code of the close message
+Return Value: -
+******************************************************************************/
+static void websocket_close(websocket *ws, int code)
+{
+    unsigned char payload[2];
+
+    put_be(payload, code, 2);
+    websocket_send(ws, WS_OP_CLOSE, payload, 2, NULL, 0);
+}
+
+/******************************************************************************
+Description.: Read what the client sent and process all complete messages.
+              Data messages count as acknowledgement of a picture, pings get
+              answered, a close message ends the connection.
+Input Value.: * ws.....: connection
+              * timeout: milliseconds to wait for data, 0 returns at once
+Return Value: 0 to continue, -1 if the connection has to be closed
+******************************************************************************/
+static int websocket_receive(websocket *ws, int timeout)
+{
+    struct pollfd pfd;
+    unsigned char *p, *mask;
+    uint64_t len;
+    int hlen, opcode, i;
+    ssize_t rc;
+
+    pfd.fd = ws->context_fd->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if((rc = poll(&pfd, 1, timeout)) < 0)
+        return (errno == EINTR) ? 0 : -1;
+    if(rc > 0) {
+        rc = read(ws->context_fd->fd, ws->in + ws->level, sizeof(ws->in) - ws->level);
+        if(rc <= 0)
+            return -1;
+        ws->level += rc;
+    }
+
+    while(ws->level >= 2) {
+        p = ws->in;
+        opcode = p[0] & 0x0F;
+
+        /* clients must mask what they send */
+        if(!(p[1] & 0x80)) {
+            websocket_close(ws, WS_CLOSE_PROTOCOL_ERROR);
+            return -1;
+        }
+
+        len = p[1] & 0x7F;
+        hlen = 2;
+        if(len == 126) {
+            if(ws->level < 4)
+                break;
+            len = (uint64_t)p[2] << 8 | p[3];
+            hlen = 4;
+        } else if(len == 127) {
+            len = WS_MESSAGE_MAX + 1;
+        }
+
+        if(len > WS_MESSAGE_MAX) {
+            websocket_close(ws, WS_CLOSE_TOO_BIG);
+            return -1;
+        }
+
+        if(ws->level < hlen + 4 + (int)len)
+            break;
+
+        mask = p + hlen;
+        p += hlen + 4;
+        for(i = 0; i < (int)len; i++)
+            p[i] ^= mask[i % 4];
+
+        switch(opcode) {
+        case WS_OP_CONTINUATION:
+        case WS_OP_TEXT:
+        case WS_OP_BINARY:
+            /* a message acknowledges one picture once it is complete */
+            if(ws->in[0] & 0x80)
+                ws->acked++;
+            break;
+        case WS_OP_PING:
+            if(websocket_send(ws, WS_OP_PONG, p, len, NULL, 0) < 0)
+                return -1;
+            break;
+        case WS_OP_PONG:
+            break;
+        case WS_OP_CLOSE:
+            /* echo the status code, then the connection is done */
+            websocket_send(ws, WS_OP_CLOSE, p, (len >= 2) ? 2 : 0, NULL, 0);
+            return -1;
+        default:
+            websocket_close(ws, WS_CLOSE_PROTOCOL_ERROR);
+            return -1;
+        }
+
+        ws->level -= hlen + 4 + len;
+        memmove(ws->in, ws->in + hlen + 4 + len, ws->level);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Answer the opening handshake of a WebSocket request
+Input Value.: * context_fd: connection of the client
+              * req....: the upgrade request
+Return Value: 0 if the connection speaks WebSocket now, -1 if an error was sent
+******************************************************************************/
+static int websocket_handshake(cfd *context_fd, request *req)
+{
+    unsigned char digest[20];
+    char key[SHA1_MESSAGE_MAX], accept[32], buffer[BUFFER_SIZE];
+    int len;
+
+    if(!req->http11 || req->upgrade == NULL || strcasestr(req->upgrade, "websocket") == NULL ||
+       req->connection == NULL || strcasestr(req->connection, "upgrade") == NULL ||
+       req->ws_key == NULL || strlen(req->ws_key) + strlen(WS_GUID) >= sizeof(key)) {
+        send_error(context_fd, 400, "WebSocket upgrade expected");
+        return -1;
+    }
+
+    if(req->ws_version == NULL || strcmp(req->ws_version, "13") != 0) {
+        send_error(context_fd, 426, "WebSocket version 13 required");
+        return -1;
+    }
+
+    snprintf(key, sizeof(key), "%s%s", req->ws_key, WS_GUID);
+    sha1((unsigned char *)key, strlen(key), digest);
+    encodeBase64(digest, sizeof(digest), accept);
+
+    len = snprintf(buffer, sizeof(buffer), "HTTP/1.1 101 Switching Protocols\r\n" \
+                   "Server: MJPG-Streamer/0.2\r\n" \
+                   "Upgrade: websocket\r\n" \
+                   "Connection: Upgrade\r\n" \
+                   "Sec-WebSocket-Accept: %s\r\n" \
+                   "\r\n", accept);
+
+    if(write(context_fd->fd, buffer, len) != len)
+        return -1;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Switch a connection to the WebSocket protocol and send the
+              frames of an input plugin as binary messages until the client
+              leaves or the server stops.
+Input Value.: * context_fd: connection of the client
+              * req....: the upgrade request, "window" sets the number of
+                         unacknowledged pictures
+              * iobuf..: buffer of the connection, may hold bytes the client
+                         sent after the request
+              * input_number: input plugin to stream from
+Return Value: -
+******************************************************************************/
+void send_websocket(cfd *context_fd, request *req, iobuffer *iobuf, int input_number)
+{
+    websocket ws;
+    frame *f = NULL;
+    unsigned long long seq = FRAME_SEQ_FRESH;
+    unsigned char header[WS_HEADER_SIZE];
+    stream_stats st;
+    char *value;
+    int window = WS_WINDOW, pending = 0, rest;
+    long long start;
+
+    if((value = request_param(req, "window")) != NULL) {
+        window = atoi(value);
+        if(window < 1)
+            window = 1;
+        if(window > WS_WINDOW_MAX)
+            window = WS_WINDOW_MAX;
+    }
+
+    if(websocket_handshake(context_fd, req) < 0)
+        return;
+
+    memset(&ws, 0, sizeof(ws));
+    ws.context_fd = context_fd;
+
+    /* the client may have sent its first messages together with the request */
+    rest = iobuf->level - iobuf->parsed;
+    if(rest > (int)sizeof(ws.in))
+        rest = sizeof(ws.in);
+    memcpy(ws.in, iobuf->buffer + iobuf->parsed, rest);
+    ws.level = rest;
+
+    DBG("WebSocket established, window of %d pictures\n", window);
+
+    stream_kick_timeout(context_fd->pc, context_fd->fd);
+    stream_stats_register(context_fd->pc, &st, context_fd->fd, input_number);
+
+    while(!context_fd->pc->pglobal->stop) {
+        /* take the acknowledgements, wait for one if the window is full */
+        if(websocket_receive(&ws, (pending < window) ? 0 : 1000) < 0)
+            break;
+        pending -= ws.acked;
+        if(pending < 0)
+            pending = 0;
+        ws.acked = 0;
+        if(pending >= window)
+            continue;
+
+        /* the newest frame after the last one sent, everything in between is skipped */
+        if((f = frame_ring_next(&context_fd->pc->pglobal->in[input_number], seq)) == NULL)
+            break;
+        seq = f->seq;
+        stream_stats_frame(&st, f);
+
+        #ifdef MANAGMENT
+        update_client_timestamp(context_fd->client);
+        #endif
+
+        header[0] = WS_HEADER_VERSION;
+        header[1] = input_number;
+        put_be(header + 2, WS_HEADER_SIZE, 2);
+        put_be(header + 4, f->seq, 8);
+        put_be(header + 12, frame_walltime(f), 8);
+
+        start = frame_clock();
+        if(websocket_send(&ws, WS_OP_BINARY, header, WS_HEADER_SIZE, f->buf, f->size) < 0)
+            break;
+        metrics_sent(&context_fd->pc->pglobal->out[context_fd->pc->id], f->size);
+        trace_send(context_fd->pc->id, f, start);
+        pending++;
+
+        frame_unref(f);
+        f = NULL;
+    }
+
+    if(context_fd->pc->pglobal->stop)
+        websocket_close(&ws, WS_CLOSE_GOING_AWAY);
+
+    frame_unref(f);
+    stream_stats_unregister(context_fd->pc, &st);
+}
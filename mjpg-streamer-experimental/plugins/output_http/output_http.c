@@ -64,6 +64,20 @@ void help(void)
 	    " [-l ] --listen ]........: Listen on Hostname / IP\n" \
             " [-c | --credentials ]...: ask for \"username:password\" on connect\n" \
             " [-n | --nocommands ]....: disable execution of commands\n"
+            " [-e | --eventloops ]....: serve streams from this number of epoll\n" \
+            "                           threads instead of one thread per client\n"
+            " [-z | --zerocopy ]......: send stream frames with MSG_ZEROCOPY\n"
+            " [-k | --kick ]..........: drop stream clients that did not accept\n" \
+            "                           any data for this many seconds\n"
+            " [-f | --fresh ].........: snapshots wait for the next frame instead\n" \
+            "                           of sending the current one\n"
+            " [-ka | --keepalive ]....: seconds an idle HTTP/1.1 connection stays\n" \
+            "                           open, 0 closes after each answer (default 5)\n"
+            " [-b | --backlog ].......: length of the queue of connections waiting\n" \
+            "                           to be accepted (default 128)\n"
+            " [-a | --acceptors ].....: threads accepting connections, each with its\n" \
+            "                           own SO_REUSEPORT socket, 0 = one per CPU\n" \
+            "                           (default 1)\n"
             " ---------------------------------------------------------------\n");
 }
 
@@ -83,6 +97,13 @@ int output_init(output_parameter *param, int id)
     int  port;
     char *credentials, *www_folder, *hostname = NULL;
     char nocommands;
+    int workers = 0;
+    char zerocopy = 0;
+    int kick = 0;
+    char fresh = 0;
+    int keepalive = 5;
+    int backlog = 128;
+    int acceptors = 1;
 
     DBG("output #%02d\n", param->id);
 
@@ -115,6 +136,20 @@ int output_init(output_parameter *param, int id)
             {"www", required_argument, 0, 0},
             {"n", no_argument, 0, 0},
             {"nocommands", no_argument, 0, 0},
+            {"e", required_argument, 0, 0},
+            {"eventloops", required_argument, 0, 0},
+            {"z", no_argument, 0, 0},
+            {"zerocopy", no_argument, 0, 0},
+            {"k", required_argument, 0, 0},
+            {"kick", required_argument, 0, 0},
+            {"f", no_argument, 0, 0},
+            {"fresh", no_argument, 0, 0},
+            {"ka", required_argument, 0, 0},
+            {"keepalive", required_argument, 0, 0},
+            {"b", required_argument, 0, 0},
+            {"backlog", required_argument, 0, 0},
+            {"a", required_argument, 0, 0},
+            {"acceptors", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -175,6 +210,71 @@ int output_init(output_parameter *param, int id)
             DBG("case 10,11\n");
             nocommands = 1;
             break;
+
+            /* e, eventloops */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            workers = atoi(optarg);
+            if(workers < 0) {
+                help();
+                return 1;
+            }
+            break;
+
+            /* z, zerocopy */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            zerocopy = 1;
+            break;
+
+            /* k, kick */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            kick = atoi(optarg);
+            break;
+
+            /* f, fresh */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            fresh = 1;
+            break;
+
+            /* ka, keepalive */
+        case 20:
+        case 21:
+            DBG("case 20,21\n");
+            keepalive = atoi(optarg);
+            if(keepalive < 0) {
+                help();
+                return 1;
+            }
+            break;
+
+            /* b, backlog */
+        case 22:
+        case 23:
+            DBG("case 22,23\n");
+            backlog = atoi(optarg);
+            if(backlog < 1) {
+                help();
+                return 1;
+            }
+            break;
+
+            /* a, acceptors */
+        case 24:
+        case 25:
+            DBG("case 24,25\n");
+            acceptors = atoi(optarg);
+            if(acceptors < 0 || acceptors > MAX_ACCEPTORS) {
+                help();
+                return 1;
+            }
+            break;
         }
     }
 
@@ -185,12 +285,53 @@ int output_init(output_parameter *param, int id)
     servers[param->id].conf.credentials = credentials;
     servers[param->id].conf.www_folder = www_folder;
     servers[param->id].conf.nocommands = nocommands;
+    servers[param->id].conf.workers = workers;
+    servers[param->id].conf.zerocopy = zerocopy;
+    servers[param->id].conf.kick = kick;
+    servers[param->id].conf.fresh = fresh;
+    servers[param->id].conf.keepalive = keepalive;
+    servers[param->id].conf.backlog = backlog;
+    servers[param->id].conf.acceptors = acceptors;
+    memset(&servers[param->id].stats, 0, sizeof(send_stats));
+    pthread_mutex_init(&servers[param->id].streams_mutex, NULL);
+    servers[param->id].streams = NULL;
+    servers[param->id].loops = NULL;
+    servers[param->id].dispatchers = NULL;
+    pthread_mutex_init(&servers[param->id].snapshots_mutex, NULL);
+    memset(servers[param->id].snapshots, 0, sizeof(servers[param->id].snapshots));
+    pthread_mutex_init(&servers[param->id].files_mutex, NULL);
+    servers[param->id].files = NULL;
+    servers[param->id].acceptors = NULL;
+    servers[param->id].acceptor_count = 0;
 
     OPRINT("www-folder-path......: %s\n", (www_folder == NULL) ? "disabled" : www_folder);
     OPRINT("HTTP TCP port........: %d\n", ntohs(port));
     OPRINT("HTTP Listen Address..: %s\n", hostname);
     OPRINT("username:password....: %s\n", (credentials == NULL) ? "disabled" : credentials);
     OPRINT("commands.............: %s\n", (nocommands) ? "disabled" : "enabled");
+    if(workers > 0) {
+        OPRINT("stream event loops...: %d\n", workers);
+    } else {
+        OPRINT("stream event loops...: disabled\n");
+    }
+    OPRINT("zerocopy.............: %s\n", (zerocopy) ? "enabled" : "disabled");
+    if(kick > 0) {
+        OPRINT("kick stalled clients.: after %d s\n", kick);
+    } else {
+        OPRINT("kick stalled clients.: disabled\n");
+    }
+    OPRINT("snapshots............: %s\n", (fresh) ? "wait for next frame" : "current frame");
+    if(keepalive > 0) {
+        OPRINT("keep-alive timeout...: %d s\n", keepalive);
+    } else {
+        OPRINT("keep-alive...........: disabled\n");
+    }
+    OPRINT("listen backlog.......: %d\n", backlog);
+    if(acceptors > 0) {
+        OPRINT("acceptor threads.....: %d\n", acceptors);
+    } else {
+        OPRINT("acceptor threads.....: one per CPU\n");
+    }
 
     param->global->out[id].name = malloc((strlen(OUTPUT_PLUGIN_NAME) + 1) * sizeof(char));
     sprintf(param->global->out[id].name, OUTPUT_PLUGIN_NAME);
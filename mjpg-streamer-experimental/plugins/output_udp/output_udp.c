@@ -57,11 +57,13 @@
 
 static pthread_t worker;
 static globals *pglobal;
-static int fd, delay, max_frame_size;
+static int fd, delay;
 static char *folder = "/tmp";
-static unsigned char *frame = NULL;
+static frame *current = NULL;
 static char *command = NULL;
 static int input_number = 0;
+static int plugin_id = 0;
+static hook events = { .capacity = 64 };
 
 // UDP port
 static int port = 0;
@@ -80,6 +82,11 @@ void help(void)
             " [-f | --folder ]........: folder to save pictures\n" \
             " [-d | --delay ].........: delay after saving pictures in ms\n" \
             " [-c | --command ].......: execute command after saveing picture\n" \
+            " [-k | --hook ]..........: start this command once, it gets a line\n" \
+            "                           on stdin for every saved picture\n" \
+            " [-hook-json ]...........: the lines are JSON objects\n" \
+            " [-hook-queue ]..........: events waiting for the hook, further\n" \
+            "                           events are dropped (default 64)\n" \
             " [-p | --port ]..........: UDP port to listen for picture requests. UDP message is the filename to save\n\n" \
             " [-i | --input ].......: read frames from the specified input plugin (first input plugin between the arguments is the 0th)\n\n" \
             " ---------------------------------------------------------------\n");
@@ -102,9 +109,8 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    if(frame != NULL) {
-        free(frame);
-    }
+    frame_unref(current);
+    current = NULL;
     close(fd);
 }
 
@@ -116,9 +122,9 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int ok = 1, frame_size = 0, rc = 0;
+    int ok = 1, rc = 0;
+    long long start;
     char buffer1[1024] = {0};
-    unsigned char *tmp_framebuffer = NULL;
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
@@ -153,32 +159,12 @@ void *worker_thread(void *arg)
 
 
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
-
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-
-        /* check if buffer for frame is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
-
-            max_frame_size = frame_size + (1 << 16);
-            if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                LOG("not enough memory\n");
-                return NULL;
-            }
-
-            frame = tmp_framebuffer;
+        frame_unref(current);
+        if((current = frame_ring_next(&pglobal->in[input_number], FRAME_SEQ_FRESH)) == NULL) {
+            LOG("not enough memory\n");
+            return NULL;
         }
 
-        /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-
         /* only save a file if a name came in with the UDP message */
         if(strlen(udpbuffer) > 0) {
             DBG("writing file: %s\n", udpbuffer);
@@ -190,14 +176,20 @@ void *worker_thread(void *arg)
             }
 
             /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
+            start = frame_clock();
+            if(write(fd, current->buf, current->size) < 0) {
                 OPRINT("could not write to file %s\n", udpbuffer);
                 perror("write()");
                 close(fd);
                 return NULL;
             }
+            metrics_sent(&pglobal->out[plugin_id], current->size);
+            trace_send(plugin_id, current, start);
 
             close(fd);
+
+            if(events.command != NULL)
+                hook_event(&events, udpbuffer, current);
         }
 
         // send back client's message that came in udpbuffer
@@ -275,6 +267,10 @@ int output_init(output_parameter *param)
             {"port", required_argument, 0, 0},
             {"i", required_argument, 0, 0},
             {"input", required_argument, 0, 0},
+            {"k", required_argument, 0, 0},
+            {"hook", required_argument, 0, 0},
+            {"hook-json", no_argument, 0, 0},
+            {"hook-queue", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -333,10 +329,27 @@ int output_init(output_parameter *param)
             DBG("case 10,11\n");
             input_number = atoi(optarg);
             break;
+            /* k, hook */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            events.command = strdup(optarg);
+            break;
+            /* hook-json */
+        case 14:
+            DBG("case 14\n");
+            events.json = 1;
+            break;
+            /* hook-queue */
+        case 15:
+            DBG("case 15\n");
+            events.capacity = atoi(optarg);
+            break;
         }
     }
 
     pglobal = param->global;
+    plugin_id = param->id;
     if(!(input_number < pglobal->incnt)) {
         OPRINT("ERROR: the %d input_plugin number is too much only %d plugins loaded\n", input_number, pglobal->incnt);
         return 1;
@@ -345,6 +358,14 @@ int output_init(output_parameter *param)
     OPRINT("output folder.....: %s\n", folder);
     OPRINT("delay after save..: %d\n", delay);
     OPRINT("command...........: %s\n", (command == NULL) ? "disabled" : command);
+    if(events.command != NULL) {
+        OPRINT("hook..............: %s, %d events queued as %s\n", events.command, events.capacity, events.json ? "JSON" : "lines");
+        if(events.capacity < 1) {
+            OPRINT("ERROR: the hook queue must hold at least one event\n");
+            return 1;
+        }
+        events.out = &pglobal->out[plugin_id];
+    }
     if(port > 0) {
         OPRINT("UDP port..........: %d\n", port);
     } else {
@@ -362,6 +383,12 @@ int output_stop(int id)
 {
     DBG("will cancel worker thread\n");
     pthread_cancel(worker);
+
+    /* the hook gets the events queued so far */
+    if(events.command != NULL) {
+        hook_stop(&events);
+        events.command = NULL;
+    }
     return 0;
 }
 
@@ -373,6 +400,10 @@ Return Value: always 0
 int output_run(int id)
 {
     DBG("launching worker thread\n");
+    if(events.command != NULL && hook_start(&events) < 0) {
+        OPRINT("could not set up the hook\n");
+        events.command = NULL;
+    }
     pthread_create(&worker, 0, worker_thread, NULL);
     pthread_detach(worker);
     return 0;
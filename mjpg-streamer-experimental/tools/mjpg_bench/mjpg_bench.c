@@ -0,0 +1,744 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  mjpg_bench - load generator for output_http
+
+  Starts a number of simulated clients against a running server and reports
+  what each of them received:
+
+  * stream clients read "?action=stream" as fast as they can
+  * snapshot pollers fetch "?action=snapshot" over a persistent connection
+  * slow readers read the stream at a limited rate, like viewers on a bad
+    network link, the server has to skip frames for them
+
+  The latency of a stream frame is the time between the X-Timestamp the
+  server sends along and its arrival, it is only meaningful if the input
+  plugin stamps the frames with the wall clock (input_file, input_http,
+  input_uvc with "-timestamp"). Snapshot latency is the time from request
+  to complete answer. Given the process id of the server, its CPU time and
+  memory are sampled as well.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+/* latency samples kept per client, later ones replace random earlier ones */
+#define MAX_SAMPLES 4096
+
+/* receive buffer of a client */
+#define BUFFER_SIZE (64*1024)
+
+typedef enum {
+    CLIENT_STREAM,
+    CLIENT_SNAPSHOT,
+    CLIENT_SLOW
+} client_type;
+
+static const char *client_names[] = { "stream", "snapshot", "slow" };
+
+/* configuration, set once by the options */
+typedef struct {
+    char *host;
+    char *port;
+    char *stream_path;
+    char *snapshot_path;
+    char *authorization;    /* base64 of "username:password" or NULL */
+    int streams;
+    int snapshots;
+    int slow;
+    int interval;           /* ms between two snapshots of a poller */
+    int rate;               /* bytes per second a slow reader accepts */
+    int duration;           /* seconds */
+    int pid;                /* server process to sample, 0 = none */
+} bench_config;
+
+/* state and results of one simulated client */
+typedef struct {
+    client_type type;
+    int id;
+    pthread_t thread;
+
+    int fd;
+    char buf[BUFFER_SIZE];
+    int start, end;         /* unread bytes of buf */
+    long long received;     /* bytes read from the socket */
+    struct timespec begin;  /* when the slow reader started reading */
+
+    unsigned long long frames;
+    unsigned long long bytes;
+    unsigned long long errors;
+    double latency[MAX_SAMPLES];    /* ms */
+    int samples;
+    unsigned long long seen;        /* latencies measured, samples is limited */
+    unsigned int seed;
+} bench_client;
+
+static bench_config conf;
+static volatile int stop = 0;
+
+/******************************************************************************
+Description.: print a help message
+Input Value.: name of the program
+Return Value: -
+******************************************************************************/
+static void help(char *progname)
+{
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+    fprintf(stderr, "Usage: %s [options]\n" \
+            " [-H | --host ]........: server to connect to (default 127.0.0.1)\n" \
+            " [-p | --port ]........: TCP port of the server (default 8080)\n" \
+            " [-s | --streams ].....: number of stream clients (default 10)\n" \
+            " [-n | --snapshots ]...: number of snapshot pollers (default 0)\n" \
+            " [-w | --slow ]........: number of slow stream readers (default 0)\n" \
+            " [-i | --interval ]....: ms between the snapshots of a poller (default 100)\n" \
+            " [-r | --rate ]........: bytes per second of a slow reader (default 65536)\n" \
+            " [-d | --duration ]....: seconds to run (default 10)\n" \
+            " [-u | --stream-path ].: path of the stream (default /?action=stream)\n" \
+            " [-g | --snapshot-path ]: path of a snapshot (default /?action=snapshot)\n" \
+            " [-c | --credentials ].: \"username:password\" to authenticate with\n" \
+            " [-P | --pid ].........: process id of the server to sample CPU and memory\n" \
+            " [-h | --help ]........: display this help\n", progname);
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+    fprintf(stderr, "Example:\n" \
+            "  mjpg_streamer -i \"input_file.so -f pictures -d 0.04\" -o output_http.so &\n" \
+            "  %s -s 50 -n 5 -w 5 -d 30 -P $!\n", progname);
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+}
+
+/******************************************************************************
+Description.: base64 encoding, for the Authorization header
+Input Value.: text to encode
+Return Value: allocated string
+******************************************************************************/
+static char *encode_base64(const char *text)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *data = (const unsigned char *)text;
+    int i, len = strlen(text);
+    unsigned int v;
+    char *out, *p;
+
+    if((out = p = malloc(4 * ((len + 2) / 3) + 1)) == NULL)
+        return NULL;
+
+    for(i = 0; i < len; i += 3) {
+        v = data[i] << 16;
+        if(i + 1 < len) v |= data[i + 1] << 8;
+        if(i + 2 < len) v |= data[i + 2];
+
+        *p++ = table[(v >> 18) & 0x3F];
+        *p++ = table[(v >> 12) & 0x3F];
+        *p++ = (i + 1 < len) ? table[(v >> 6) & 0x3F] : '=';
+        *p++ = (i + 2 < len) ? table[v & 0x3F] : '=';
+    }
+    *p = '\0';
+
+    return out;
+}
+
+/******************************************************************************
+Description.: difference of two points in time
+Input Value.: start and end
+Return Value: milliseconds
+******************************************************************************/
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/******************************************************************************
+Description.: keep a latency sample, once the array is full every sample
+              replaces a random one so the array stays representative
+Input Value.: client and latency in ms
+Return Value: -
+******************************************************************************/
+static void client_sample(bench_client *c, double ms)
+{
+    unsigned long long n = c->seen++;
+
+    if(c->samples < MAX_SAMPLES) {
+        c->latency[c->samples++] = ms;
+    } else if((n = rand_r(&c->seed) % (n + 1)) < MAX_SAMPLES) {
+        c->latency[n] = ms;
+    }
+}
+
+/******************************************************************************
+Description.: connect to the server and send a GET request
+Input Value.: client and path to request
+Return Value: 0 if the request was sent, -1 in case of an error
+******************************************************************************/
+static int client_request(bench_client *c, const char *path)
+{
+    struct addrinfo hints, *aip, *p;
+    struct timeval tv = { 1, 0 };
+    char request[1024];
+    int len;
+
+    if(c->fd < 0) {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if(getaddrinfo(conf.host, conf.port, &hints, &aip) != 0)
+            return -1;
+
+        for(p = aip; p != NULL; p = p->ai_next) {
+            if((c->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+                continue;
+            if(connect(c->fd, p->ai_addr, p->ai_addrlen) == 0)
+                break;
+            close(c->fd);
+            c->fd = -1;
+        }
+        freeaddrinfo(aip);
+
+        if(c->fd < 0)
+            return -1;
+
+        /* a blocked read has to notice the end of the benchmark */
+        setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        /* a slow reader must not get the data buffered by its own socket */
+        if(c->type == CLIENT_SLOW) {
+            len = 4096;
+            setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &len, sizeof(len));
+            clock_gettime(CLOCK_MONOTONIC, &c->begin);
+        }
+
+        c->start = c->end = 0;
+    }
+
+    len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\n" \
+                   "Host: %s\r\n" \
+                   "User-Agent: mjpg_bench\r\n" \
+                   "%s%s%s" \
+                   "\r\n", path, conf.host,
+                   (conf.authorization != NULL) ? "Authorization: Basic " : "",
+                   (conf.authorization != NULL) ? conf.authorization : "",
+                   (conf.authorization != NULL) ? "\r\n" : "");
+
+    if(write(c->fd, request, len) != len)
+        return -1;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: close the connection of a client
+Input Value.: client
+Return Value: -
+******************************************************************************/
+static void client_close(bench_client *c)
+{
+    if(c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
+
+/******************************************************************************
+Description.: read more data into the buffer of a client, a slow reader waits
+              until its rate allows it
+Input Value.: client
+Return Value: number of bytes read, -1 if the connection is gone or the
+              benchmark is over
+******************************************************************************/
+static int client_fill(bench_client *c)
+{
+    struct timespec now;
+    int rc, want = BUFFER_SIZE - c->end;
+    double allowed;
+
+    if(c->start > 0) {
+        memmove(c->buf, c->buf + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+        want = BUFFER_SIZE - c->end;
+    }
+
+    if(c->type == CLIENT_SLOW) {
+        /* small reads, and only as many bytes as the rate allows by now */
+        while(!stop) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            allowed = elapsed_ms(&c->begin, &now) * conf.rate / 1000.0 - c->received;
+            if(allowed >= 1024)
+                break;
+            usleep(10 * 1000);
+        }
+        if(want > 4096)
+            want = 4096;
+    }
+
+    while(!stop) {
+        rc = read(c->fd, c->buf + c->end, want);
+        if(rc > 0) {
+            c->end += rc;
+            c->received += rc;
+            return rc;
+        }
+        if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            continue;
+        return -1;
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+Description.: read the header of an answer or of a part of the stream, up to
+              and including the empty line
+Input Value.: * c......: client
+              * length.: receives the Content-Length, -1 if there is none
+              * stamp..: receives X-Timestamp in seconds, 0 if there is none
+Return Value: status code for an answer, 0 for a part, -1 in case of an error
+******************************************************************************/
+static int client_header(bench_client *c, int *length, double *stamp)
+{
+    char *line, *eol;
+    int status = 0, empty = 1;
+
+    *length = -1;
+    *stamp = 0;
+
+    while(1) {
+        while((eol = memchr(c->buf + c->start, '\n', c->end - c->start)) == NULL) {
+            if(c->end - c->start == BUFFER_SIZE || client_fill(c) < 0)
+                return -1;
+        }
+
+        line = c->buf + c->start;
+        *eol = '\0';
+        if(eol > line && eol[-1] == '\r')
+            eol[-1] = '\0';
+        c->start = eol + 1 - c->buf;
+
+        /* boundaries and the line breaks around them are skipped */
+        if(*line == '\0') {
+            if(!empty)
+                return status;
+            continue;
+        }
+        if(strncmp(line, "--", 2) == 0)
+            continue;
+
+        empty = 0;
+        if(strncmp(line, "HTTP/", 5) == 0 && strchr(line, ' ') != NULL)
+            status = atoi(strchr(line, ' ') + 1);
+        else if(strncasecmp(line, "Content-Length:", 15) == 0)
+            *length = atoi(line + 15);
+        else if(strncasecmp(line, "X-Timestamp:", 12) == 0)
+            *stamp = atof(line + 12);
+    }
+}
+
+/******************************************************************************
+Description.: skip the body of an answer or part
+Input Value.: client and number of bytes
+Return Value: 0 if done, -1 in case of an error
+******************************************************************************/
+static int client_skip(bench_client *c, int length)
+{
+    int n;
+
+    while(length > 0) {
+        if(c->start == c->end && client_fill(c) < 0)
+            return -1;
+        n = c->end - c->start;
+        if(n > length)
+            n = length;
+        c->start += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: thread of a stream client or slow reader
+Input Value.: client
+Return Value: NULL
+******************************************************************************/
+static void *stream_thread(void *arg)
+{
+    bench_client *c = arg;
+    struct timeval now;
+    double stamp, ms;
+    int status, length;
+
+    while(!stop) {
+        if(client_request(c, conf.stream_path) < 0 ||
+           (status = client_header(c, &length, &stamp)) != 200) {
+            if(!stop)
+                c->errors++;
+            client_close(c);
+            sleep(1);
+            continue;
+        }
+
+        while(!stop) {
+            if(client_header(c, &length, &stamp) < 0 || length < 0 || client_skip(c, length) < 0)
+                break;
+
+            c->frames++;
+            c->bytes += length;
+
+            /* only plausible if the input uses the wall clock */
+            if(stamp > 0) {
+                gettimeofday(&now, NULL);
+                ms = (now.tv_sec - stamp) * 1000.0 + now.tv_usec / 1000.0;
+                if(ms >= 0 && ms < 60 * 1000)
+                    client_sample(c, ms);
+            }
+        }
+
+        if(!stop)
+            c->errors++;
+        client_close(c);
+    }
+
+    client_close(c);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: thread of a snapshot poller, it keeps its connection open as
+              long as the server allows
+Input Value.: client
+Return Value: NULL
+******************************************************************************/
+static void *snapshot_thread(void *arg)
+{
+    bench_client *c = arg;
+    struct timespec start, end;
+    double stamp, ms;
+    int status, length;
+
+    while(!stop) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if(client_request(c, conf.snapshot_path) < 0 ||
+           (status = client_header(c, &length, &stamp)) < 0 ||
+           length < 0 || client_skip(c, length) < 0) {
+            if(!stop)
+                c->errors++;
+            client_close(c);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ms = elapsed_ms(&start, &end);
+
+        if(status == 200) {
+            c->frames++;
+            c->bytes += length;
+            client_sample(c, ms);
+        } else {
+            c->errors++;
+        }
+
+        if(ms < conf.interval)
+            usleep((conf.interval - ms) * 1000);
+    }
+
+    client_close(c);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: compare function for qsort
+Input Value.: two doubles
+Return Value: <0, 0 or >0
+******************************************************************************/
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/******************************************************************************
+Description.: percentile of sorted values
+Input Value.: sorted array, its length and the percentile
+Return Value: value
+******************************************************************************/
+static double percentile(const double *values, int count, double p)
+{
+    int i;
+
+    if(count == 0)
+        return 0;
+
+    i = (int)(p / 100.0 * (count - 1) + 0.5);
+    return values[i];
+}
+
+/******************************************************************************
+Description.: read CPU time and resident memory of a process
+Input Value.: * pid....: process id
+              * cpu....: receives user + system time in seconds
+              * rss....: receives the resident set size in kB
+Return Value: 0 if OK, -1 if the process could not be read
+******************************************************************************/
+static int process_usage(int pid, double *cpu, long *rss)
+{
+    char path[64], line[256], *p;
+    unsigned long utime, stime;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if((fp = fopen(path, "r")) == NULL)
+        return -1;
+    p = fgets(line, sizeof(line), fp);
+    fclose(fp);
+
+    /* the command name may contain spaces, the fields follow its ")" */
+    if(p == NULL || (p = strrchr(line, ')')) == NULL ||
+       sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    *cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+    *rss = 0;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if((fp = fopen(path, "r")) == NULL)
+        return -1;
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        if(strncmp(line, "VmRSS:", 6) == 0)
+            *rss = atol(line + 6);
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: print the results of all clients and a summary per client type
+Input Value.: clients, their number and the measured time in seconds
+Return Value: -
+******************************************************************************/
+static void report(bench_client *clients, int count, double seconds)
+{
+    double *all, sorted[MAX_SAMPLES];
+    int i, t, n, total, active;
+    unsigned long long frames, bytes, errors;
+
+    printf("%-9s %4s %8s %8s %8s %8s %8s %8s %6s\n",
+           "client", "id", "frames", "fps", "MB/s", "p50 ms", "p90 ms", "p99 ms", "errors");
+
+    for(i = 0; i < count; i++) {
+        memcpy(sorted, clients[i].latency, clients[i].samples * sizeof(double));
+        qsort(sorted, clients[i].samples, sizeof(double), compare_double);
+
+        printf("%-9s %4d %8llu %8.1f %8.2f %8.1f %8.1f %8.1f %6llu\n",
+               client_names[clients[i].type], clients[i].id, clients[i].frames,
+               clients[i].frames / seconds, clients[i].bytes / seconds / (1024 * 1024),
+               percentile(sorted, clients[i].samples, 50),
+               percentile(sorted, clients[i].samples, 90),
+               percentile(sorted, clients[i].samples, 99),
+               clients[i].errors);
+    }
+
+    printf("\n%-9s %7s %10s %10s %8s %8s %8s %8s %6s\n",
+           "summary", "clients", "fps/client", "total fps", "MB/s", "p50 ms", "p90 ms", "p99 ms", "errors");
+
+    for(t = CLIENT_STREAM; t <= CLIENT_SLOW; t++) {
+        for(i = 0, n = 0, total = 0, active = 0; i < count; i++) {
+            if(clients[i].type == (client_type)t) {
+                total += clients[i].samples;
+                active++;
+            }
+        }
+        if(active == 0)
+            continue;
+
+        if((all = malloc((total + 1) * sizeof(double))) == NULL)
+            return;
+
+        frames = bytes = errors = 0;
+        for(i = 0; i < count; i++) {
+            if(clients[i].type != (client_type)t)
+                continue;
+            memcpy(all + n, clients[i].latency, clients[i].samples * sizeof(double));
+            n += clients[i].samples;
+            frames += clients[i].frames;
+            bytes += clients[i].bytes;
+            errors += clients[i].errors;
+        }
+        qsort(all, n, sizeof(double), compare_double);
+
+        printf("%-9s %7d %10.1f %10.1f %8.2f %8.1f %8.1f %8.1f %6llu\n",
+               client_names[t], active, frames / seconds / active, frames / seconds,
+               bytes / seconds / (1024 * 1024),
+               percentile(all, n, 50), percentile(all, n, 90), percentile(all, n, 99), errors);
+        free(all);
+    }
+}
+
+/******************************************************************************
+Description.: parse the options, run the clients for the configured time and
+              print the results
+Input Value.: command line
+Return Value: 0 if OK, 1 in case of an error
+******************************************************************************/
+int main(int argc, char *argv[])
+{
+    bench_client *clients;
+    struct timespec start, end;
+    struct rusage usage;
+    double seconds, cpu_start = 0, cpu_end = 0;
+    long rss_start = 0, rss_end = 0;
+    int i, count, server = 0;
+
+    conf.host = "127.0.0.1";
+    conf.port = "8080";
+    conf.stream_path = "/?action=stream";
+    conf.snapshot_path = "/?action=snapshot";
+    conf.authorization = NULL;
+    conf.streams = 10;
+    conf.snapshots = 0;
+    conf.slow = 0;
+    conf.interval = 100;
+    conf.rate = 64 * 1024;
+    conf.duration = 10;
+    conf.pid = 0;
+
+    while(1) {
+        int c;
+        static struct option long_options[] = {
+            {"help", no_argument, NULL, 'h'},
+            {"host", required_argument, NULL, 'H'},
+            {"port", required_argument, NULL, 'p'},
+            {"streams", required_argument, NULL, 's'},
+            {"snapshots", required_argument, NULL, 'n'},
+            {"slow", required_argument, NULL, 'w'},
+            {"interval", required_argument, NULL, 'i'},
+            {"rate", required_argument, NULL, 'r'},
+            {"duration", required_argument, NULL, 'd'},
+            {"stream-path", required_argument, NULL, 'u'},
+            {"snapshot-path", required_argument, NULL, 'g'},
+            {"credentials", required_argument, NULL, 'c'},
+            {"pid", required_argument, NULL, 'P'},
+            {NULL, 0, NULL, 0}
+        };
+
+        c = getopt_long(argc, argv, "hH:p:s:n:w:i:r:d:u:g:c:P:", long_options, NULL);
+
+        /* no more options to parse */
+        if(c == -1) break;
+
+        switch(c) {
+        case 'H': conf.host = optarg; break;
+        case 'p': conf.port = optarg; break;
+        case 's': conf.streams = atoi(optarg); break;
+        case 'n': conf.snapshots = atoi(optarg); break;
+        case 'w': conf.slow = atoi(optarg); break;
+        case 'i': conf.interval = atoi(optarg); break;
+        case 'r': conf.rate = atoi(optarg); break;
+        case 'd': conf.duration = atoi(optarg); break;
+        case 'u': conf.stream_path = optarg; break;
+        case 'g': conf.snapshot_path = optarg; break;
+        case 'c': conf.authorization = encode_base64(optarg); break;
+        case 'P': conf.pid = atoi(optarg); break;
+        case 'h': /* fall through */
+        default:
+            help(argv[0]);
+            return 1;
+        }
+    }
+
+    count = conf.streams + conf.snapshots + conf.slow;
+    if(count <= 0 || conf.duration <= 0 || conf.rate <= 0 || conf.interval < 0) {
+        help(argv[0]);
+        return 1;
+    }
+
+    if((clients = calloc(count, sizeof(bench_client))) == NULL) {
+        fprintf(stderr, "could not allocate memory for %d clients\n", count);
+        return 1;
+    }
+
+    for(i = 0; i < count; i++) {
+        clients[i].fd = -1;
+        clients[i].seed = i + 1;
+        if(i < conf.streams) {
+            clients[i].type = CLIENT_STREAM;
+            clients[i].id = i;
+        } else if(i < conf.streams + conf.snapshots) {
+            clients[i].type = CLIENT_SNAPSHOT;
+            clients[i].id = i - conf.streams;
+        } else {
+            clients[i].type = CLIENT_SLOW;
+            clients[i].id = i - conf.streams - conf.snapshots;
+        }
+    }
+
+    if(conf.pid > 0 && process_usage(conf.pid, &cpu_start, &rss_start) == 0)
+        server = 1;
+
+    printf("%d stream clients, %d snapshot pollers, %d slow readers against %s:%s for %d s\n\n",
+           conf.streams, conf.snapshots, conf.slow, conf.host, conf.port, conf.duration);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; i++) {
+        if(pthread_create(&clients[i].thread, NULL,
+                          (clients[i].type == CLIENT_SNAPSHOT) ? snapshot_thread : stream_thread,
+                          &clients[i]) != 0) {
+            fprintf(stderr, "could not start client thread %d\n", i);
+            return 1;
+        }
+    }
+
+    sleep(conf.duration);
+    stop = 1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for(i = 0; i < count; i++)
+        pthread_join(clients[i].thread, NULL);
+
+    seconds = elapsed_ms(&start, &end) / 1000.0;
+    report(clients, count, seconds);
+
+    getrusage(RUSAGE_SELF, &usage);
+    printf("\nbenchmark: %.1f%% CPU\n",
+           (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6) * 100.0 / seconds);
+
+    if(server && process_usage(conf.pid, &cpu_end, &rss_end) == 0) {
+        printf("server...: %.1f%% CPU, %.3f%% CPU per client, RSS %ld kB -> %ld kB\n",
+               (cpu_end - cpu_start) * 100.0 / seconds,
+               (cpu_end - cpu_start) * 100.0 / seconds / count,
+               rss_start, rss_end);
+    }
+
+    free(clients);
+    return 0;
+}
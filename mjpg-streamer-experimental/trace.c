@@ -0,0 +1,199 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mjpg_streamer.h"
+#include "trace.h"
+
+static int trace_every = 0;
+static unsigned int trace_next = 0;
+static trace_event events[TRACE_EVENTS];
+
+/* the events of an input plugin span from one stage to the next one */
+static const char *stage_names[FRAME_STAGES] = {
+    NULL,
+    "driver",       /* captured -> dequeued */
+    "encode",       /* dequeued -> encoded */
+    "publish"       /* encoded -> published */
+};
+
+/******************************************************************************
+Description.: enable tracing
+Input Value.: every n-th frame gets traced, 0 disables tracing
+Return Value: -
+******************************************************************************/
+void trace_init(int every)
+{
+    trace_every = (every > 0) ? every : 0;
+}
+
+/******************************************************************************
+Description.: tells whether tracing is enabled
+Input Value.: -
+Return Value: 1 if enabled, 0 if not
+******************************************************************************/
+int trace_enabled(void)
+{
+    return trace_every > 0;
+}
+
+/******************************************************************************
+Description.: tells whether a frame is one of the traced ones
+Input Value.: frame
+Return Value: 1 if it is traced, 0 if not
+******************************************************************************/
+int trace_sampled(frame *f)
+{
+    return trace_every > 0 && f != NULL && f->seq % trace_every == 0;
+}
+
+/******************************************************************************
+Description.: the earliest stage of a frame that is known
+Input Value.: frame
+Return Value: monotonic nanoseconds, 0 if no stage is known
+******************************************************************************/
+static long long frame_first_stamp(frame *f)
+{
+    int i;
+
+    for(i = 0; i < FRAME_STAGES; i++) {
+        if(f->stamp[i] != 0)
+            return f->stamp[i];
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: store an event in the ring, the oldest one gets overwritten.
+              Readers skip events that are written at the same time.
+Input Value.: name, plugin kind and number, frame and the time span
+Return Value: -
+******************************************************************************/
+static void trace_add(const char *name, int output, int plugin, frame *f, long long start, long long end)
+{
+    unsigned int n = __sync_fetch_and_add(&trace_next, 1);
+    trace_event *e = &events[n % TRACE_EVENTS];
+
+    e->generation = 0;
+    __sync_synchronize();
+
+    e->name = name;
+    e->output = output;
+    e->plugin = plugin;
+    e->seq = f->seq;
+    e->start = start;
+    e->end = end;
+    e->captured = frame_first_stamp(f);
+
+    __sync_synchronize();
+    e->generation = n + 1;
+}
+
+/******************************************************************************
+Description.: record the stages a frame passed in the input plugin, called
+              once it got published
+Input Value.: number of the input plugin and the frame
+Return Value: -
+******************************************************************************/
+void trace_frame(int input, frame *f)
+{
+    int i, prev = -1;
+
+    if(!trace_sampled(f))
+        return;
+
+    /* every stage that is known spans from the last known one */
+    for(i = 0; i < FRAME_STAGES; i++) {
+        if(f->stamp[i] == 0)
+            continue;
+        if(prev >= 0)
+            trace_add(stage_names[i], -1, input, f, f->stamp[prev], f->stamp[i]);
+        prev = i;
+    }
+}
+
+/******************************************************************************
+Description.: record that an output plugin sent a frame, called once the send
+              is complete
+Input Value.: * output.: number of the output plugin
+              * f......: frame that was sent
+              * start..: frame_clock() before sending started
+Return Value: -
+******************************************************************************/
+void trace_send(int output, frame *f, long long start)
+{
+    if(!trace_sampled(f))
+        return;
+
+    trace_add("send", output, output, f, start, frame_clock());
+}
+
+/******************************************************************************
+Description.: format the events of the ring in the Chrome trace format. The
+              inputs and outputs show up as processes, each plugin as a thread.
+Input Value.: buffer and its size, events that do not fit are left out
+Return Value: length of the text
+******************************************************************************/
+size_t trace_json(char *buffer, size_t size)
+{
+    unsigned int i, first, last;
+    trace_event e;
+    size_t len = 0;
+    int rc;
+
+    last = __sync_fetch_and_add(&trace_next, 0);
+    first = (last > TRACE_EVENTS) ? last - TRACE_EVENTS : 0;
+
+    rc = snprintf(buffer, size, "{\"traceEvents\":[\n"
+                  "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"inputs\"}},\n"
+                  "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"outputs\"}}");
+    if(rc < 0 || (size_t)rc >= size)
+        return 0;
+    len = rc;
+
+    for(i = first; i < last; i++) {
+        memcpy(&e, &events[i % TRACE_EVENTS], sizeof(e));
+        __sync_synchronize();
+
+        /* skip events that were rewritten while copying */
+        if(e.generation != i + 1 || events[i % TRACE_EVENTS].generation != i + 1)
+            continue;
+
+        rc = snprintf(buffer + len, size - len,
+                      ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                      "\"args\":{\"seq\":%llu,\"age_ms\":%.3f}}",
+                      e.name, (e.output < 0) ? 1 : 2, e.plugin, e.start / 1000.0, (e.end - e.start) / 1000.0,
+                      e.seq, (e.captured > 0) ? (e.end - e.captured) / 1000000.0 : 0.0);
+        if(rc < 0 || (size_t)rc >= size - len - 5)
+            break;
+        len += rc;
+    }
+
+    rc = snprintf(buffer + len, size - len, "\n]}\n");
+    if(rc > 0 && (size_t)rc < size - len)
+        len += rc;
+
+    return len;
+}
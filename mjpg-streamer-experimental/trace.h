@@ -0,0 +1,67 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+#include "frame.h"
+
+/*
+ * Latency tracing. Every n-th frame (n set with "--trace") leaves events in
+ * a ring buffer: one for each stage it passed in the input plugin and one
+ * for each time an output plugin sent it. The ring can be fetched in the
+ * Chrome trace format ("chrome://tracing" or https://ui.perfetto.dev).
+ */
+
+/* events kept, older ones are overwritten */
+#define TRACE_EVENTS 4096
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _trace_event trace_event;
+struct _trace_event {
+    unsigned int generation;    /* 0 while the event is written */
+    const char *name;
+    int output;                 /* -1 for events of the input plugin */
+    int plugin;                 /* number of the input or output plugin */
+    unsigned long long seq;     /* sequence number of the frame */
+    long long start;            /* monotonic nanoseconds */
+    long long end;
+    long long captured;         /* earliest known stamp of the frame */
+};
+
+void trace_init(int every);
+int trace_enabled(void);
+int trace_sampled(frame *f);
+void trace_frame(int input, frame *f);
+void trace_send(int output, frame *f, long long start);
+size_t trace_json(char *buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif